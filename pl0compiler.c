@@ -2,26 +2,93 @@
 // This program was made for Systems and Software.
 
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define MAX_SIZE 1000
-#define MAX_SYMBOL_TABLE_SIZE 500
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#define READ_CHUNK_SIZE 65536
+#define MAX_ARENAS 64
+#define IR_REGISTERS 8
+#define PEEPHOLE_RULES 5
+#define PHASES 3 // Lexing, parsing with code generation, and the peephole optimizer
+#define PIPELINE_RING 16384 // Tokens a pipelined compile holds at once, a power of two
 
 
+// A growable block of memory backing one of the compiler's tables. Capacity doubles whenever it
+// runs out and new space is zeroed. Every arena is registered in a pool on first use so that all
+// of them can be released in one step, and so the total reserved size can be tracked.
+typedef struct arena
+{
+    void *base; // Start of the memory; moves when the arena grows
+    size_t cap; // Bytes reserved
+    struct arena_pool *pool; // Pool the arena is registered in, NULL until it has memory
+} arena;
+
+typedef struct arena_pool
+{
+    arena *list[MAX_ARENAS]; // Every arena that has memory
+    int count; // Number of arenas in list
+    size_t bytes; // Bytes currently reserved by all arenas
+    size_t peak_bytes; // Most bytes ever reserved at once
+    jmp_buf *on_full; // Where to jump when memory runs out, NULL to report it and exit
+} arena_pool;
+
+typedef struct source_buf
+{
+    const char *data; // Read-only view of the whole source program
+    size_t size; // Number of bytes in data
+    int mapped; // 1 if data is mmap'd from the file, 0 if it was read into the heap
+} source_buf;
+
 typedef struct symbol
 {
     int kind; // const = 1, var = 2, proc = 3
-    char name[10]; // name up to 11 chars
+    const char *name; // name, points into the source program
+    int name_len; // length of name
+    int id; // interned identifier id of name
+    int shadow; // symbol this one hides while its scope is open, -1 if none
     int val; // number (ASCII value)
     int level; // L level
-    int addr; // M address
+    int addr; // M address, -1 for a procedure dead code elimination removed
     int mark; // to indicate unavailable or deleted
 } symbol;
 
+// Lookups go through per-identifier indexes instead of scanning the table. For each interned id,
+// newest is the most recently declared symbol of that name, newest_const the most recent const,
+// and visible the innermost var/proc in a scope that is still open. Var/proc symbols also sit on
+// a scope stack so that leaving a scope only touches that scope's own entries.
 typedef struct symbol_table
 {
-    symbol table[MAX_SYMBOL_TABLE_SIZE]; // Contains all symbols
+    symbol *table; // Contains all symbols
+    int *newest; // Per id: latest symbol with that name, -1 if none
+    int *newest_const; // Per id: latest const with that name, -1 if none
+    int *visible; // Per id: innermost unmarked var/proc with that name, -1 if none
+    int id_count; // Ids the three indexes above have room for
+    int *scope_stack; // Var/proc symbols of all open scopes
+    int *scope_start; // Per level: where its entries begin in scope_stack
+    int scope_size; // Number of entries in scope_stack
+    arena table_mem, newest_mem, newest_const_mem, visible_mem, scope_stack_mem, scope_start_mem;
     int size; // Table size
     int symIdx; // Symbol index
     int current_level; // Holds the current level
@@ -36,772 +103,4143 @@ typedef struct assembly
     int M; // Changes depending on OP
 } assembly;
 
+typedef struct vm_stats
+{
+    unsigned long long executed; // Instructions executed
+    double seconds; // Time spent running
+    long max_stack; // Most stack words held by activation records at once
+    size_t native_bytes; // Size of the machine code when run by the JIT, 0 in the VM
+} vm_stats;
+
+typedef struct pl0_compiler pl0_compiler;
+
+typedef struct peephole_rule
+{
+    const char *name; // Shown next to the hit count
+    int (*apply)(pl0_compiler *ctx, int i, const char *is_target); // Rewrites at code index i, returns 1 if it did
+} peephole_rule;
+
+// Register IR operations. Binary operations and ODD write d from operands a and b; the B*
+// branches jump to M when a compares to b that way, BRZ when a is 0 and BEVEN when a is even.
+enum
+{
+    IR_LOAD, IR_STORE,
+    IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_EQL, IR_NEQ, IR_LSS, IR_LEQ, IR_GTR, IR_GEQ, IR_ODD,
+    IR_BEQ, IR_BNE, IR_BLT, IR_BLE, IR_BGT, IR_BGE, IR_BRZ, IR_BEVEN, IR_JMP,
+    IR_CALL, IR_RET, IR_ENTER, IR_WRITE, IR_READ, IR_HALT, IR_FAIL
+};
+
+typedef struct ir_instr
+{
+    int op; // IR_ operation
+    int d; // Destination; the return PM/0 index for IR_CALL
+    int a, b; // Operands
+    unsigned char dk, ak, bk; // Whether d, a and b index the value file (0) or the current frame (1)
+    int L; // Level difference for loads, stores and calls
+    int M; // Variable offset, INC size, jump or call target, or PM/0 index for IR_FAIL
+} ir_instr;
+
+typedef struct ir_program
+{
+    ir_instr *code;
+    int count; // Number of IR instructions
+    int *start; // Per PM/0 index: IR index of the block starting there, -1 if none
+    int pm_count; // Number of PM/0 instructions lowered
+    int32_t *vals; // Initial value file: registers, spill slots, then constants
+    int value_count; // Entries in vals
+    int const_count; // Constants in vals
+    int spill_slots; // Spill slots in vals
+    int vreg_count; // Virtual registers before allocation
+    arena_pool *pool; // Backs the arenas below and run_ir()'s memory
+    arena code_mem, start_mem, vals_mem;
+} ir_program;
+
+#define OBJ_MAGIC 0x4f304d50u // "PM0O" read as a little-endian word
+#define OBJ_VERSION 1
+
+// Header at the start of an object file
+typedef struct obj_header
+{
+    uint32_t magic; // OBJ_MAGIC
+    uint32_t version; // OBJ_VERSION
+    uint32_t count; // Number of instructions
+    uint32_t entry; // Index of the first instruction to run, always 0 in version 1
+    uint32_t max_frame; // Largest INC operand, in stack words
+    uint32_t symbol_count; // Entries in the symbol section, 0 if there is none
+    uint32_t symbol_offset; // Byte offset of the symbol section, 0 if there is none
+    uint32_t reserved; // 0
+} obj_header;
+
+typedef struct obj_symbol
+{
+    int32_t kind, val, level, addr, mark; // As in symbol
+    char name[12]; // NUL-padded
+} obj_symbol;
+
+// An object file mapped into memory by load_object
+typedef struct pl0_object
+{
+    const obj_header *header;
+    const assembly *code; // header->count instructions
+    const obj_symbol *symbols; // header->symbol_count entries, NULL if there are none
+    void *map; // The whole file
+    size_t map_size;
+} pl0_object;
+
+// An on-disk cache of compiled programs, see cache_lookup()
+typedef struct pl0_cache
+{
+    const char *dir; // NULL when caching is off
+    size_t max_bytes; // Size the directory is trimmed to after each store
+} pl0_cache;
+
+#define CACHE_STAMP "pl0compiler " __DATE__ " " __TIME__ // A rebuilt compiler starts a new cache
+#define CACHE_DEFAULT_MAX ((size_t) 64 << 20)
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Artifacts that --emit selects, one bit each
+#define EMIT_SOURCE 1
+#define EMIT_LEXEMES 2
+#define EMIT_TOKENS 4
+#define EMIT_ASM 8
+#define EMIT_SYMTAB 16
+#define EMIT_OBJ 32
+#define EMIT_ALL 63
+#define EMIT_AST 64 // Only listed when asked for
+
+// Listings are collected in one buffer that is written out with a single write() whenever it
+// fills up, instead of going through a printf() per line
+typedef struct output
+{
+    int fd; // Where the buffer is written
+    int json; // 1 to write one JSON object instead of the text listings
+    int fields; // Members written to the JSON object so far
+    arena_pool *pool; // Backs tee
+    arena *tee_mem; // Keeps a copy of everything written when pool is set, for the cache
+    char *tee;
+    size_t teed; // Bytes in tee
+    size_t size; // Bytes waiting in buf
+    size_t written; // Bytes handed to the kernel so far
+    char buf[OUTPUT_BUFFER_SIZE];
+} output;
+
 typedef struct code_seg
 {
-    assembly code[MAX_SIZE]; // Contains all the assembly code
+    assembly *code; // Contains all the assembly code
+    arena mem; // Backs code
     int size; // Size of code_seg
     int cx; // Code index
 } code_seg;
 
+// Tokens are stored as parallel arrays. Lexemes are never copied; each token keeps a span into
+// the source program, and numbers are converted to their value while lexing.
+//
+// A pipelined compile lexes on a thread of its own while the parser runs. The arrays are then a
+// ring of PIPELINE_RING slots, token i living in slot i & mask: the lexer publishes how many
+// tokens it has made in produced, the parser publishes the first token it still needs in
+// consumed, and the lexer never gets a ring ahead of that. Only the atomics are shared; the
+// lexer alone writes the fields next to produced and the parser the ones next to consumed,
+// which are kept on cache lines of their own.
 typedef struct token_list
 {
-    char names[MAX_SIZE][MAX_SIZE]; // Holds a list of all named variables
-    int nums[MAX_SIZE]; // Holds a list of all numsym values
-    int num_count; // Stores number of numsym values
-    int tokens[MAX_SIZE]; // Holds a list of all token values
+    const char *src; // The source program the spans point into
+    size_t src_size; // Number of bytes in src
+    unsigned char *tokens; // Holds a list of all token values
+    uint32_t *offsets; // Offset of each lexeme in src
+    uint32_t *lengths; // Length of each lexeme
+    int *values; // Value of each numsym token
+    int capacity; // Number of tokens the arrays can hold
+    arena tokens_mem, offsets_mem, lengths_mem, values_mem;
+    int mask; // Slot of a token's index: PIPELINE_RING - 1 when pipelined, -1 (the index itself) if not
+    int ring; // 1 while a lexer thread is filling the ring
+    pthread_t lexer;
+    _Alignas(64) _Atomic int produced; // Tokens the lexer has published
+    _Atomic int done; // 1 once produced is final
+    int lexed; // Tokens made so far
+    int room; // Tokens the lexer may make before looking at consumed again
+    int lex_failed; // 1 if the lexer ran out of memory; read after it has been joined
+    _Alignas(64) _Atomic int consumed; // First token the parser still needs
+    int released; // Last value stored in consumed
     int token; // Holds the current token
     int current_index; // Holds index of the current token
     int next_index; // Holds index of the next token
-    int size; // Holds the size of the token_list
+    int size; // Holds the size of the token_list; when pipelined, the tokens received so far
 } token_list;
 
-symbol_table global_sym_table;
-code_seg global_code;
-token_list global_tkn_list;
-
-int addMultiDigitSymbol (char ogChars[], int index, int numNames);
-int addMultiCharSymbol (char ogChars[], int index, int numNames);
-int isKeyword (int index);
-int isComment (char ogChars[], int index);
-int get_next_token();
-int symbol_table_check();
-void error(int error_num);
-void emit(int OP, int L, int M);
-void program();
-void block();
-void const_declaration();
-int var_declaration();
-void procedure_declaration(int jmpaddr);
-void statement();
-void condition();
-void expression();
-void term();
-void factor();
+// Identifiers are interned while lexing so that the parser can compare names as integer ids.
+// Ids index into offsets/lengths, which give each name's first occurrence in the source.
+typedef struct intern_table
+{
+    int *slots; // Open-addressed hash table of ids, -1 marks an empty slot
+    int mask; // Number of slots - 1 (a power of two)
+    uint32_t *hashes; // Hash of each id's name
+    uint32_t *offsets; // Offset of each id's name in the source
+    uint32_t *lengths; // Length of each id's name
+    int size; // Number of interned identifiers
+    int capacity; // Number of ids the arrays can hold
+    arena slots_mem, hashes_mem, offsets_mem, lengths_mem;
+} intern_table;
+
+#define PROC_MAGIC 0x504d3050u // "P0MP" read as a little-endian word
+#define PROC_VERSION 1
 
-int main (int argc, char **argv) 
+// Procedure store file: a header, then the entries, code, symbols and externals arrays
+typedef struct proc_header
 {
-    char *inFile = argv[1];
-    
-    // Read in the file, giving feedback if the file doesn't exist and print out the contents
-    // of that given file
-    FILE *inPtr = fopen(inFile, "r");
-    if (inPtr == NULL)
-    {
-        printf("Error opening file\n"); 
-        return 0;
-    }
+    uint32_t magic; // PROC_MAGIC
+    uint32_t version; // PROC_VERSION
+    uint64_t stamp; // Hash of the compiler build and options the code was made with
+    uint32_t entry_count, code_count, symbol_count, external_count;
+} proc_header;
 
-    char ch;
-    int size = 0;
-    char ogChars[MAX_SIZE];
+// The code of one procedure's block, as it was emitted by the last compile that saw it
+typedef struct proc_entry
+{
+    uint64_t path; // Hash of the procedure's name and the names of the procedures around it
+    uint64_t span_hash; // Hash of the source of its block
+    uint32_t span_tokens; // Tokens in the block
+    uint32_t level; // Level the procedure is declared at
+    uint32_t start; // Code index the block started at, which its jumps are relative to
+    uint32_t code, code_count; // Its instructions in the code array, up to and including RTN
+    uint32_t symbol, symbol_count; // Symbols declared inside it, in the symbols array
+    uint32_t external, external_count; // Lookups that went outside it, in the externals array
+    uint32_t nested; // Entries just before this one that belong to procedures inside it
+    uint32_t kept; // In memory: 1 if code refers to the old store's code array. 0 on disk
+} proc_entry;
 
-    // Prints contents of the file as "SOURCE PROGRAM"
-    printf("Source Program:\n");
-    while ((ch = fgetc(inPtr)) != EOF) {
-        printf("%c", ch);
-        ogChars[size] = ch;
-        size++;
+typedef struct proc_symbol
+{
+    int32_t kind, val, level, addr, mark; // As in symbol
+    int32_t token; // Token of its name, counted from the start of the block
+} proc_symbol;
 
-        // Checks if the char array can fit the extra characters
-        if (size >= MAX_SIZE - 1) {
-            break;
-        }
-    }
-    printf("\n");
-    fclose(inPtr);
+// A name the block looked up that did not resolve to one of its own symbols, with what it
+// resolved to. The block's code is only valid while every such lookup still gives the same.
+typedef struct proc_external
+{
+    int32_t token; // Token of the name, counted from the start of the block
+    int32_t declare; // The lookup was made while declaring
+    int32_t found; // 0 if the name was not found
+    int32_t kind, val, level, addr, mark; // The symbol found; a procedure's addr may change
+} proc_external;
 
-    int tokens[MAX_SIZE];
-    int numTokens = 0;
-    int numNames = 0;
-    char currentChar = ' ';
-    global_tkn_list.num_count = 0;
-    
-    // This for loop is the main loop that iterates over the array of symbols
-    for (int i=0; i<size; i++)
-    {
-        // Accounts for whitespace to be ignored
-        currentChar = ogChars[i];
-        if (currentChar < 33)
-        {
-            continue;
-        }
+// A procedure whose block is being compiled
+typedef struct proc_frame
+{
+    uint64_t path;
+    int first; // First symbol declared inside it
+    int start; // Code index of its block
+    int token; // First token of its block
+    int entries; // New entries before it
+    int lookups; // Lookups recorded before it
+} proc_frame;
 
-        // Checks for numbers and symbols of any type
-        else if (currentChar > 32 && currentChar < 65)
-        {
-            // Check for Numbers
-            if (currentChar >= 48 && currentChar <= 57)
-            {
-                i = addMultiDigitSymbol(ogChars, i, numNames) - 1;
-                if (strlen(global_tkn_list.names[numNames]) < 6) {
-                    tokens[numTokens] = 3;
-                    global_tkn_list.nums[global_tkn_list.num_count] = atoi(global_tkn_list.names[numNames]);
-                    global_tkn_list.num_count++;
-                }
-                else
-                    tokens[numTokens] = 36;
-                numTokens++;
-                numNames++;
-                
-            }
+// A symbol_table_check() that resolved outside the innermost procedure being compiled
+typedef struct proc_lookup
+{
+    int token, declare, found;
+} proc_lookup;
 
-            // Check for Special Characters, Comments, and Invalid Symbols
-            else 
-            {
-                switch (currentChar)
-                {
-                case '+':
-                    tokens[numTokens] = 4;
-                    strcpy(global_tkn_list.names[numNames], "+");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '-':
-                    tokens[numTokens] = 5;
-                    strcpy(global_tkn_list.names[numNames], "-");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '*':
-                    tokens[numTokens] = 6;
-                    strcpy(global_tkn_list.names[numNames], "*");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '=':
-                    tokens[numTokens] = 9;
-                    strcpy(global_tkn_list.names[numNames], "=");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '(':
-                    tokens[numTokens] = 15;
-                    strcpy(global_tkn_list.names[numNames], "(");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case ')':
-                    tokens[numTokens] = 16;
-                    strcpy(global_tkn_list.names[numNames], ")");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case ',':
-                    tokens[numTokens] = 17;
-                    strcpy(global_tkn_list.names[numNames], ",");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '.':
-                    tokens[numTokens] = 19;
-                    strcpy(global_tkn_list.names[numNames], ".");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case ';':
-                    tokens[numTokens] = 18;
-                    strcpy(global_tkn_list.names[numNames], ";");
-                    numNames++;
-                    numTokens++;
-                    break;
-                    
-                case '/':
-                    if ((i + 1) <= size && ogChars[i+1] == 42)
-                    {
-                        i = isComment(ogChars, i + 1);
-                        break;
-                    }
-                    
-                    tokens[numTokens] = 7;
-                    strcpy(global_tkn_list.names[numNames], "/");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case ':':
-                    if ((i + 1) <= size && ogChars[i+1] == 61)
-                    {
-                        tokens[numTokens] = 20;
-                        strcpy(global_tkn_list.names[numNames], ":=");
-                        numNames++;
-                        numTokens++;
-                        i++;
-                        break;
-                    }
-                    
-                    tokens[numTokens] = 34;
-                    strcpy(global_tkn_list.names[numNames], ":");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '>':
-                    if ((i + 1) <= size && ogChars[i+1] == 61)
-                    {
-                        tokens[numTokens] = 14;
-                        strcpy(global_tkn_list.names[numNames], ">=");
-                        numNames++;
-                        numTokens++;
-                        i++;
-                        break;
-                    }
-                    
-                    tokens[numTokens] = 13;
-                    strcpy(global_tkn_list.names[numNames], ">");
-                    numNames++;
-                    numTokens++;
-                    break;
-                case '<':
-                    if ((i + 1) <= size && ogChars[i+1] == 62)
-                    {
-                        tokens[numTokens] = 10;
-                        strcpy(global_tkn_list.names[numNames], "<>");
-                        numNames++;
-                        numTokens++;
-                        i++;
-                        break;
-                    }
-                    else if ((i + 1) <= size && ogChars[i+1] == 61)
-                    {
-                        tokens[numTokens] = 12;
-                        strcpy(global_tkn_list.names[numNames], "<=");
-                        numNames++;
-                        numTokens++;
-                        i++;
-                        break;
-                    }
-                    
-                    tokens[numTokens] = 11;
-                    strcpy(global_tkn_list.names[numNames], "<");
-                    numNames++;
-                    numTokens++;
-                    break;
-                
-                default:
-                    tokens[numTokens] = 34;
-                    char tempStr[2];
-                    tempStr[0] = currentChar;
-                    tempStr[1] = '\0';
-                    strcpy(global_tkn_list.names[numNames], tempStr);
-                    numNames++;
-                    numTokens++;
-                }
-            }
-        }
+// Per-procedure incremental compilation. The procedures of the last compile are mapped from
+// their store file, and every procedure of this compile is collected into a new store.
+typedef struct proc_store
+{
+    int enabled;
+    uint64_t stamp;
+    const proc_header *old; // NULL if there is no usable store
+    const proc_entry *old_entries;
+    const assembly *old_code;
+    const proc_symbol *old_symbols;
+    const proc_external *old_externals;
+    void *map;
+    size_t map_size;
+    int *old_index; // Open-addressed table of old entries by path, -1 marks an empty slot
+    int old_mask;
+    proc_entry *entries; // The new store. Code that was reused stays in the old one
+    assembly *code;
+    proc_symbol *symbols;
+    proc_external *externals;
+    int entry_count, code_count, symbol_count, external_count;
+    int code_total; // Instructions of all entries, including the reused ones
+    proc_frame *frames;
+    int depth; // Procedures being compiled
+    proc_lookup *lookups;
+    int lookup_count;
+    int *seen; // Per name and lookup kind: last entry that listed it as external, for deduplication
+    int reused, recompiled; // Procedures of this compile
+    arena index_mem, entries_mem, code_mem, symbols_mem, externals_mem, frames_mem, lookups_mem, seen_mem, save_mem;
+} proc_store;
+
+// Counters of the work one compile did. They are kept all the time, since bumping a counter
+// costs less than testing whether anyone wants it.
+typedef struct pl0_stats
+{
+    unsigned long long tokens; // Tokens lexed
+    unsigned long long keyword_lookups; // Words looked up in the keyword table
+    unsigned long long intern_probes; // Slots of the identifier table compared while lexing
+    unsigned long long symbol_lookups; // Calls to symbol_table_check()
+    unsigned long long symbol_comparisons; // Candidate symbols those calls looked at
+    unsigned long long scopes_opened, scopes_closed;
+    unsigned long long instructions; // Instructions emitted, before the peephole pass
+    unsigned long long ast_nodes; // Syntax tree nodes built
+} pl0_stats;
+
+// A procedure of the main block, compiled by a worker of compile_parallel()
+typedef struct par_unit
+{
+    int first, end; // Its tokens, from "procedure" up to the one after its ";"
+    int ok; // 1 if it compiled without errors
+    int code, code_end; // Its instructions in the worker's code array
+    int symbol, symbol_end; // Its symbols in the worker's table, the heading first
+    int lookup, lookup_end; // Its lookups that went outside it, in the worker's procs.lookups
+    pl0_stats stats; // Work it took
+} par_unit;
+
+// A run of consecutive units and the worker context that compiles them
+typedef struct par_chunk
+{
+    pl0_compiler *main;
+    pl0_compiler *worker;
+    int first, end; // Its units
+    pthread_t thread;
+    int started; // 1 if thread runs it
+} par_chunk;
+
+typedef struct parallel_state
+{
+    int threads; // Threads to compile the procedures of the main block on, 0 or 1 for none
+    pl0_compiler *workers; // Contexts of the workers, aligned like a context has to be
+    int worker_count;
+    par_unit *units;
+    int unit_count;
+    par_chunk *chunks;
+    int outer; // Symbols declared before the first unit
+    int *heads; // Per unit: its heading's index in the context's table, once spliced
+    arena workers_mem, units_mem, chunks_mem, heads_mem;
+} parallel_state;
+
+#define AST_BLOCK 1 // sym: the procedure, -1 for the main block; M: its INC; a: body; b: procedures
+#define AST_ASSIGN 2 // sym, L, M: the variable; a: the value
+#define AST_CALL 3 // sym, L, M: the procedure
+#define AST_BEGIN 4 // a: first statement, the rest linked through next
+#define AST_IF 5 // a: condition; b: body
+#define AST_WHILE 6 // a: condition; b: body
+#define AST_READ 7 // sym, L, M: the variable
+#define AST_WRITE 8 // a: the value
+#define AST_NUMBER 9 // a: the value; sym: the constant it names, -1 for a literal
+#define AST_LOAD 10 // sym, L, M: the variable
+#define AST_NEGATE 11 // a: the operand
+#define AST_ODD 12 // a: the operand
+#define AST_BINARY 13 // op: OPR M of the operation or comparison; a, b: the operands
+
+// Node of the abstract syntax tree. Nodes refer to each other by index, -1 for none, since the
+// array moves as it grows.
+typedef struct ast_node
+{
+    unsigned char kind; // One of the AST_ kinds
+    unsigned char op; // OPR M of a binary node, 1 for a block whose code was reused
+    int a, b; // Children or value, as listed by kind
+    int next; // Next statement of a begin, or next procedure of a block
+    int sym; // Symbol the name resolved to
+    int L, M; // Level difference and address of that symbol, as seen from where it is used
+} ast_node;
+
+typedef struct ast_tree
+{
+    ast_node *nodes; // Bumped one node at a time and dropped all at once by resetting count
+    int count;
+    arena mem;
+    int keep; // 1 to keep the whole tree for list_ast()
+    int deferred; // 1 to generate the code from the whole tree once parsing is done, 0 to stream it
+    int root; // Main block when the whole tree is built, -1 if there is none
+    int parent; // Block whose procedures are being parsed when the whole tree is built, -1 if none
+    int result; // Node built by the last statement_body() or condition_body(), -1 if none
+    int stream; // 1 while the statements of a begin are generated as soon as they are parsed
+} ast_tree;
+
+#define INLINE_DEFAULT_LIMIT 12 // Largest body, in instructions, inlined without --inline
+#define INLINE_RECURSIVE 1 // Calls itself, an enclosing procedure or a procedure that may recurse
+#define INLINE_TOO_LARGE 2 // Its body is longer than the limit
+#define INLINE_NESTED 3 // Calls its own procedures, which need its frame
+
+// What the inliner made of one procedure
+typedef struct inline_proc
+{
+    int symbol; // The procedure's entry in the symbol table
+    int inc; // Index of its INC before inlining
+    int reason; // 0 if its body could be copied into callers, else one of the INLINE_ reasons
+    int frame; // Its INC M once the calls in it were inlined
+    int body, size; // Where its body starts in the new code and how many instructions it has
+    int calls; // Calls to it that were replaced by its body
+} inline_proc;
+
+// One error found while compiling
+typedef struct pl0_diagnostic
+{
+    int error; // Error number
+    int token; // Token it was found at, -1 at the end of the program
+    uint32_t offset; // Where that token starts in the source
+    int line, column; // The same position, counted from 1
+    char message[96]; // Text without the "Error: " prefix
+} pl0_diagnostic;
+
+// All the state of one compilation. Contexts share nothing, so a process can compile any number
+// of programs, one after another or at the same time on different threads. A context that is
+// compiled again keeps the memory its arenas already reserved.
+struct pl0_compiler
+{
+    symbol_table sym_table;
+    code_seg code;
+    token_list tkn_list;
+    intern_table interns;
+    arena_pool pool; // Backs every table of the context
+    arena_pool lex_pool; // Backs the intern table, which a pipelined compile fills on the lexer thread
+    int pipelined; // 1 to lex on a second thread while parsing, see token_list
+    int opt_level; // 0 turns off constant folding and the peephole optimizer
+    int inline_limit; // Largest procedure body the inliner copies into its callers, 0 for none
+    int syntax_only; // 1 to only check the program, generating no code
+    int streaming; // 1 to generate each statement's code as soon as it is parsed, not after parsing
+    int peephole_hits[PEEPHOLE_RULES]; // Rewrites made by each rule in peephole_rules
+    jmp_buf fail; // Where compiling stops after an error nothing can recover from
+    jmp_buf *recover; // Where error() resumes parsing, the innermost recovery point
+    int sync_index; // Token the last recovery stopped at; errors there are not reported again
+    pl0_diagnostic *diagnostics; // Every error found, in source order once compiling is done
+    int diagnostic_count;
+    arena diagnostics_mem;
+    proc_store procs; // Used once pl0_load_procedures() has been called
+    inline_proc *inlines; // Per procedure: what the inliner did with it
+    int inline_count;
+    arena inlines_mem;
+    double phase_seconds[PHASES]; // Time spent in each phase of the last compile
+    size_t phase_peak[PHASES]; // Peak arena bytes at the end of each phase
+    pl0_stats stats;
+    parallel_state par;
+    ast_tree ast;
+};
+
+// What pl0_compile() produced. The pointers refer to the context and stay valid until it is
+// compiled again or freed.
+typedef struct pl0_result
+{
+    int error; // Error number of the first diagnostic, 0 if the program compiled
+    int token; // Token the first error was found at, -1 if there is no error
+    const char *message; // Text of the first diagnostic without the "Error: " prefix, "" if none
+    const pl0_diagnostic *diagnostics; // All errors in source order
+    int diagnostic_count; // Number of entries in diagnostics
+    const assembly *code; // The generated code
+    int count; // Number of instructions in code
+    const symbol *symbols; // The symbol table
+    int symbol_count; // Number of entries in symbols
+    int inline_limit; // Body size the inliner went up to, 0 if it did not run
+    const inline_proc *inlines; // What it did with each procedure
+    int inline_count; // Number of entries in inlines
+    int inlined; // Calls it replaced
+    int tail_calls; // Recursive calls turned into jumps
+    int accumulated; // Those among them whose update of a variable goes through an accumulator
+    int removed; // Instructions the peephole optimizer removed
+    int unreachable; // Instructions dead code elimination removed, as code that cannot run
+    int unused; // Procedures among them that are never called
+    const int *peephole_hits; // Rewrites made by each rule in peephole_rules
+    int reused, recompiled; // Procedures taken from the procedure store or compiled again
+    const double *phase_seconds; // Time spent lexing, parsing and optimizing
+    const size_t *phase_peak; // Peak arena bytes at the end of each of those phases
+    const pl0_stats *stats; // What the compile did
+} pl0_result;
+
+extern const peephole_rule peephole_rules[PEEPHOLE_RULES];
 
-        // Checks for words of any kind
-        else if (currentChar > 64 && currentChar < 123)
+void pl0_init(pl0_compiler *ctx);
+int pl0_compile(pl0_compiler *ctx, const char *src, size_t len, pl0_result *out);
+void pl0_free(pl0_compiler *ctx);
+int pl0_load_procedures(pl0_compiler *ctx, const char *path);
+int pl0_save_procedures(pl0_compiler *ctx, const char *path);
+size_t pl0_peak_bytes(const pl0_compiler *ctx);
+const char *pl0_error_text(int error_num);
+void *arena_fit(arena_pool *pool, arena *a, size_t bytes);
+void arena_free(arena *a);
+void arena_free_all(arena_pool *pool);
+void reserve_symbol(pl0_compiler *ctx);
+int load_source(const char *path, source_buf *src);
+void free_source(source_buf *src);
+void lex(pl0_compiler *ctx, const char *src, size_t size);
+int start_lexer(pl0_compiler *ctx, const char *src, size_t size);
+int stop_lexer(pl0_compiler *ctx, int drain);
+void index_symbol(pl0_compiler *ctx);
+void open_scope(pl0_compiler *ctx);
+void close_scope(pl0_compiler *ctx);
+const char *lexeme(pl0_compiler *ctx, int index);
+int lexeme_len(pl0_compiler *ctx, int index);
+int get_next_token(pl0_compiler *ctx);
+void update_tokens(pl0_compiler *ctx, int index);
+int symbol_table_check(pl0_compiler *ctx);
+int note_lookup(pl0_compiler *ctx, int found);
+void report(pl0_compiler *ctx, int error_num, int index);
+_Noreturn void error(pl0_compiler *ctx, int error_num);
+void emit(pl0_compiler *ctx, int OP, int L, int M);
+void program(pl0_compiler *ctx);
+void block(pl0_compiler *ctx);
+void const_declaration(pl0_compiler *ctx);
+int var_declaration(pl0_compiler *ctx);
+void procedure_declaration(pl0_compiler *ctx);
+void compile_parallel(pl0_compiler *ctx);
+int statement(pl0_compiler *ctx);
+int condition(pl0_compiler *ctx);
+int expression(pl0_compiler *ctx);
+int term(pl0_compiler *ctx);
+int factor(pl0_compiler *ctx);
+int fold_expression(pl0_compiler *ctx, int n);
+void fold_statement(pl0_compiler *ctx, int n);
+void gen_program(pl0_compiler *ctx);
+void gen_statement(pl0_compiler *ctx, int n);
+void gen_expression(pl0_compiler *ctx, int n);
+int inline_procedures(pl0_compiler *ctx);
+int eliminate_tail_calls(pl0_compiler *ctx, int *accumulated);
+int peephole(pl0_compiler *ctx);
+int eliminate_dead_code(pl0_compiler *ctx, int *procedures);
+int run_vm(arena_pool *pool, const assembly *code, int count, vm_stats *stats);
+int run_jit(arena_pool *pool, const assembly *code, int count, vm_stats *stats);
+int lower_ir(arena_pool *pool, const assembly *code, int count, ir_program *ir);
+void dump_ir(const ir_program *ir);
+int run_ir(const ir_program *ir, const assembly *code, vm_stats *stats);
+void free_ir(ir_program *ir);
+void out_flush(output *o);
+void out_bytes(output *o, const char *p, size_t n);
+void out_char(output *o, char c);
+void out_str(output *o, const char *str);
+void out_int(output *o, long long value);
+void out_padded(output *o, const char *p, size_t n, size_t width);
+void out_json_str(output *o, const char *p, size_t n);
+void out_field(output *o, const char *name);
+void list_source(output *o, const char *src, size_t size);
+void list_lexemes(output *o, pl0_compiler *ctx);
+void list_tokens(output *o, pl0_compiler *ctx);
+void list_diagnostics(output *o, const pl0_result *result);
+void list_inlining(output *o, const pl0_result *result);
+void list_peephole(output *o, const pl0_result *result);
+void list_code(output *o, const assembly *code, int count);
+void list_ast(output *o, pl0_compiler *ctx);
+void list_symbols(output *o, const symbol *symbols, int count);
+void list_stats(output *o, const pl0_result *result, const double *seconds, unsigned long long bytes);
+int parse_emit(const char *list);
+void write_text_code(const char *path, const assembly *code, int count);
+int write_object(arena_pool *pool, const char *path, const assembly *code, int count,
+                 const symbol *symbols, int symbol_count);
+int load_object(const char *path, pl0_object *obj);
+int write_file(const char *path, const void *data, size_t size);
+double lap(struct timespec *mark);
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+int cache_lookup(const pl0_cache *cache, uint64_t key, source_buf *listing, pl0_object *obj);
+void cache_store(const pl0_cache *cache, arena_pool *pool, uint64_t key, const char *listing, size_t listing_size,
+                 const assembly *code, int count, const symbol *symbols, int symbol_count);
+void cache_report(const pl0_cache *cache, arena_pool *pool);
+void free_object(pl0_object *obj);
+int execute(arena_pool *pool, const assembly *code, int count, int run, int dump);
+int read_manifest(arena_pool *pool, const char *path, arena *inputs_mem, char ***inputs, int *count, arena *names_mem);
+int compile_batch(char **paths, int count, int jobs, int opt_level, int inline_limit, int text, int syntax_only,
+                  const pl0_cache *cache);
+int run_benchmarks(uint64_t seed, int opt_level, const char *filter, const char *json_path, const char *baseline_path);
+int write_benchmark_program(const char *name, uint64_t seed);
+
+int main (int argc, char **argv) 
+{
+    // Reads from standard input when no file (or "-") is given. With --run the compiled program
+    // is executed after the listings are printed; --jit runs it as native code instead and --ir
+    // on the register IR. --dump-ir prints the register IR. -O0 turns off constant folding and
+    // the optimizer; --inline N only inlines procedures of up to N instructions, 0 for none.
+    // The code is written to the object file elf.bin, or the file given with -o; --strip leaves
+    // out its symbol section and --text-elf also writes the old text listing elf.txt. --load
+    // runs an object file instead of compiling a program.
+    //
+    // --emit=source,lexemes,tokens,asm,symtab,obj picks what is printed and whether the object
+    // file is written (all of it by default), and --json prints it as one JSON object. "ast"
+    // in the list also prints the syntax tree, which is not part of the default.
+    // --syntax-only checks the program without generating code and prints only the outcome.
+    //
+    // --cache DIR reuses the code and listings of programs compiled before, keeping DIR under
+    // --cache-max megabytes (64 by default). --cache-stats prints what DIR holds.
+    // --incremental FILE keeps the code of each procedure in FILE and reuses it for procedures
+    // that did not change since the last compile; the cache is not used then.
+    //
+    // --bench runs the benchmark suite on generated programs, only the cases whose name contains
+    // --bench-filter S if given. --bench-json FILE saves the results and --bench-baseline FILE
+    // compares against saved ones. --generate CASE prints the program of a case instead. --seed N
+    // changes the programs generated.
+    //
+    // --stats adds the time of each phase and counters of the work done to the listings. The
+    // cache is not used then, as its replayed listings would not say what this run did.
+    // --pipeline lexes on a second thread while the parser runs, unless the lexeme or token
+    // table is listed, which needs every token at once. --threads N compiles the procedures of
+    // the main block on N threads. --stream generates each statement's code as soon as it is
+    // parsed instead of once the whole syntax tree is built, which holds less of the tree.
+    //
+    // Given several files, a --manifest file listing them or --jobs N, it compiles them all on
+    // N threads (one per core by default) and writes each one's code next to it instead.
+    char *inFile = "-";
+    char **inputs = NULL;
+    int input_count = 0;
+    arena inputs_mem = {0}, names_mem = {0};
+    char *manifest = NULL;
+    int jobs = -1;
+    char *outFile = "elf.bin";
+    char *loadFile = NULL;
+    int run = 0;
+    int dump = 0;
+    int strip = 0;
+    int text = 0;
+    int emit = EMIT_ALL;
+    int emit_given = 0;
+    int json = 0;
+    int syntax_only = 0;
+    pl0_cache cache = { .dir = NULL, .max_bytes = CACHE_DEFAULT_MAX };
+    int cache_stats = 0;
+    char *incremental = NULL;
+    int bench = 0;
+    char *bench_filter = NULL, *bench_json = NULL, *bench_baseline = NULL, *generate = NULL;
+    uint64_t seed = 1;
+    int stats = 0;
+    int pipeline = 0;
+    double stats_seconds[2] = { 0, 0 }; // Listing and writing the object file
+    struct timespec mark;
+    arena out_mem = {0}, tee_mem = {0};
+    pl0_compiler ctx;
+    pl0_init(&ctx);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--run") == 0)
+            run = 1;
+        else if (strcmp(argv[i], "-O0") == 0)
+            ctx.opt_level = 0;
+        else if (strcmp(argv[i], "-O1") == 0)
+            ctx.opt_level = 1;
+        else if (strcmp(argv[i], "--inline") == 0 && i + 1 < argc)
+            ctx.inline_limit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jit") == 0)
+            run = 2;
+        else if (strcmp(argv[i], "--ir") == 0)
+            run = 3;
+        else if (strcmp(argv[i], "--dump-ir") == 0)
+            dump = 1;
+        else if (strcmp(argv[i], "--strip") == 0)
+            strip = 1;
+        else if (strcmp(argv[i], "--text-elf") == 0)
+            text = 1;
+        else if (strncmp(argv[i], "--emit=", 7) == 0)
         {
-                i = addMultiCharSymbol(ogChars, i, numNames) - 1;
-                if (strlen(global_tkn_list.names[numNames]) < 12)
-                    tokens[numTokens] = isKeyword(numNames);
-                else
-                    tokens[numTokens] = 35;
-                numTokens++;
-                numNames++;
+            emit = parse_emit(argv[i] + 7);
+            emit_given = 1;
+            if (emit < 0)
+            {
+                printf("Unknown --emit list %s\n", argv[i] + 7);
+                pl0_free(&ctx);
+                return 1;
+            }
         }
-
-        // Otherwise, the symbol is invalid and will throw a corresponding error in the Lexeme Table
+        else if (strcmp(argv[i], "--json") == 0)
+            json = 1;
+        else if (strcmp(argv[i], "--syntax-only") == 0)
+            syntax_only = 1;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cache.dir = argv[++i];
+        else if (strcmp(argv[i], "--cache-max") == 0 && i + 1 < argc)
+            cache.max_bytes = (size_t) strtoull(argv[++i], NULL, 10) << 20;
+        else if (strcmp(argv[i], "--cache-stats") == 0)
+            cache_stats = 1;
+        else if (strcmp(argv[i], "--incremental") == 0 && i + 1 < argc)
+            incremental = argv[++i];
+        else if (strcmp(argv[i], "--bench") == 0)
+            bench = 1;
+        else if (strcmp(argv[i], "--bench-filter") == 0 && i + 1 < argc)
+            bench_filter = argv[++i];
+        else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc)
+            bench_json = argv[++i];
+        else if (strcmp(argv[i], "--bench-baseline") == 0 && i + 1 < argc)
+            bench_baseline = argv[++i];
+        else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc)
+            generate = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = 1;
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            pipeline = 1;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            ctx.par.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stream") == 0)
+            ctx.streaming = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outFile = argv[++i];
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+            loadFile = argv[++i];
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc)
+            manifest = argv[++i];
         else
         {
-            tokens[numTokens] = 34;
-            char tempStr[2];
-            tempStr[0] = currentChar;
-            tempStr[1] = '\0';
-            strcpy(global_tkn_list.names[numNames], tempStr);
-            numNames++;
-            numTokens++;
+            inputs = arena_fit(&ctx.pool, &inputs_mem, (size_t) (input_count + 1) * sizeof(char *));
+            inputs[input_count++] = argv[i];
         }
-    }    
+    }
 
-    // Fills the global token list
-    for (int i=0; i<numTokens; i++){
-        global_tkn_list.tokens[i] = tokens[i];
+    if (bench || generate != NULL)
+    {
+        int status = bench ? run_benchmarks(seed, ctx.opt_level, bench_filter, bench_json, bench_baseline)
+                           : write_benchmark_program(generate, seed);
+        pl0_free(&ctx);
+        return status;
     }
-    global_tkn_list.size = numTokens;
 
-    // Prints out the lexeme table
-    printf("\nLexeme Table:\n\nlexeme\t\ttoken type\n");
-    for (int i=0; i<numNames; i++)
+    if (cache.dir != NULL)
     {
-        if (global_tkn_list.tokens[i] == 34)
-        {
-            printf("%-12s\tError: Symbol is invalid\n", global_tkn_list.names[i]);
-            exit(0);
-        }
-        else if (global_tkn_list.tokens[i] == 35)
+        mkdir(cache.dir, 0755);
+        if (cache_stats)
         {
-            printf("%-12s\tError: Name is too long\n", global_tkn_list.names[i]);
-            exit(0);
+            cache_report(&cache, &ctx.pool);
+            pl0_free(&ctx);
+            return 0;
         }
-        else if (global_tkn_list.tokens[i] == 36)
-        {
-            printf("%-12s\tError: Too many digits\n", global_tkn_list.names[i]);
-            exit(0);
-        }
-        else
-            printf("%-12s\t%d\n", global_tkn_list.names[i], global_tkn_list.tokens[i]);
     }
 
-    // Prints out the token list
-    printf("\nToken List:\n");
-    for (int i=0; i<numTokens; i++)
+    if (jobs >= 0 || manifest != NULL || input_count > 1)
     {
-        if (global_tkn_list.tokens[i] == 2 || global_tkn_list.tokens[i] == 3)
-        {
-            printf("%d %s ", global_tkn_list.tokens[i], global_tkn_list.names[i]);
-        }
-        else if (global_tkn_list.tokens[i] > 33)
+        if (manifest != NULL && read_manifest(&ctx.pool, manifest, &inputs_mem, &inputs, &input_count, &names_mem) != 0)
         {
-            continue;
+            printf("Error opening file\n");
+            pl0_free(&ctx);
+            return 1;
         }
-        else
-            printf("%d ", global_tkn_list.tokens[i]);
+        int status = compile_batch(inputs, input_count, jobs, ctx.opt_level, ctx.inline_limit, text, syntax_only, &cache);
+        pl0_free(&ctx);
+        return status;
     }
+    if (input_count > 0)
+        inFile = inputs[0];
 
-    // Calls the compiler
-    global_tkn_list.num_count = 0;
-    program();
-    printf("\n\nThis program is syntactically correct! Good job\n");
-
-    // Prints out Assembly Instructions to screen
-    printf("\nLine\tOP\tL\tM\n");
-    printf("0\tJMP\t0\t3\n");
-    for (int i=0; i<global_code.size + 1; i++){
-        switch(global_code.code[i].OP) {
-            case 1:
-                printf("%d\tLIT\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 2:
-                printf("%d\tOPR\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 3:
-                printf("%d\tLOD\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 4:
-                printf("%d\tSTO\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 5:
-                printf("%d\tCAL\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 6:
-                printf("%d\tINC\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 7:
-                printf("%d\tJMP\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 8:
-                printf("%d\tJPC\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 9:
-                printf("%d\tSYS\t%d\t%d\n", i, global_code.code[i].L, global_code.code[i].M);
-                break;
-        }
+    // Runs an object file straight from its mapping
+    if (loadFile != NULL)
+    {
+        pl0_object obj;
+        if (load_object(loadFile, &obj) != 0)
+            return 1;
+        printf("Object File: %s\n%u instructions, frames of up to %u words, %u symbols\n", loadFile,
+               obj.header->count, obj.header->max_frame, obj.header->symbol_count);
+        output *out = arena_fit(&ctx.pool, &out_mem, sizeof(output));
+        out->fd = STDOUT_FILENO;
+        list_code(out, obj.code, (int) obj.header->count);
+        out_flush(out);
+        int status = execute(&ctx.pool, obj.code, (int) obj.header->count, run, dump);
+        printf("\nPeak arena usage: %zu bytes\n", pl0_peak_bytes(&ctx));
+        free_object(&obj);
+        pl0_free(&ctx);
+        return status;
     }
-
-    // Prints out Assembly Instructions to screen
-    FILE *code_out;  
-    code_out = fopen("elf.txt", "w");
-    for (int i=0; i<global_code.size + 1; i++){
-        switch(global_code.code[i].OP) {
-            case 1:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 2:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 3:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 4:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 5:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 6:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 7:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 8:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-            case 9:
-                fprintf(code_out, "%d\t%d\t%d\n", global_code.code[i].OP, global_code.code[i].L, global_code.code[i].M);
-                break;
-        }
+    
+    // Load the whole file, giving feedback if the file doesn't exist, and print out the contents
+    // of that given file
+    source_buf source;
+    if (load_source(inFile, &source) != 0)
+    {
+        printf("Error opening file\n"); 
+        return 1;
     }
-    fclose(code_out);
 
-    printf("\nSymbol Table\n");
-    printf("Kind \t|Name \t|Value \t|Level \t|Address \t|Mark \n");
-    printf("-------------------------------------------------------\n");
-    for (int i=0; i<global_sym_table.size; i++){
-        if (global_sym_table.table[i].kind == 1) {
-        printf("%d \t|%s \t|%d \t|- \t|- \t\t|%d\n", global_sym_table.table[i].kind, 
-                    global_sym_table.table[i].name, 
-                    global_sym_table.table[i].val, 
-                    global_sym_table.table[i].mark);
+    const char *ogChars = source.data;
+
+    // Replays the listings and code of an earlier compile of the same program with the same
+    // options. A replay could not say what this run did, nor rebuild the procedure store.
+    uint64_t key = 0;
+    if (stats || incremental != NULL)
+        cache.dir = NULL;
+    if (cache.dir != NULL && !syntax_only)
+    {
+        // The JSON listing names the source and object files, so with --json both are part of the key
+        char options[512];
+        snprintf(options, sizeof options, "%s -O%d inline=%d emit=%d json=%d strip=%d", CACHE_STAMP,
+                 ctx.opt_level, ctx.inline_limit, emit, json, strip);
+        key = hash64(options, strlen(options), 0);
+        if (json)
+        {
+            key = hash64(inFile, strlen(inFile) + 1, key);
+            key = hash64(outFile, strlen(outFile) + 1, key);
         }
-        else {
-        printf("%d \t|%s \t|%d \t|%d \t|%d \t\t|%d\n", global_sym_table.table[i].kind, 
-                    global_sym_table.table[i].name, 
-                    global_sym_table.table[i].val, 
-                    global_sym_table.table[i].level, 
-                    global_sym_table.table[i].addr, 
-                    global_sym_table.table[i].mark);
+        key = hash64(ogChars, source.size, key);
+        source_buf listing;
+        pl0_object obj;
+        if (cache_lookup(&cache, key, &listing, &obj) == 0)
+        {
+            fwrite(listing.data, 1, listing.size, stdout);
+            if ((emit & EMIT_OBJ) && write_file(outFile, obj.map, obj.map_size) != 0)
+                printf("\nError writing %s\n", outFile);
+            if (text)
+                write_text_code("elf.txt", obj.code, (int) obj.header->count);
+            int status = execute(&ctx.pool, obj.code, (int) obj.header->count, run, dump);
+            if (!emit_given && !json)
+                printf("\nPeak arena usage: %zu bytes\n", pl0_peak_bytes(&ctx));
+            free_object(&obj);
+            free_source(&listing);
+            pl0_free(&ctx);
+            free_source(&source);
+            return status;
         }
     }
 
-    return 0;
-}
+    // Calls the compiler. The token list stays in the context for the listings below, even when
+    // compiling stopped at an error.
+    ctx.syntax_only = syntax_only;
+    ctx.pipelined = pipeline && !(emit & (EMIT_LEXEMES | EMIT_TOKENS));
+    ctx.ast.keep = (emit & EMIT_AST) && !syntax_only;
+    if (incremental != NULL)
+        pl0_load_procedures(&ctx, incremental);
+    pl0_result result;
+    pl0_compile(&ctx, ogChars, source.size, &result);
+    clock_gettime(CLOCK_MONOTONIC, &mark);
+    if (syntax_only)
+        emit = 0;
 
-// This function will add a multi-digit symbol to the name table and returns the new index so that
-// main won't reiterate over previous symbols
-int addMultiDigitSymbol (char ogChars[], int index, int numNames)
-{
-    if (isdigit(ogChars[index]))
+    output *out = arena_fit(&ctx.pool, &out_mem, sizeof(output));
+    out->fd = STDOUT_FILENO;
+    out->json = json;
+    if (cache.dir != NULL && result.error == 0 && !syntax_only)
     {
-        char tempStr[2];
-        tempStr[0] = ogChars[index];
-        tempStr[1] = '\0';
-        strcpy(global_tkn_list.names[numNames], strcat(global_tkn_list.names[numNames], tempStr));
-        index = addMultiDigitSymbol (ogChars, index + 1, numNames);
+        out->pool = &ctx.pool;
+        out->tee_mem = &tee_mem;
     }
-    return index;
-}
-
-// This function will add a multi-character symbol to the name table and returns the new index so that
-// main won't reiterate over previous symbols
-int addMultiCharSymbol (char ogChars[], int index, int numNames)
-{
-    if (isalnum(ogChars[index]))
+    if (json)
     {
-        char tempStr[2];
-        tempStr[0] = ogChars[index];
-        tempStr[1] = '\0';
-        strcpy(global_tkn_list.names[numNames], strcat(global_tkn_list.names[numNames], tempStr));
-        index = addMultiCharSymbol (ogChars, index + 1, numNames);
+        out_char(out, '{');
+        out_field(out, "file");
+        out_json_str(out, inFile, strlen(inFile));
+        out_field(out, "ok");
+        out_str(out, result.error == 0 ? "true" : "false");
     }
-    return index;
-}
+    if (emit & EMIT_SOURCE)
+        list_source(out, ogChars, source.size);
+    if (emit & EMIT_LEXEMES)
+        list_lexemes(out, &ctx);
+    if (emit & EMIT_TOKENS)
+        list_tokens(out, &ctx);
+    if (emit & EMIT_AST)
+        list_ast(out, &ctx);
+    list_diagnostics(out, &result);
 
-// This function determines if a given string is a keyword and will return the proper token value 
-// accordingly
-int isKeyword (int index)
-{
-    if (strcmp(global_tkn_list.names[index], "odd") == 0)
-    {
-        return 1;
-    }
-    else if (strcmp(global_tkn_list.names[index], "if") == 0)
-    {
-        return 23;
-    }
-    else if (strcmp(global_tkn_list.names[index], "become") == 0)
-    {
-        return 20;
-    }
-    else if (strcmp(global_tkn_list.names[index], "begin") == 0)
+    // Saves each syntax error in errorout<number>.txt
+    if (result.error != 0 || syntax_only)
     {
-        return 21;
-    }
-    else if (strcmp(global_tkn_list.names[index], "end") == 0)
-    {
-        return 22;
-    }
-    else if (strcmp(global_tkn_list.names[index], "then") == 0)
-    {
-        return 24;
+        for (int i = 0; i < result.diagnostic_count; i++)
+        {
+            const pl0_diagnostic *d = &result.diagnostics[i];
+            if (d->error > 33)
+                continue;
+            char name[32];
+            snprintf(name, sizeof name, "errorout%d.txt", d->error);
+            FILE *fptr = fopen(name, "w");
+            if (fptr != NULL)
+            {
+                fprintf(fptr, "Error: %s\n", pl0_error_text(d->error));
+                fclose(fptr);
+            }
+        }
+        if (stats)
+        {
+            stats_seconds[0] = lap(&mark);
+            list_stats(out, &result, stats_seconds, out->written + out->size);
+        }
+        if (json)
+            out_str(out, "}\n");
+        out_flush(out);
+        pl0_free(&ctx);
+        free_source(&source);
+        return result.error != 0;
     }
-    else if (strcmp(global_tkn_list.names[index], "while") == 0)
+
+    // Prints out Assembly Instructions, with the peephole optimizer's rewrites, and saves them
+    if (emit & EMIT_ASM)
     {
-        return 25;
+        if (result.inline_limit > 0)
+            list_inlining(out, &result);
+        if (ctx.opt_level > 0)
+            list_peephole(out, &result);
+        list_code(out, result.code, result.count);
     }
-    else if (strcmp(global_tkn_list.names[index], "do") == 0)
+    if (emit & EMIT_OBJ)
     {
-        return 26;
+        if (json)
+        {
+            out_field(out, "object");
+            out_json_str(out, outFile, strlen(outFile));
+        }
+        out_flush(out);
+        stats_seconds[0] += lap(&mark);
+        if (write_object(&ctx.pool, outFile, result.code, result.count, result.symbols, strip ? 0 : result.symbol_count) != 0)
+            printf("\nError writing %s\n", outFile);
+        stats_seconds[1] += lap(&mark);
     }
-    else if (strcmp(global_tkn_list.names[index], "call") == 0)
+    if (text)
     {
-        return 27;
+        out_flush(out);
+        stats_seconds[0] += lap(&mark);
+        write_text_code("elf.txt", result.code, result.count);
+        stats_seconds[1] += lap(&mark);
     }
-    else if (strcmp(global_tkn_list.names[index], "const") == 0)
+    if (emit & EMIT_SYMTAB)
+        list_symbols(out, result.symbols, result.symbol_count);
+    if (stats)
     {
-        return 28;
+        stats_seconds[0] += lap(&mark);
+        struct stat st;
+        unsigned long long bytes = out->written + out->size;
+        if ((emit & EMIT_OBJ) && stat(outFile, &st) == 0)
+            bytes += (unsigned long long) st.st_size;
+        list_stats(out, &result, stats_seconds, bytes);
     }
-    else if (strcmp(global_tkn_list.names[index], "var") == 0)
+    if (json && incremental != NULL)
     {
-        return 29;
+        out_field(out, "incremental");
+        out_str(out, "{\"reused\":");
+        out_int(out, result.reused);
+        out_str(out, ",\"recompiled\":");
+        out_int(out, result.recompiled);
+        out_char(out, '}');
     }
-    else if (strcmp(global_tkn_list.names[index], "procedure") == 0)
+    if (json)
+        out_str(out, "}\n");
+    out_flush(out);
+    if (out->pool != NULL)
+        cache_store(&cache, &ctx.pool, key, out->tee, out->teed, result.code, result.count, result.symbols,
+                    strip ? 0 : result.symbol_count);
+    if (incremental != NULL)
     {
-        return 30;
+        if (pl0_save_procedures(&ctx, incremental) != 0)
+            printf("\nError writing %s\n", incremental);
+        if (!json)
+            printf("\nIncremental compile: %d procedures reused, %d recompiled\n", result.reused, result.recompiled);
     }
-    else if (strcmp(global_tkn_list.names[index], "write") == 0)
+
+    int status = execute(&ctx.pool, result.code, result.count, run, dump);
+
+    if (!emit_given && !json)
+        printf("\nPeak arena usage: %zu bytes\n", pl0_peak_bytes(&ctx));
+
+    pl0_free(&ctx);
+    free_source(&source);
+    return status;
+}
+
+// Output
+//
+// Everything main() lists goes through an output buffer. Numbers are formatted by hand and
+// the text is copied straight into the buffer, which is only handed to the kernel when it is
+// full or the listings are done. Each list_ function writes one artifact, either as the text
+// listing or as a member of the JSON object the caller opened.
+
+// Hands n bytes to the kernel, keeping a copy in tee if there is one
+static void out_write(output *o, const char *p, size_t n)
+{
+    if (o->pool != NULL)
     {
-        return 31;
+        o->tee = arena_fit(o->pool, o->tee_mem, o->teed + n + 1);
+        memcpy(o->tee + o->teed, p, n);
+        o->teed += n;
     }
-    else if (strcmp(global_tkn_list.names[index], "read") == 0)
+    size_t done = 0;
+    while (done < n)
     {
-        return 32;
+        ssize_t w = write(o->fd, p + done, n - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            break;
+        done += (size_t) w;
     }
-    else
-        return 2;
+    o->written += done;
 }
 
-// This function will be called if a comment is recognized and will return the proper index
-// for main to iterate over as to ignore anything within a comment.
-int isComment (char ogChars[], int index)
+// Writes out what is in the buffer. Anything printf() left in stdout's buffer goes first, so
+// the two can be mixed.
+void out_flush(output *o)
 {
-    if (ogChars[index] != 47)
+    fflush(stdout);
+    out_write(o, o->buf, o->size);
+    o->size = 0;
+}
+
+void out_bytes(output *o, const char *p, size_t n)
+{
+    if (o->size + n > sizeof o->buf)
     {
-        index = isComment(ogChars, index + 1);
+        out_flush(o);
+        // Too large to be worth copying
+        if (n > sizeof o->buf)
+        {
+            out_write(o, p, n);
+            return;
+        }
     }
-    return index;
+    memcpy(o->buf + o->size, p, n);
+    o->size += n;
 }
 
-// Returns the index of the next token so long as the accessed index is valid
-int get_next_token(){
-    if (global_tkn_list.next_index < 0 || global_tkn_list.next_index >= global_tkn_list.size)
-        return -1;
-    return global_tkn_list.next_index;
+void out_char(output *o, char c)
+{
+    if (o->size == sizeof o->buf)
+        out_flush(o);
+    o->buf[o->size++] = c;
 }
 
-// Updates the token list so that it shifts to the next index 
-void update_tokens(int index){
-    global_tkn_list.current_index = index;
-    global_tkn_list.next_index = global_tkn_list.current_index + 1;
-    global_tkn_list.token = global_tkn_list.tokens[global_tkn_list.current_index];
+void out_str(output *o, const char *str)
+{
+    out_bytes(o, str, strlen(str));
 }
 
-// Checks if the symbol table contains the current token index name .
-// Returns the index if it is in the symbol table, returns -1 otherwise.
-int symbol_table_check(){
-    if (global_sym_table.declare == 1) {
-        for (int i=global_sym_table.size - 1; i>=0; i--){  
-            if (global_sym_table.table[i].kind == 1) {
-                if (strcmp(global_sym_table.table[i].name, global_tkn_list.names[global_tkn_list.current_index]) == 0)
-                    return i;
-            }
-            else {
-                if ((strcmp(global_sym_table.table[i].name, global_tkn_list.names[global_tkn_list.current_index]) == 0)) {
-                    if (global_sym_table.table[i].level == global_sym_table.current_level) {
-                        if (global_sym_table.table[i].mark == 0) {
-                            return i;
-                        }
-                    }
-                }
-            }
-        }
-    }
-    else {
-        for (int i=global_sym_table.size - 1; i>=0; i--){  
-            if (global_sym_table.table[i].kind == 1) {
-                if (strcmp(global_sym_table.table[i].name, global_tkn_list.names[global_tkn_list.current_index]) == 0)
-                    return i;
-            }
-            else {
-                if ((strcmp(global_sym_table.table[i].name, global_tkn_list.names[global_tkn_list.current_index]) == 0)) {
-                    if (global_sym_table.table[i].mark == 0) {
-                        return i;
-                    }                    
-                    if (global_sym_table.table[i].mark == 1) {
-                        error(20);
-                    }
-                }
-            }
-        }
-    }
-    return -1;
+void out_int(output *o, long long value)
+{
+    char digits[24];
+    int n = 0;
+    unsigned long long u = value < 0 ? 0 - (unsigned long long) value : (unsigned long long) value;
+    do {
+        digits[sizeof digits - 1 - n++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (value < 0)
+        digits[sizeof digits - 1 - n++] = '-';
+    out_bytes(o, digits + sizeof digits - n, (size_t) n);
 }
 
-// Based on a given error number, the corresponding error will be outputted to a text file.
-// Afterwards, the program will exit
-void error(int error_num){
-    FILE *fptr;
-    switch (error_num) {
-        case 1:
-            printf("Error: program must end with period\n"); 
-            fptr = fopen("errorout1.txt", "w");
-            fprintf(fptr, "Error: program must end with period\n");
-            fclose(fptr);
-            exit(0);
-        case 2:
-            printf("Error: const, var, procedure, and read keywords must be followed by identifier\n"); 
-            fptr = fopen("errorout2.txt", "w");
-            fprintf(fptr, "Error: const, var, procedure, and read keywords must be followed by identifier\n");
-            fclose(fptr);
-            exit(0);
-        case 3:
-            printf("Error: symbol name has already been declared\n"); 
-            fptr = fopen("errorout3.txt", "w");
-            fprintf(fptr, "Error: symbol name has already been declared\n");
-            fclose(fptr);
-            exit(0);
-        case 4:
-            printf("Error: constants must be assigned with =\n"); 
-            fptr = fopen("errorout4.txt", "w");
-            fprintf(fptr, "Error: constants must be assigned with =\n");
-            fclose(fptr);
-            exit(0);
-        case 5:
-            printf("Error: constants must be assigned an integer value\n"); 
-            fptr = fopen("errorout5.txt", "w");
-            fprintf(fptr, "Error: constants must be assigned an integer value\n");
-            fclose(fptr);
-            exit(0);
-        case 6:
-            printf("Error: constant, variable, and procedure declarations must be followed by a semicolon\n"); 
-            fptr = fopen("errorout6.txt", "w");
-            fprintf(fptr, "Error: constant, variable, and procedure declarations must be followed by a semicolon\n");
-            fclose(fptr);
-            exit(0);
-        case 7:
-            printf("Error: undeclared identifier %s\n", global_tkn_list.names[global_tkn_list.current_index]); 
-            fptr = fopen("errorout7.txt", "w");
-            fprintf(fptr, "Error: Error: undeclared identifier\n");
-            fclose(fptr);
-            exit(0);
-        case 8:
-            printf("Error: only variable values may be altered\n"); 
-            fptr = fopen("errorout8.txt", "w");
-            fprintf(fptr, "Error: only variable values may be altered\n");
-            fclose(fptr);
-            exit(0);
-        case 9:
-            printf("Error: assignment statements must use :=\n"); 
-            fptr = fopen("errorout9.txt", "w");
-            fprintf(fptr, "Error: assignment statements must use :=\n");
-            fclose(fptr);
-            exit(0);
-        case 10:
-            printf("Error: begin must be followed by end\n"); 
-            fptr = fopen("errorout10.txt", "w");
-            fprintf(fptr, "Error: begin must be followed by end\n");
-            fclose(fptr);
-            exit(0);
-        case 11:
-            printf("Error: if must be followed by then\n"); 
-            fptr = fopen("errorout11.txt", "w");
-            fprintf(fptr, "Error: if must be followed by then\n");
-            fclose(fptr);
-            exit(0);
-        case 12:
-            printf("Error: while must be followed by do\n"); 
-            fptr = fopen("errorout12.txt", "w");
-            fprintf(fptr, "Error: while must be followed by do\n");
-            fclose(fptr);
-            exit(0);
-        case 13:
-            printf("Error: condition must contain comparison operator\n"); 
-            fptr = fopen("errorout13.txt", "w");
-            fprintf(fptr, "Error: condition must contain comparison operator\n");
-            fclose(fptr);
-            exit(0);
-        case 14:
-            printf("Error: right parenthesis must follow left parenthesis\n"); 
-            fptr = fopen("errorout14.txt", "w");
-            fprintf(fptr, "Error: right parenthesis must follow left parenthesis\n");
-            fclose(fptr);
-            exit(0);
-        case 15:
-            printf("Error: arithmetic equations must contain operands, parentheses, numbers, or symbols\n"); 
-            fptr = fopen("errorout15.txt", "w");
-            fprintf(fptr, "Error: arithmetic equations must contain operands, parentheses, numbers, or symbols\n");
-            fclose(fptr);
-            exit(0);
-        case 16:
-            printf("Error: call must be followed by an identifier\n"); 
-            fptr = fopen("errorout16.txt", "w");
-            fprintf(fptr, "Error: call must be followed by an identifier\n");
-            fclose(fptr);
-            exit(0);
-        case 17:
-            printf("Error: variables and constants cannot be accessed using call\n"); 
-            fptr = fopen("errorout17.txt", "w");
-            fprintf(fptr, "Error: variables and constants cannot be accessed using call\n");
-            fclose(fptr);
-            exit(0);
-        case 18:
-            printf("Error: incorrect symbol during procedure declaration\n"); 
-            fptr = fopen("errorout18.txt", "w");
-            fprintf(fptr, "Error: incorrect symbol during procedure declaration\n");
-            fclose(fptr);
-            exit(0);
-        case 19:
-            printf("Error: procedure and const cannot be reassigned\n"); 
-            fptr = fopen("errorout19.txt", "w");
-            fprintf(fptr, "Error: procedure and const cannot be reassigned\n");
-            fclose(fptr);
-            exit(0);
-        case 20:
-            printf("Error: identifier is out of scope\n"); 
-            fptr = fopen("errorout20.txt", "w");
-            fprintf(fptr, "Error: identifier is out of scope\n");
-            fclose(fptr);
-            exit(0);
-        default:
-            printf("Error: unkown error type ???");
-            exit(0);
-    }
+// Writes the n bytes at p, then spaces up to width like printf's "%-*.*s"
+void out_padded(output *o, const char *p, size_t n, size_t width)
+{
+    out_bytes(o, p, n);
+    for (; n < width; n++)
+        out_char(o, ' ');
 }
 
-// Stores a new instruction to the assembly code array
-void emit(int OP, int L, int M) {
-    
-    if(global_code.cx > MAX_SIZE)
-        error(25);
-    else
+// Writes the n bytes at p as a JSON string
+void out_json_str(output *o, const char *p, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    out_char(o, '"');
+    size_t start = 0;
+    for (size_t i = 0; i < n; i++)
     {
-        global_code.code[global_code.cx].OP = OP; //opcode
-        global_code.code[global_code.cx].L = L; // lexicographical level
-        global_code.code[global_code.cx].M = M; // modifier
-        global_code.cx++;
-        global_code.size++;
+        unsigned char c = (unsigned char) p[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out_bytes(o, p + start, i - start);
+        start = i + 1;
+        out_char(o, '\\');
+        if (c == '"' || c == '\\')
+            out_char(o, (char) c);
+        else if (c == '\n')
+            out_char(o, 'n');
+        else if (c == '\t')
+            out_char(o, 't');
+        else if (c == '\r')
+            out_char(o, 'r');
+        else
+        {
+            out_str(o, "u00");
+            out_char(o, hex[c >> 4]);
+            out_char(o, hex[c & 15]);
+        }
     }
+    out_bytes(o, p + start, n - start);
+    out_char(o, '"');
 }
 
-void program(){
-    // BLOCK
-    // if token != periodsym
-    //      error
-    // emit HALT
+// Starts the next member of the JSON object
+void out_field(output *o, const char *name)
+{
+    if (o->fields++ > 0)
+        out_char(o, ',');
+    out_char(o, '"');
+    out_str(o, name);
+    out_str(o, "\":");
+}
 
-    update_tokens(0);
-    global_sym_table.size = 0;
-    global_code.cx = 1;
-    block();
-    if (global_tkn_list.token != 19)
-         error(1);
-    emit(9, 0, 3);
+void list_source(output *o, const char *src, size_t size)
+{
+    if (o->json)
+    {
+        out_field(o, "source");
+        out_json_str(o, src, size);
+        return;
+    }
+    out_str(o, "Source Program:\n");
+    out_bytes(o, src, size);
+    out_char(o, '\n');
 }
 
-void block(){
-    // CONST-DECLARATION
-    // numVars = VAR-DECLARATION
-    // emit INC (M = 3 + numVars)
-    // STATEMENT
-        global_sym_table.current_level++;
-    global_sym_table.declare = 1;
-    int jmpaddr = global_code.cx;
-    emit (7, 0, jmpaddr);
-    const_declaration();
-    int num_vars = var_declaration();
-    procedure_declaration(jmpaddr);
-    global_code.code[jmpaddr].M = (global_code.cx - 1) * 3;
-    emit(6, 0, 3 + num_vars);
-    global_sym_table.declare = 0;
-    statement();
-        for (int i=0; i<global_sym_table.size; i++) {
-            if (global_sym_table.table[i].level == global_sym_table.current_level)
-                global_sym_table.table[i].mark = 1;
-        }
-    global_sym_table.current_level--;
-}
-
-void const_declaration(){
-    // if (token == 28)
+// Lists every lexeme with its token, or the error that made it invalid
+void list_lexemes(output *o, pl0_compiler *ctx)
+{
+    if (o->json)
+    {
+        out_field(o, "lexemes");
+        out_char(o, '[');
+        for (int i = 0; i < ctx->tkn_list.size; i++)
+        {
+            int token = ctx->tkn_list.tokens[i];
+            out_str(o, i > 0 ? ",{\"lexeme\":" : "{\"lexeme\":");
+            out_json_str(o, lexeme(ctx, i), (size_t) lexeme_len(ctx, i));
+            out_str(o, ",\"offset\":");
+            out_int(o, ctx->tkn_list.offsets[i]);
+            out_str(o, token > 33 ? ",\"error\":" : ",\"token\":");
+            out_int(o, token);
+            out_char(o, '}');
+        }
+        out_char(o, ']');
+        return;
+    }
+    out_str(o, "\nLexeme Table:\n\nlexeme\t\ttoken type\n");
+    for (int i = 0; i < ctx->tkn_list.size; i++)
+    {
+        int token = ctx->tkn_list.tokens[i];
+        out_padded(o, lexeme(ctx, i), (size_t) lexeme_len(ctx, i), 12);
+        out_char(o, '\t');
+        if (token > 33)
+        {
+            out_str(o, "Error: ");
+            out_str(o, pl0_error_text(token));
+        }
+        else
+            out_int(o, token);
+        out_char(o, '\n');
+    }
+}
+
+// Lists the valid tokens, each identifier and number followed by its lexeme
+void list_tokens(output *o, pl0_compiler *ctx)
+{
+    int first = 1;
+    if (o->json)
+    {
+        out_field(o, "tokens");
+        out_char(o, '[');
+    }
+    else
+        out_str(o, "\nToken List:\n");
+    for (int i = 0; i < ctx->tkn_list.size; i++)
+    {
+        int token = ctx->tkn_list.tokens[i];
+        if (token > 33)
+            continue;
+        if (o->json)
+        {
+            if (!first)
+                out_char(o, ',');
+            out_int(o, token);
+        }
+        else
+        {
+            out_int(o, token);
+            out_char(o, ' ');
+            if (token == 2 || token == 3)
+            {
+                out_bytes(o, lexeme(ctx, i), (size_t) lexeme_len(ctx, i));
+                out_char(o, ' ');
+            }
+        }
+        first = 0;
+    }
+    out_char(o, o->json ? ']' : '\n');
+}
+
+// Lists every error with its line and column, or says that there were none
+void list_diagnostics(output *o, const pl0_result *result)
+{
+    if (o->json)
+    {
+        out_field(o, "diagnostics");
+        out_char(o, '[');
+        for (int i = 0; i < result->diagnostic_count; i++)
+        {
+            const pl0_diagnostic *d = &result->diagnostics[i];
+            out_str(o, i > 0 ? ",{\"error\":" : "{\"error\":");
+            out_int(o, d->error);
+            out_str(o, ",\"line\":");
+            out_int(o, d->line);
+            out_str(o, ",\"column\":");
+            out_int(o, d->column);
+            out_str(o, ",\"message\":");
+            out_json_str(o, d->message, strlen(d->message));
+            out_char(o, '}');
+        }
+        out_char(o, ']');
+        return;
+    }
+    if (result->error == 0)
+        out_str(o, "\nThis program is syntactically correct! Good job\n");
+    for (int i = 0; i < result->diagnostic_count; i++)
+    {
+        const pl0_diagnostic *d = &result->diagnostics[i];
+        out_str(o, "Error: ");
+        out_str(o, d->message);
+        out_str(o, " (line ");
+        out_int(o, d->line);
+        out_str(o, ", column ");
+        out_int(o, d->column);
+        out_str(o, ")\n");
+    }
+    if (result->error != 0 && result->diagnostic_count == 0)
+    {
+        out_str(o, "Error: ");
+        out_str(o, result->message);
+        out_char(o, '\n');
+    }
+}
+
+// Lists which procedures the inliner copied into their callers, and why it left the others
+void list_inlining(output *o, const pl0_result *result)
+{
+    static const char *reasons[] = { "", "may recurse", "too large", "calls its own procedures" };
+    if (o->json)
+    {
+        out_field(o, "inliner");
+        out_str(o, "{\"limit\":");
+        out_int(o, result->inline_limit);
+        out_str(o, ",\"inlined\":");
+        out_int(o, result->inlined);
+        out_str(o, ",\"procedures\":[");
+        for (int i = 0; i < result->inline_count; i++)
+        {
+            const inline_proc *p = &result->inlines[i];
+            const symbol *sym = &result->symbols[p->symbol];
+            out_str(o, i > 0 ? ",{\"name\":" : "{\"name\":");
+            out_json_str(o, sym->name, (size_t) sym->name_len);
+            out_str(o, ",\"size\":");
+            out_int(o, p->size);
+            out_str(o, ",\"calls\":");
+            out_int(o, p->calls);
+            if (p->reason != 0)
+            {
+                out_str(o, ",\"reason\":");
+                out_json_str(o, reasons[p->reason], strlen(reasons[p->reason]));
+            }
+            out_char(o, '}');
+        }
+        out_str(o, "]}");
+        return;
+    }
+    out_str(o, "\nInliner (bodies of up to ");
+    out_int(o, result->inline_limit);
+    out_str(o, " instructions):\n");
+    for (int i = 0; i < result->inline_count; i++)
+    {
+        const inline_proc *p = &result->inlines[i];
+        const symbol *sym = &result->symbols[p->symbol];
+        out_padded(o, sym->name, (size_t) sym->name_len, 26);
+        if (p->reason != 0)
+        {
+            out_str(o, "not inlined, ");
+            out_str(o, reasons[p->reason]);
+        }
+        else
+        {
+            out_str(o, "inlined at ");
+            out_int(o, p->calls);
+            out_str(o, p->calls == 1 ? " call" : " calls");
+        }
+        out_str(o, " (");
+        out_int(o, p->size);
+        out_str(o, p->size == 1 ? " instruction)\n" : " instructions)\n");
+    }
+    out_str(o, "Inlined ");
+    out_int(o, result->inlined);
+    out_str(o, result->inlined == 1 ? " call\n" : " calls\n");
+}
+
+// Lists the recursive calls turned into jumps, how often each peephole rewrite fired and what
+// dead code elimination removed
+void list_peephole(output *o, const pl0_result *result)
+{
+    if (o->json)
+    {
+        out_field(o, "tail_calls");
+        out_str(o, "{\"jumps\":");
+        out_int(o, result->tail_calls);
+        out_str(o, ",\"accumulated\":");
+        out_int(o, result->accumulated);
+        out_char(o, '}');
+        out_field(o, "peephole");
+        out_char(o, '{');
+        for (int i = 0; i < PEEPHOLE_RULES; i++)
+        {
+            out_json_str(o, peephole_rules[i].name, strlen(peephole_rules[i].name));
+            out_char(o, ':');
+            out_int(o, result->peephole_hits[i]);
+            out_char(o, ',');
+        }
+        out_str(o, "\"removed\":");
+        out_int(o, result->removed);
+        out_str(o, "},\"dead_code\":{\"removed\":");
+        out_int(o, result->unreachable);
+        out_str(o, ",\"procedures\":");
+        out_int(o, result->unused);
+        out_char(o, '}');
+        return;
+    }
+    out_str(o, "\nTail Calls:\nTurned ");
+    out_int(o, result->tail_calls);
+    out_str(o, result->tail_calls == 1 ? " recursive call into a jump, " : " recursive calls into jumps, ");
+    out_int(o, result->accumulated);
+    out_str(o, " through an accumulator\n");
+    out_str(o, "\nPeephole Optimizer:\n");
+    for (int i = 0; i < PEEPHOLE_RULES; i++)
+    {
+        out_padded(o, peephole_rules[i].name, strlen(peephole_rules[i].name), 26);
+        out_int(o, result->peephole_hits[i]);
+        out_char(o, '\n');
+    }
+    out_str(o, "Removed ");
+    out_int(o, result->removed);
+    out_str(o, " of ");
+    out_int(o, result->count + result->removed + result->unreachable);
+    out_str(o, " instructions\n");
+    out_str(o, "\nDead Code Elimination:\nRemoved ");
+    out_int(o, result->unreachable);
+    out_str(o, result->unreachable == 1 ? " instruction that cannot run, including " : " instructions that cannot run, including ");
+    out_int(o, result->unused);
+    out_str(o, result->unused == 1 ? " unused procedure\n" : " unused procedures\n");
+}
+
+// Lists the count instructions in code as assembly. Line 0 of the text listing stands for the
+// jump into the program that the machine starts with.
+void list_code(output *o, const assembly *code, int count)
+{
+    static const char *names[10] = { "", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS" };
+    if (o->json)
+    {
+        out_field(o, "asm");
+        out_char(o, '[');
+        for (int i = 0; i < count; i++)
+        {
+            int op = code[i].OP >= 1 && code[i].OP <= 9 ? code[i].OP : 0;
+            out_str(o, i > 0 ? ",{\"op\":\"" : "{\"op\":\"");
+            out_str(o, names[op]);
+            out_str(o, "\",\"l\":");
+            out_int(o, code[i].L);
+            out_str(o, ",\"m\":");
+            out_int(o, code[i].M);
+            out_char(o, '}');
+        }
+        out_char(o, ']');
+        return;
+    }
+    out_str(o, "\nLine\tOP\tL\tM\n0\tJMP\t0\t3\n");
+    for (int i = 0; i < count; i++)
+    {
+        if (code[i].OP < 1 || code[i].OP > 9)
+            continue;
+        out_int(o, i + 1);
+        out_char(o, '\t');
+        out_str(o, names[code[i].OP]);
+        out_char(o, '\t');
+        out_int(o, code[i].L);
+        out_char(o, '\t');
+        out_int(o, code[i].M);
+        out_char(o, '\n');
+    }
+}
+
+#define AST_MAX_INDENT 64 // Deeper nodes are indented no further, keeping the listing linear in size
+
+static void out_indent(output *o, int depth)
+{
+    for (int i = 0; i < depth && i < AST_MAX_INDENT; i++)
+        out_str(o, "  ");
+}
+
+// Writes the name of the symbol node refers to, followed by its level difference and address
+static void list_ast_name(output *o, pl0_compiler *ctx, const ast_node *node, int address)
+{
+    const symbol *s = node->sym >= 0 ? &ctx->sym_table.table[node->sym] : NULL;
+    if (o->json)
+    {
+        out_str(o, ",\"name\":");
+        if (s != NULL)
+            out_json_str(o, s->name, (size_t) s->name_len);
+        else
+            out_str(o, "null");
+        out_str(o, ",\"l\":");
+        out_int(o, node->L);
+        if (address)
+        {
+            out_str(o, ",\"m\":");
+            out_int(o, node->M);
+        }
+        return;
+    }
+    out_char(o, ' ');
+    if (s != NULL)
+        out_bytes(o, s->name, (size_t) s->name_len);
+    else
+        out_str(o, "main");
+    out_str(o, " (L ");
+    out_int(o, node->L);
+    if (address)
+    {
+        out_str(o, ", M ");
+        out_int(o, node->M);
+    }
+    out_char(o, ')');
+}
+
+// Writes node n and its children at depth
+static void list_ast_node(output *o, pl0_compiler *ctx, int n, int depth)
+{
+    static const char *kinds[14] = { "", "block", "assign", "call", "begin", "if", "while", "read", "write",
+                                     "number", "load", "negate", "odd", "binary" };
+    static const char *ops[12] = { "", "+", "-", "*", "/", "=", "<>", "<", "<=", ">", ">=", "odd" };
+    ast_node *nodes = ctx->ast.nodes;
+    if (n < 0)
+    {
+        if (o->json)
+            out_str(o, "null");
+        return;
+    }
+
+    // Binary chains are walked like gen_expression() walks them, left operands first
+    int up = -1;
+    while (nodes[n].kind == AST_BINARY)
+    {
+        if (o->json)
+        {
+            out_str(o, "{\"kind\":\"binary\",\"op\":\"");
+            out_str(o, ops[nodes[n].op]);
+            out_str(o, "\",\"left\":");
+        }
+        else
+        {
+            out_indent(o, depth);
+            out_str(o, ops[nodes[n].op]);
+            out_char(o, '\n');
+        }
+        depth++;
+        int down = nodes[n].a;
+        nodes[n].a = up;
+        up = n;
+        n = down;
+    }
+
+    const ast_node *node = &nodes[n];
+    if (o->json)
+    {
+        out_str(o, "{\"kind\":\"");
+        out_str(o, node->kind == AST_NUMBER && node->sym >= 0 ? "const" : kinds[node->kind]);
+        out_char(o, '"');
+    }
+    else
+    {
+        out_indent(o, depth);
+        out_str(o, node->kind == AST_NUMBER && node->sym >= 0 ? "const" : kinds[node->kind]);
+    }
+    switch (node->kind)
+    {
+    case AST_BLOCK:
+        if (o->json)
+        {
+            out_str(o, ",\"name\":");
+            if (node->sym >= 0)
+                out_json_str(o, ctx->sym_table.table[node->sym].name, (size_t) ctx->sym_table.table[node->sym].name_len);
+            else
+                out_str(o, "\"main\"");
+            if (node->op == 1)
+            {
+                out_str(o, ",\"reused\":true}");
+                break;
+            }
+            out_str(o, ",\"inc\":");
+            out_int(o, node->M);
+            out_str(o, ",\"procedures\":[");
+            for (int p = node->b; p >= 0; p = nodes[p].next)
+            {
+                if (p != node->b)
+                    out_char(o, ',');
+                list_ast_node(o, ctx, p, depth + 1);
+            }
+            out_str(o, "],\"body\":");
+            list_ast_node(o, ctx, node->a, depth + 1);
+            out_char(o, '}');
+            break;
+        }
+        out_char(o, ' ');
+        if (node->sym >= 0)
+            out_bytes(o, ctx->sym_table.table[node->sym].name, (size_t) ctx->sym_table.table[node->sym].name_len);
+        else
+            out_str(o, "main");
+        if (node->op == 1)
+        {
+            out_str(o, " (reused)\n");
+            break;
+        }
+        out_str(o, " (INC ");
+        out_int(o, node->M);
+        out_str(o, ")\n");
+        for (int p = node->b; p >= 0; p = nodes[p].next)
+            list_ast_node(o, ctx, p, depth + 1);
+        list_ast_node(o, ctx, node->a, depth + 1);
+        break;
+    case AST_BEGIN:
+        if (o->json)
+            out_str(o, ",\"statements\":[");
+        else
+            out_char(o, '\n');
+        for (int s = node->a; s >= 0; s = nodes[s].next)
+        {
+            if (o->json && s != node->a)
+                out_char(o, ',');
+            list_ast_node(o, ctx, s, depth + 1);
+        }
+        out_str(o, o->json ? "]}" : "");
+        break;
+    case AST_IF:
+    case AST_WHILE:
+        out_str(o, o->json ? ",\"condition\":" : "\n");
+        list_ast_node(o, ctx, node->a, depth + 1);
+        out_str(o, o->json ? ",\"body\":" : "");
+        list_ast_node(o, ctx, node->b, depth + 1);
+        out_str(o, o->json ? "}" : "");
+        break;
+    case AST_NUMBER:
+        if (node->sym >= 0 && o->json)
+        {
+            out_str(o, ",\"name\":");
+            out_json_str(o, ctx->sym_table.table[node->sym].name, (size_t) ctx->sym_table.table[node->sym].name_len);
+        }
+        else if (node->sym >= 0)
+        {
+            out_char(o, ' ');
+            out_bytes(o, ctx->sym_table.table[node->sym].name, (size_t) ctx->sym_table.table[node->sym].name_len);
+            out_str(o, " =");
+        }
+        out_str(o, o->json ? ",\"value\":" : " ");
+        out_int(o, node->a);
+        out_str(o, o->json ? "}" : "\n");
+        break;
+    case AST_ASSIGN:
+    case AST_WRITE:
+    case AST_NEGATE:
+    case AST_ODD:
+        if (node->kind == AST_ASSIGN)
+            list_ast_name(o, ctx, node, 1);
+        out_str(o, o->json ? (node->kind == AST_NEGATE || node->kind == AST_ODD ? ",\"operand\":" : ",\"value\":") : "\n");
+        list_ast_node(o, ctx, node->a, depth + 1);
+        out_str(o, o->json ? "}" : "");
+        break;
+    default: // Call, read and load
+        list_ast_name(o, ctx, node, node->kind != AST_CALL);
+        out_str(o, o->json ? "}" : "\n");
+        break;
+    }
+
+    while (up >= 0)
+    {
+        int next = nodes[up].a;
+        nodes[up].a = n;
+        n = up;
+        up = next;
+        if (o->json)
+            out_str(o, ",\"right\":");
+        list_ast_node(o, ctx, nodes[n].b, depth);
+        if (o->json)
+            out_char(o, '}');
+        depth--;
+    }
+}
+
+// Lists the syntax tree kept by the last compile of ctx, which needs ctx->ast.keep set. Constant
+// expressions are folded, and addresses are those the code was generated with, before the
+// peephole optimizer moved any code.
+void list_ast(output *o, pl0_compiler *ctx)
+{
+    if (o->json)
+        out_field(o, "ast");
+    else
+        out_str(o, "\nAbstract Syntax Tree:\n");
+    list_ast_node(o, ctx, ctx->ast.root, 0);
+}
+
+void list_symbols(output *o, const symbol *symbols, int count)
+{
+    if (o->json)
+    {
+        out_field(o, "symtab");
+        out_char(o, '[');
+        for (int i = 0; i < count; i++)
+        {
+            out_str(o, i > 0 ? ",{\"kind\":" : "{\"kind\":");
+            out_int(o, symbols[i].kind);
+            out_str(o, ",\"name\":");
+            out_json_str(o, symbols[i].name, (size_t) symbols[i].name_len);
+            out_str(o, ",\"value\":");
+            out_int(o, symbols[i].val);
+            out_str(o, ",\"level\":");
+            out_int(o, symbols[i].level);
+            out_str(o, ",\"address\":");
+            out_int(o, symbols[i].addr);
+            out_str(o, ",\"mark\":");
+            out_int(o, symbols[i].mark);
+            out_char(o, '}');
+        }
+        out_char(o, ']');
+        return;
+    }
+    out_str(o, "\nSymbol Table\nKind \t|Name \t|Value \t|Level \t|Address \t|Mark \n");
+    out_str(o, "-------------------------------------------------------\n");
+    for (int i = 0; i < count; i++)
+    {
+        out_int(o, symbols[i].kind);
+        out_str(o, " \t|");
+        out_bytes(o, symbols[i].name, (size_t) symbols[i].name_len);
+        out_str(o, " \t|");
+        out_int(o, symbols[i].val);
+        if (symbols[i].kind == 1)
+            out_str(o, " \t|- \t|- \t\t|");
+        else
+        {
+            out_str(o, " \t|");
+            out_int(o, symbols[i].level);
+            out_str(o, " \t|");
+            out_int(o, symbols[i].addr);
+            out_str(o, " \t\t|");
+        }
+        out_int(o, symbols[i].mark);
+        out_char(o, '\n');
+    }
+}
+
+// Lists the counters of a compile and the time of each phase: the compiler's own, then printing
+// the listings and writing the object file as given in seconds, with the bytes those wrote
+void list_stats(output *o, const pl0_result *result, const double *seconds, unsigned long long bytes)
+{
+    static const char *phases[PHASES + 2] = { "lex", "parse", "optimize", "listing", "object" };
+    const pl0_stats *st = result->stats;
+    const char *names[] = { "tokens", "keyword_lookups", "intern_probes", "symbol_lookups", "symbol_comparisons",
+                            "scopes_opened", "scopes_closed", "instructions", "ast_nodes", "bytes_written" };
+    unsigned long long values[] = { st->tokens, st->keyword_lookups, st->intern_probes, st->symbol_lookups,
+                                    st->symbol_comparisons, st->scopes_opened, st->scopes_closed, st->instructions, st->ast_nodes,
+                                    bytes };
+    char ms[32];
+    if (o->json)
+    {
+        out_field(o, "stats");
+        out_char(o, '{');
+        for (int i = 0; i < PHASES + 2; i++)
+        {
+            snprintf(ms, sizeof ms, "%.3f", (i < PHASES ? result->phase_seconds[i] : seconds[i - PHASES]) * 1e3);
+            out_str(o, i > 0 ? ",\"" : "\"");
+            out_str(o, phases[i]);
+            out_str(o, "_ms\":");
+            out_str(o, ms);
+        }
+        for (size_t i = 0; i < sizeof values / sizeof values[0]; i++)
+        {
+            out_str(o, ",\"");
+            out_str(o, names[i]);
+            out_str(o, "\":");
+            out_int(o, (long long) values[i]);
+        }
+        out_char(o, '}');
+        return;
+    }
+    out_str(o, "\nCompiler Statistics:\n");
+    for (int i = 0; i < PHASES + 2; i++)
+    {
+        snprintf(ms, sizeof ms, "%.3f ms\n", (i < PHASES ? result->phase_seconds[i] : seconds[i - PHASES]) * 1e3);
+        out_padded(o, phases[i], strlen(phases[i]), 20);
+        out_str(o, ms);
+    }
+    for (size_t i = 0; i < sizeof values / sizeof values[0]; i++)
+    {
+        out_padded(o, names[i], strlen(names[i]), 20);
+        out_int(o, (long long) values[i]);
+        out_char(o, '\n');
+    }
+}
+
+// Turns a comma-separated --emit list into EMIT_ bits. Returns -1 if it names something else.
+int parse_emit(const char *list)
+{
+    static const char *names[] = { "source", "lexemes", "tokens", "asm", "symtab", "obj", "ast" };
+    int emit = 0;
+    while (*list != '\0')
+    {
+        size_t n = strcspn(list, ",");
+        int k = 0;
+        while (k < 7 && (strlen(names[k]) != n || strncmp(list, names[k], n) != 0))
+            k++;
+        if (k == 7)
+            return -1;
+        emit |= 1 << k;
+        list += n;
+        if (*list == ',')
+            list++;
+    }
+    return emit;
+}
+
+// Writes the count instructions in code to path as text, one "OP L M" line each
+void write_text_code(const char *path, const assembly *code, int count)
+{
+    FILE *code_out = fopen(path, "w");
+    if (code_out == NULL)
+    {
+        printf("\nError writing %s\n", path);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        fprintf(code_out, "%d\t%d\t%d\n", code[i].OP, code[i].L, code[i].M);
+    fclose(code_out);
+}
+
+// Runs the count instructions in code on the engine picked by run (0 does not run them, 1 the
+// VM, 2 the JIT and 3 the register IR), printing the register IR first if dump is set.
+// Returns 0, or 1 if the program stopped with a runtime error.
+int execute(arena_pool *pool, const assembly *code, int count, int run, int dump)
+{
+    ir_program ir;
+    int lowered = -1;
+    if (run == 3 || dump)
+    {
+        lowered = lower_ir(pool, code, count, &ir);
+        if (lowered == 0 && dump)
+            dump_ir(&ir);
+        else if (lowered != 0)
+            printf("\nThis code cannot be lowered to the register IR\n");
+    }
+
+    int status = 0;
+    if (run)
+    {
+        vm_stats stats;
+        printf("\nProgram Output:\n");
+        status = -1;
+        if (run == 3 && lowered == 0)
+        {
+            status = run_ir(&ir, code, &stats);
+            printf("\nExecuted %llu IR instructions in %.3f ms (%.2f million instructions/sec)\n",
+                   stats.executed, stats.seconds * 1e3,
+                   stats.seconds > 0 ? (double) stats.executed / stats.seconds / 1e6 : 0.0);
+            printf("Stack peaked at %ld words\n", stats.max_stack);
+        }
+        if (run == 2)
+        {
+            status = run_jit(pool, code, count, &stats);
+            if (status >= 0)
+                printf("\nRan %zu bytes of native code in %.3f ms\n", stats.native_bytes, stats.seconds * 1e3);
+            else
+                printf("(JIT unavailable, using the virtual machine)\n");
+        }
+        if (status < 0)
+        {
+            status = run_vm(pool, code, count, &stats);
+            printf("\nExecuted %llu instructions in %.3f ms (%.2f million instructions/sec)\n",
+                   stats.executed, stats.seconds * 1e3,
+                   stats.seconds > 0 ? (double) stats.executed / stats.seconds / 1e6 : 0.0);
+            printf("Stack peaked at %ld words\n", stats.max_stack);
+        }
+    }
+
+    if (lowered == 0)
+        free_ir(&ir);
+    return status;
+}
+
+// Library interface
+//
+// A caller sets up a pl0_compiler with pl0_init(), compiles any number of programs with
+// pl0_compile() and releases everything with pl0_free(). Errors never leave the process: error()
+// records a diagnostic in the context and longjmps back to the statement or declaration it is
+// in, where parsing resumes, or into pl0_compile() when it cannot. pl0_compile() hands all of
+// them over in the pl0_result. Running out of memory ends compiling the same way, as error 25.
+
+// Prepares a context for its first compilation
+void pl0_init(pl0_compiler *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->opt_level = 1;
+    ctx->inline_limit = INLINE_DEFAULT_LIMIT;
+}
+
+// Puts the diagnostics in source order, keeping errors at the same place in the order they were
+// found, and works out their lines and columns in one pass over the source
+static void place_diagnostics(pl0_compiler *ctx)
+{
+    pl0_diagnostic *d = ctx->diagnostics;
+    for (int i = 1; i < ctx->diagnostic_count; i++)
+    {
+        pl0_diagnostic key = d[i];
+        int j = i - 1;
+        for (; j >= 0 && d[j].offset > key.offset; j--)
+            d[j + 1] = d[j];
+        d[j + 1] = key;
+    }
+    const char *src = ctx->tkn_list.src;
+    size_t pos = 0, line_start = 0;
+    int line = 1;
+    for (int i = 0; i < ctx->diagnostic_count; i++)
+    {
+        for (; pos < d[i].offset; pos++)
+        {
+            if (src[pos] == '\n')
+            {
+                line++;
+                line_start = pos + 1;
+            }
+        }
+        d[i].line = line;
+        d[i].column = (int) (d[i].offset - line_start) + 1;
+    }
+}
+
+// Returns the seconds since mark and moves mark to now
+double lap(struct timespec *mark)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double) (now.tv_sec - mark->tv_sec) + (double) (now.tv_nsec - mark->tv_nsec) / 1e9;
+    *mark = now;
+    return seconds;
+}
+
+// Records the time since mark as spent in phase, and the arena peak so far, then moves mark on
+static void end_phase(pl0_compiler *ctx, int phase, struct timespec *mark)
+{
+    ctx->phase_seconds[phase] = lap(mark);
+    // The lexer thread of a pipelined compile may still be growing its pool
+    ctx->phase_peak[phase] = ctx->tkn_list.ring ? ctx->pool.peak_bytes : pl0_peak_bytes(ctx);
+}
+
+// Compiles the len bytes at src, which must stay unchanged while the result is in use. Parsing
+// resumes after each syntax error, so one call finds as many errors as it can. Returns 0 and
+// fills in the code and symbol table, or returns the number of the first error and fills in
+// every diagnostic.
+int pl0_compile(pl0_compiler *ctx, const char *src, size_t len, pl0_result *out)
+{
+    // Forget the previous compilation but keep the memory it used
+    ctx->tkn_list.size = 0;
+    ctx->tkn_list.current_index = -1;
+    ctx->interns.size = 0;
+    if (ctx->interns.slots != NULL)
+        memset(ctx->interns.slots, -1, (size_t) (ctx->interns.mask + 1) * sizeof(int));
+    ctx->sym_table.size = 0;
+    ctx->sym_table.current_level = 0;
+    ctx->sym_table.declare = 0;
+    ctx->code.size = 0;
+    ctx->code.cx = 0;
+    ctx->ast.count = 0;
+    ctx->ast.root = ctx->ast.parent = -1;
+    // Reused and parallel procedures are stitched into code that is emitted as it is parsed
+    ctx->ast.deferred = !ctx->streaming && !ctx->procs.enabled && (ctx->par.threads < 2 || ctx->ast.keep)
+                        && !ctx->syntax_only;
+    ctx->inline_count = 0;
+    memset(ctx->peephole_hits, 0, sizeof(ctx->peephole_hits));
+    ctx->recover = NULL;
+    ctx->sync_index = -2;
+    ctx->diagnostic_count = 0;
+    memset(ctx->phase_seconds, 0, sizeof(ctx->phase_seconds));
+    memset(ctx->phase_peak, 0, sizeof(ctx->phase_peak));
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    proc_store *st = &ctx->procs;
+    st->stamp = hash64(CACHE_STAMP, strlen(CACHE_STAMP), (uint64_t) ctx->opt_level); // Folding changes the code
+    st->entry_count = st->code_count = st->symbol_count = st->external_count = st->code_total = 0;
+    st->depth = st->lookup_count = 0;
+    st->reused = st->recompiled = 0;
+
+    volatile int inlined = 0, tail_calls = 0, accumulated = 0, removed = 0, unreachable = 0, unused = 0;
+    volatile int out_of_memory = 0;
+    struct timespec mark;
+    clock_gettime(CLOCK_MONOTONIC, &mark);
+    ctx->pool.on_full = &ctx->fail;
+    ctx->lex_pool.on_full = &ctx->fail;
+    switch (setjmp(ctx->fail))
+    {
+    case 0:
+        if (start_lexer(ctx, src, len))
+        {
+            // Lexing is timed as part of parsing, which it runs alongside
+            end_phase(ctx, 0, &mark);
+            program(ctx);
+            if (stop_lexer(ctx, 1))
+                longjmp(ctx->fail, 1);
+        }
+        else
+        {
+            lex(ctx, src, len);
+            end_phase(ctx, 0, &mark);
+            if (st->enabled)
+            {
+                st->seen = arena_fit(&ctx->pool, &st->seen_mem, (size_t) (2 * ctx->interns.size + 1) * sizeof(int));
+                memset(st->seen, 0, (size_t) (2 * ctx->interns.size + 1) * sizeof(int));
+            }
+            // Lexical errors are all reported up front; the parser skips the tokens they left
+            for (int i = 0; i < ctx->tkn_list.size; i++)
+                if (ctx->tkn_list.tokens[i] > 33)
+                    report(ctx, ctx->tkn_list.tokens[i], i);
+            program(ctx);
+        }
+        if (ctx->ast.deferred)
+        {
+            // A tree with errors is folded too, so it is listed like a streamed one
+            if (ctx->opt_level > 0)
+                fold_statement(ctx, ctx->ast.root);
+            if (ctx->diagnostic_count == 0)
+                gen_program(ctx);
+        }
+        end_phase(ctx, 1, &mark);
+        if (ctx->opt_level > 0 && ctx->diagnostic_count == 0 && !ctx->syntax_only)
+        {
+            // Inlining first gives the peephole rules the copied bodies to work on. Dropping code
+            // can leave jumps for them to shorten, which can in turn leave code that no longer runs.
+            if (ctx->inline_limit > 0)
+                inlined = inline_procedures(ctx);
+            int through = 0;
+            tail_calls = eliminate_tail_calls(ctx, &through);
+            accumulated = through;
+            int dropped, procedures = 0;
+            do
+            {
+                removed += peephole(ctx);
+                dropped = eliminate_dead_code(ctx, &procedures);
+                unreachable += dropped;
+            } while (dropped > 0);
+            unused = procedures;
+        }
+        end_phase(ctx, 2, &mark);
+        break;
+    case 1: // From the arenas
+        out_of_memory = 1;
+        break;
+    default: // From error(); what was parsed is folded like a streamed compile would have
+        if (ctx->ast.deferred && ctx->opt_level > 0)
+            fold_statement(ctx, ctx->ast.root);
+        break;
+    }
+    if (ctx->tkn_list.ring)
+    {
+        // Parsing stopped early; the lexical errors in the rest of the program still count
+        volatile int drain = !out_of_memory;
+        if (setjmp(ctx->fail) != 0)
+            drain = 0;
+        if (stop_lexer(ctx, drain) || !drain)
+            out_of_memory = 1;
+    }
+    ctx->pool.on_full = NULL;
+    ctx->lex_pool.on_full = NULL;
+    ctx->recover = NULL;
+    if (out_of_memory && ctx->diagnostics_mem.cap >= (size_t) (ctx->diagnostic_count + 1) * sizeof(pl0_diagnostic))
+        report(ctx, 25, ctx->tkn_list.current_index);
+    place_diagnostics(ctx);
+
+    memset(out, 0, sizeof(*out));
+    out->token = -1;
+    out->message = "";
+    out->peephole_hits = ctx->peephole_hits;
+    out->phase_seconds = ctx->phase_seconds;
+    out->phase_peak = ctx->phase_peak;
+    out->stats = &ctx->stats;
+    out->diagnostics = ctx->diagnostics;
+    out->diagnostic_count = ctx->diagnostic_count;
+    if (ctx->diagnostic_count > 0)
+    {
+        out->error = ctx->diagnostics[0].error;
+        out->token = ctx->diagnostics[0].token;
+        out->message = ctx->diagnostics[0].message;
+    }
+    else if (out_of_memory)
+    {
+        // Not even the diagnostic fitted
+        out->error = 25;
+        out->message = pl0_error_text(25);
+    }
+    else
+    {
+        out->code = ctx->code.code + 1;
+        out->count = ctx->code.size;
+        out->symbols = ctx->sym_table.table;
+        out->symbol_count = ctx->sym_table.size;
+        out->inline_limit = ctx->opt_level > 0 ? ctx->inline_limit : 0;
+        out->inlines = ctx->inlines;
+        out->inline_count = ctx->inline_count;
+        out->inlined = inlined;
+        out->tail_calls = tail_calls;
+        out->accumulated = accumulated;
+        out->removed = removed;
+        out->unreachable = unreachable;
+        out->unused = unused;
+    }
+    out->reused = st->reused;
+    out->recompiled = st->recompiled;
+    return out->error;
+}
+
+// Releases all memory of a context. It can be compiled again after pl0_init().
+void pl0_free(pl0_compiler *ctx)
+{
+    if (ctx->procs.map != NULL)
+        munmap(ctx->procs.map, ctx->procs.map_size);
+    ctx->procs.map = NULL;
+    ctx->procs.old = NULL;
+    for (int i = 0; i < ctx->par.worker_count; i++)
+        pl0_free(&ctx->par.workers[i]);
+    ctx->par.worker_count = 0;
+    arena_free_all(&ctx->pool);
+    arena_free_all(&ctx->lex_pool);
+}
+
+// Returns the most arena bytes ctx has held at once, counting the lexer's and the workers' pools
+size_t pl0_peak_bytes(const pl0_compiler *ctx)
+{
+    size_t bytes = ctx->pool.peak_bytes + ctx->lex_pool.peak_bytes;
+    for (int i = 0; i < ctx->par.worker_count; i++)
+        bytes += pl0_peak_bytes(&ctx->par.workers[i]);
+    return bytes;
+}
+
+// Turns on incremental compilation for ctx, with the procedures saved at path by an earlier
+// pl0_save_procedures(). A missing or unusable file just means every procedure is compiled.
+// Returns 1 if procedures were loaded, 0 if not.
+int pl0_load_procedures(pl0_compiler *ctx, const char *path)
+{
+    proc_store *st = &ctx->procs;
+    st->enabled = 1;
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0)
+        return 0;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && (size_t) sb.st_size >= sizeof(proc_header))
+        map = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    const proc_header *h = map;
+    size_t size = (size_t) sb.st_size;
+    size_t expect = sizeof(proc_header) + (size_t) h->entry_count * sizeof(proc_entry) + (size_t) h->code_count * sizeof(assembly)
+                    + (size_t) h->symbol_count * sizeof(proc_symbol) + (size_t) h->external_count * sizeof(proc_external);
+    if (h->magic != PROC_MAGIC || h->version != PROC_VERSION || expect != size)
+    {
+        munmap(map, size);
+        return 0;
+    }
+    st->map = map;
+    st->map_size = size;
+    st->old_entries = (const proc_entry *) (h + 1);
+    st->old_code = (const assembly *) (st->old_entries + h->entry_count);
+    st->old_symbols = (const proc_symbol *) (st->old_code + h->code_count);
+    st->old_externals = (const proc_external *) (st->old_symbols + h->symbol_count);
+
+    // Entries point into the arrays; one that does not fit makes the whole file unusable
+    for (uint32_t i = 0; i < h->entry_count; i++)
+    {
+        const proc_entry *e = &st->old_entries[i];
+        if ((uint64_t) e->code + e->code_count > h->code_count || (uint64_t) e->symbol + e->symbol_count > h->symbol_count
+            || (uint64_t) e->external + e->external_count > h->external_count || e->nested > i || e->code_count == 0)
+            return 0;
+    }
+
+    int slots = 1;
+    while (slots < 2 * (int) h->entry_count)
+        slots *= 2;
+    st->old_index = arena_fit(&ctx->pool, &st->index_mem, (size_t) slots * sizeof(int));
+    memset(st->old_index, -1, (size_t) slots * sizeof(int));
+    st->old_mask = slots - 1;
+    for (uint32_t i = 0; i < h->entry_count; i++)
+    {
+        uint32_t slot = (uint32_t) st->old_entries[i].path & (uint32_t) st->old_mask;
+        while (st->old_index[slot] != -1)
+            slot = (slot + 1) & (uint32_t) st->old_mask;
+        st->old_index[slot] = (int) i;
+    }
+    st->old = h;
+    return 1;
+}
+
+// Writes the procedures of the last compile to path, for pl0_load_procedures() to use next
+// time. The file is replaced in one step, so a compile reading it never sees half of it.
+// Returns 0, or -1 if the compile failed or the file could not be written.
+int pl0_save_procedures(pl0_compiler *ctx, const char *path)
+{
+    proc_store *st = &ctx->procs;
+    if (!st->enabled || ctx->diagnostic_count > 0 || ctx->syntax_only)
+        return -1;
+    char tmp[1024];
+    if (snprintf(tmp, sizeof tmp, "%s.tmp.%ld", path, (long) getpid()) >= (int) sizeof tmp)
+        return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    output *o = arena_fit(&ctx->pool, &st->save_mem, sizeof(output));
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+    proc_header h = { PROC_MAGIC, PROC_VERSION, st->stamp, (uint32_t) st->entry_count, (uint32_t) st->code_total,
+                      (uint32_t) st->symbol_count, (uint32_t) st->external_count };
+    out_bytes(o, (const char *) &h, sizeof h);
+    uint32_t code = 0;
+    for (int i = 0; i < st->entry_count; i++)
+    {
+        proc_entry entry = st->entries[i];
+        entry.code = code;
+        entry.kept = 0;
+        code += entry.code_count;
+        out_bytes(o, (const char *) &entry, sizeof entry);
+    }
+    for (int i = 0; i < st->entry_count; i++)
+    {
+        const proc_entry *entry = &st->entries[i];
+        out_bytes(o, (const char *) ((entry->kept ? st->old_code : st->code) + entry->code), entry->code_count * sizeof(assembly));
+    }
+    if (st->symbol_count > 0)
+        out_bytes(o, (const char *) st->symbols, (size_t) st->symbol_count * sizeof(proc_symbol));
+    if (st->external_count > 0)
+        out_bytes(o, (const char *) st->externals, (size_t) st->external_count * sizeof(proc_external));
+    out_flush(o);
+    size_t size = sizeof h + (size_t) st->entry_count * sizeof(proc_entry) + (size_t) st->code_total * sizeof(assembly)
+                  + (size_t) st->symbol_count * sizeof(proc_symbol) + (size_t) st->external_count * sizeof(proc_external);
+    int status = lseek(fd, 0, SEEK_END) == (off_t) size ? 0 : -1;
+    if (close(fd) != 0)
+        status = -1;
+    if (status == 0 && rename(tmp, path) == 0)
+        return 0;
+    unlink(tmp);
+    return -1;
+}
+
+// Batch compilation
+//
+// compile_batch() compiles many files at once on a pool of worker threads, each with its own
+// pl0_compiler context that it reuses from file to file. The files are split into one block per
+// worker, kept in a deque: a worker takes files from the bottom of its own deque and, once that
+// runs dry, steals from the top of the others, so a worker that drew large files does not hold
+// up the rest. No work is added after the start, which keeps the deques down to the pop and
+// steal halves of the usual Chase-Lev deque. Every file's outcome is stored in its batch_job and
+// printed in input order when all workers are done, so the report does not depend on timing.
+
+typedef struct batch_job
+{
+    const char *path; // Source file
+    char *out_path; // Object file written for it
+    char *text_path; // Text listing written for it with --text-elf
+    int error; // Error number, -1 if the files could not be read or written, 0 if it compiled
+    int count; // Number of instructions generated
+    int cached; // 1 if the code came from the compile cache
+    char message[128]; // Why the files could not be read or written when error is -1
+    int worker; // Worker that compiled it, which holds the text of its diagnostics
+    size_t report, report_size; // Where that text is in the worker's reports
+} batch_job;
+
+typedef struct batch_deque
+{
+    _Atomic long top; // Next job a thief takes
+    _Atomic long bottom; // One past the next job the owner takes
+    const int *jobs; // Job indexes
+} batch_deque;
+
+typedef struct batch_pool
+{
+    batch_job *jobs;
+    batch_deque *deques; // One per worker
+    int workers;
+    int opt_level;
+    int inline_limit;
+    int text; // Also write text listings
+    int syntax_only; // Only check the files, writing nothing
+    const pl0_cache *cache;
+    _Atomic int stolen; // Jobs taken from another worker's deque
+} batch_pool;
+
+typedef struct batch_worker
+{
+    batch_pool *pool;
+    int id; // Index of the worker's own deque
+    pthread_t thread;
+    arena_pool mem; // Only for reports, which outlive the worker
+    arena reports_mem;
+    char *reports; // One line per diagnostic of every file the worker compiled
+    size_t reports_size;
+} batch_worker;
+
+// Takes the job at the bottom of the owner's deque. Returns its index, or -1 if the deque is empty.
+static int deque_pop(batch_deque *d)
+{
+    long b = atomic_load(&d->bottom) - 1;
+    atomic_store(&d->bottom, b);
+    long t = atomic_load(&d->top);
+    if (t > b)
+    {
+        atomic_store(&d->bottom, b + 1);
+        return -1;
+    }
+    int job = d->jobs[b];
+    if (t == b)
+    {
+        // The last job: whoever moves top first gets it
+        if (!atomic_compare_exchange_strong(&d->top, &t, t + 1))
+            job = -1;
+        atomic_store(&d->bottom, b + 1);
+    }
+    return job;
+}
+
+// Takes the job at the top of another worker's deque. Returns its index, or -1 if it is empty.
+static int deque_steal(batch_deque *d)
+{
+    for (;;)
+    {
+        long t = atomic_load(&d->top);
+        long b = atomic_load(&d->bottom);
+        if (t >= b)
+            return -1;
+        int job = d->jobs[t];
+        if (atomic_compare_exchange_strong(&d->top, &t, t + 1))
+            return job;
+    }
+}
+
+// Compiles one file of a batch with ctx and writes its object file
+static void batch_compile(pl0_compiler *ctx, batch_worker *worker, batch_job *job, int text)
+{
+    const pl0_cache *cache = worker->pool->cache;
+    source_buf source;
+    if (load_source(job->path, &source) != 0)
+    {
+        job->error = -1;
+        snprintf(job->message, sizeof job->message, "cannot open file");
+        return;
+    }
+
+    // Batches list nothing, so their entries only differ by the options that change the code
+    uint64_t key = 0;
+    if (cache->dir != NULL && !ctx->syntax_only)
+    {
+        char options[256];
+        snprintf(options, sizeof options, "%s -O%d inline=%d batch", CACHE_STAMP, ctx->opt_level, ctx->inline_limit);
+        key = hash64(source.data, source.size, hash64(options, strlen(options), 0));
+        source_buf listing;
+        pl0_object obj;
+        if (cache_lookup(cache, key, &listing, &obj) == 0)
+        {
+            job->count = (int) obj.header->count;
+            job->cached = 1;
+            if (write_file(job->out_path, obj.map, obj.map_size) != 0)
+            {
+                job->error = -1;
+                snprintf(job->message, sizeof job->message, "cannot write %s", job->out_path);
+            }
+            else if (text)
+                write_text_code(job->text_path, obj.code, job->count);
+            free_object(&obj);
+            free_source(&listing);
+            free_source(&source);
+            return;
+        }
+    }
+
+    pl0_result result;
+    if (pl0_compile(ctx, source.data, source.size, &result) != 0)
+    {
+        job->error = result.error;
+        job->worker = worker->id;
+        job->report = worker->reports_size;
+        for (int i = 0; i < result.diagnostic_count; i++)
+        {
+            const pl0_diagnostic *d = &result.diagnostics[i];
+            const char *format = "%s:%d:%d: Error: %s\n";
+            size_t bytes = (size_t) snprintf(NULL, 0, format, job->path, d->line, d->column, d->message) + 1;
+            worker->reports = arena_fit(&worker->mem, &worker->reports_mem, worker->reports_size + bytes);
+            snprintf(worker->reports + worker->reports_size, bytes, format, job->path, d->line, d->column, d->message);
+            worker->reports_size += bytes - 1;
+        }
+        job->report_size = worker->reports_size - job->report;
+    }
+    else if (!ctx->syntax_only)
+    {
+        job->count = result.count;
+        if (write_object(&ctx->pool, job->out_path, result.code, result.count, result.symbols, result.symbol_count) != 0)
+        {
+            job->error = -1;
+            snprintf(job->message, sizeof job->message, "cannot write %s", job->out_path);
+        }
+        else
+        {
+            if (text)
+                write_text_code(job->text_path, result.code, result.count);
+            if (cache->dir != NULL)
+                cache_store(cache, &ctx->pool, key, "", 0, result.code, result.count, result.symbols, result.symbol_count);
+        }
+    }
+    free_source(&source);
+}
+
+static void *batch_work(void *arg)
+{
+    batch_worker *worker = arg;
+    batch_pool *pool = worker->pool;
+    pl0_compiler ctx;
+    pl0_init(&ctx);
+    ctx.opt_level = pool->opt_level;
+    ctx.inline_limit = pool->inline_limit;
+    ctx.syntax_only = pool->syntax_only;
+    for (;;)
+    {
+        int job = deque_pop(&pool->deques[worker->id]);
+        for (int k = 1; job < 0 && k < pool->workers; k++)
+        {
+            job = deque_steal(&pool->deques[(worker->id + k) % pool->workers]);
+            if (job >= 0)
+                atomic_fetch_add(&pool->stolen, 1);
+        }
+        // Nothing is added once the batch starts, so empty deques everywhere mean it is done
+        if (job < 0)
+            break;
+        batch_compile(&ctx, worker, &pool->jobs[job], pool->text);
+    }
+    pl0_free(&ctx);
+    return NULL;
+}
+
+// Writes path with its extension replaced by ext to out, or with ext appended if that would give
+// path itself. out needs room for strlen(path) + strlen(ext) + 1 bytes. Returns the bytes used.
+static size_t output_path(char *out, const char *path, const char *ext)
+{
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t stem = strlen(path);
+    if (dot != NULL && (slash == NULL || dot > slash) && strcmp(dot, ext) != 0)
+        stem = (size_t) (dot - path);
+    memcpy(out, path, stem);
+    strcpy(out + stem, ext);
+    return stem + strlen(ext) + 1;
+}
+
+// Orders batch jobs by the object file they write, then by their place in the input
+static int batch_job_output_order(const void *a, const void *b)
+{
+    const batch_job *x = *(const batch_job *const *) a, *y = *(const batch_job *const *) b;
+    int order = strcmp(x->out_path, y->out_path);
+    return order != 0 ? order : (x > y) - (x < y);
+}
+
+// Appends the paths listed in the manifest file at path, one per line, to inputs. Blank lines and
+// lines starting with '#' are skipped. Returns 0, or -1 if the manifest cannot be read.
+int read_manifest(arena_pool *pool, const char *path, arena *inputs_mem, char ***inputs, int *count, arena *names_mem)
+{
+    source_buf manifest;
+    if (load_source(path, &manifest) != 0)
+        return -1;
+    size_t size = manifest.size;
+    char *names = arena_fit(pool, names_mem, size + 1);
+    memcpy(names, manifest.data, size);
+    names[size] = '\n';
+    free_source(&manifest);
+    for (size_t i = 0; i <= size; )
+    {
+        char *line = names + i;
+        char *end = memchr(line, '\n', size + 1 - i);
+        i = (size_t) (end - names) + 1;
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        *inputs = arena_fit(pool, inputs_mem, (size_t) (*count + 1) * sizeof(char *));
+        (*inputs)[(*count)++] = line;
+    }
+    return 0;
+}
+
+// Compiles the count files in paths on jobs threads (0 picks one per core) and prints, in input
+// order, a line per file that compiled and a path:line:column line per error in the others.
+// Each file's code goes to the same path with a .bin extension, unless syntax_only is set.
+// Returns 0 if every file compiled, 1 otherwise.
+int compile_batch(char **paths, int count, int jobs, int opt_level, int inline_limit, int text, int syntax_only,
+                  const pl0_cache *cache)
+{
+    if (jobs <= 0)
+        jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+    if (jobs > count)
+        jobs = count > 0 ? count : 1;
+
+    arena_pool mem = {0};
+    arena job_mem = {0}, index_mem = {0}, deque_mem = {0}, worker_mem = {0}, path_mem = {0}, by_out_mem = {0};
+    batch_job *job = arena_fit(&mem, &job_mem, (size_t) (count + 1) * sizeof(batch_job));
+    int *index = arena_fit(&mem, &index_mem, (size_t) (count + 1) * sizeof(int));
+    batch_deque *deques = arena_fit(&mem, &deque_mem, (size_t) jobs * sizeof(batch_deque));
+    batch_worker *workers = arena_fit(&mem, &worker_mem, (size_t) jobs * sizeof(batch_worker));
+
+    size_t path_bytes = 0;
+    for (int i = 0; i < count; i++)
+        path_bytes += 2 * strlen(paths[i]) + sizeof(".bin") + sizeof(".elf.txt");
+    char *out = arena_fit(&mem, &path_mem, path_bytes + 1);
+    for (int i = 0; i < count; i++)
+    {
+        job[i].path = paths[i];
+        job[i].out_path = out;
+        out += output_path(out, paths[i], ".bin");
+        job[i].text_path = out;
+        out += output_path(out, paths[i], ".elf.txt");
+        index[i] = i;
+    }
+
+    // Inputs with the same stem (a.pl0 and a.txt, or one file named twice) would write over each
+    // other's object file, so the batch is refused before anything is compiled
+    if (!syntax_only)
+    {
+        batch_job **by_out = arena_fit(&mem, &by_out_mem, (size_t) (count + 1) * sizeof(batch_job *));
+        for (int i = 0; i < count; i++)
+            by_out[i] = &job[i];
+        qsort(by_out, (size_t) count, sizeof(batch_job *), batch_job_output_order);
+        int clashes = 0, first = 0;
+        for (int i = 1; i < count; i++)
+            if (strcmp(by_out[first]->out_path, by_out[i]->out_path) != 0)
+                first = i;
+            else
+            {
+                printf("Error: %s and %s would both be compiled to %s\n", by_out[first]->path, by_out[i]->path,
+                       by_out[i]->out_path);
+                clashes++;
+            }
+        if (clashes > 0)
+        {
+            arena_free_all(&mem);
+            return 1;
+        }
+    }
+
+    batch_pool pool = { .jobs = job, .deques = deques, .workers = jobs, .opt_level = opt_level,
+                        .inline_limit = inline_limit, .text = text, .syntax_only = syntax_only, .cache = cache };
+    atomic_init(&pool.stolen, 0);
+    for (int w = 0; w < jobs; w++)
+    {
+        long lo = (long) count * w / jobs, hi = (long) count * (w + 1) / jobs;
+        atomic_init(&deques[w].top, lo);
+        atomic_init(&deques[w].bottom, hi);
+        deques[w].jobs = index;
+        workers[w].pool = &pool;
+        workers[w].id = w;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Worker 0 is the calling thread
+    int started = 1;
+    while (started < jobs && pthread_create(&workers[started].thread, NULL, batch_work, &workers[started]) == 0)
+        started++;
+    batch_work(&workers[0]);
+    for (int w = 1; w < started; w++)
+        pthread_join(workers[w].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (job[i].error == 0 && syntax_only)
+            printf("%s is syntactically correct\n", job[i].path);
+        else if (job[i].error == 0)
+            printf("%s -> %s (%d instructions)\n", job[i].path, job[i].out_path, job[i].count);
+        else
+        {
+            if (job[i].error < 0)
+                printf("%s: Error: %s\n", job[i].path, job[i].message);
+            else
+                fwrite(workers[job[i].worker].reports + job[i].report, 1, job[i].report_size, stdout);
+            failed++;
+        }
+    }
+    printf("\nCompiled %d of %d files on %d thread%s in %.3f ms (%d stolen)\n", count - failed, count, started,
+           started == 1 ? "" : "s",
+           ((double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6),
+           atomic_load(&pool.stolen));
+    if (cache->dir != NULL)
+    {
+        int cached = 0;
+        for (int i = 0; i < count; i++)
+            cached += job[i].cached;
+        printf("%d of them from the cache\n", cached);
+    }
+    for (int w = 0; w < jobs; w++)
+        arena_free_all(&workers[w].mem);
+    arena_free_all(&mem);
+    return failed > 0;
+}
+
+// Benchmarks
+//
+// run_benchmarks() measures how the compiler scales. Each case is a program made up by
+// bench_generate() from a seeded generator, growing along one axis at a time: token count,
+// distinct identifiers, procedure nesting depth, expression length or number of procedures.
+// A case is compiled in a child process, so its peak resident set is its own, and as many times
+// as fit in a fifth of a second; the fastest run of each phase counts. The results can be
+// written as JSON and compared against such a file from an earlier build.
+
+typedef struct bench_shape
+{
+    const char *name;
+    int statements; // Statements in the main block
+    int identifiers; // Variables of the main block
+    int depth; // Procedures nested inside each other
+    int expression; // Operands per expression
+    int procedures; // Procedures side by side, each calling the one before
+} bench_shape;
+
+static const bench_shape bench_shapes[] = {
+    { "tokens-S", 5000, 16, 0, 4, 0 },
+    { "tokens-M", 50000, 16, 0, 4, 0 },
+    { "tokens-L", 500000, 16, 0, 4, 0 },
+    { "identifiers-S", 5000, 1000, 0, 4, 0 },
+    { "identifiers-M", 50000, 10000, 0, 4, 0 },
+    { "identifiers-L", 200000, 100000, 0, 4, 0 },
+    { "depth-S", 1000, 16, 16, 4, 0 },
+    { "depth-M", 1000, 16, 128, 4, 0 },
+    { "depth-L", 1000, 16, 1024, 4, 0 },
+    { "expression-S", 2000, 16, 0, 64, 0 },
+    { "expression-M", 2000, 16, 0, 1024, 0 },
+    { "expression-L", 200, 16, 0, 16384, 0 },
+    { "procedures-S", 100, 16, 0, 4, 100 },
+    { "procedures-M", 100, 16, 0, 4, 1000 },
+    { "procedures-L", 100, 16, 0, 4, 10000 },
+};
+#define BENCH_SHAPES ((int) (sizeof bench_shapes / sizeof bench_shapes[0]))
+
+// What one case measured
+typedef struct bench_result
+{
+    int tokens, lines, instructions;
+    size_t bytes;
+    int runs;
+    double seconds[PHASES]; // Fastest run of each phase
+    size_t peak[PHASES]; // Peak arena bytes at the end of each phase
+    long peak_rss_kb; // Peak resident set of the whole case
+    int error;
+} bench_result;
+
+typedef struct bench_text
+{
+    arena_pool *pool;
+    arena *mem;
+    char *data;
+    size_t size;
+    uint64_t state; // xorshift64* generator
+} bench_text;
+
+static void bench_put(bench_text *t, const char *str)
+{
+    size_t n = strlen(str);
+    t->data = arena_fit(t->pool, t->mem, t->size + n + 1);
+    memcpy(t->data + t->size, str, n);
+    t->size += n;
+}
+
+static void bench_putf(bench_text *t, const char *format, int value)
+{
+    char buf[64];
+    snprintf(buf, sizeof buf, format, value);
+    bench_put(t, buf);
+}
+
+static int bench_random(bench_text *t, int below)
+{
+    t->state ^= t->state >> 12;
+    t->state ^= t->state << 25;
+    t->state ^= t->state >> 27;
+    return (int) ((t->state * 2685821657736338717ULL) >> 33) % below;
+}
+
+// An operand: one of the count variables named prefix0, prefix1, ... or a number
+static void bench_operand(bench_text *t, const char *prefix, int count)
+{
+    if (bench_random(t, 4) == 0)
+        bench_putf(t, "%d", bench_random(t, 1000));
+    else
+    {
+        bench_put(t, prefix);
+        bench_putf(t, "%d", bench_random(t, count));
+    }
+}
+
+static void bench_expression(bench_text *t, const char *prefix, int count, int operands)
+{
+    static const char *ops[] = { " + ", " - ", " * ", " + " };
+    bench_operand(t, prefix, count);
+    for (int i = 1; i < operands; i++)
+    {
+        bench_put(t, ops[bench_random(t, 4)]);
+        bench_operand(t, prefix, count);
+    }
+}
+
+// A statement over the variables prefix0 to prefix<count-1>, on a line of its own
+static void bench_statement(bench_text *t, const char *prefix, int count, int operands, int last)
+{
+    int kind = bench_random(t, 8);
+    if (kind == 0)
+    {
+        bench_put(t, "  if ");
+        bench_operand(t, prefix, count);
+        bench_put(t, " < ");
+        bench_expression(t, prefix, count, operands);
+        bench_put(t, " then ");
+    }
+    else if (kind == 1)
+    {
+        bench_put(t, "  while ");
+        bench_operand(t, prefix, count);
+        bench_put(t, " > 100 do ");
+    }
+    else
+        bench_put(t, "  ");
+    if (kind == 2)
+    {
+        bench_put(t, "write ");
+        bench_expression(t, prefix, count, operands);
+    }
+    else
+    {
+        bench_put(t, prefix);
+        bench_putf(t, "%d := ", bench_random(t, count));
+        bench_expression(t, prefix, count, operands);
+    }
+    bench_put(t, last ? "\n" : ";\n");
+}
+
+// Writes the program of shape into t->data, which the caller's arena owns
+static void bench_generate(bench_text *t, const bench_shape *shape, uint64_t seed)
+{
+    t->size = 0;
+    t->state = seed * 2 + 1;
+    bench_put(t, "var");
+    for (int i = 0; i < shape->identifiers; i++)
+        bench_putf(t, i % 10 == 9 ? " v%d,\n" : " v%d,", i);
+    bench_put(t, " w;\n");
+
+    // A chain of nested procedures, the innermost using the variables of all of them
+    for (int d = 1; d <= shape->depth; d++)
+    {
+        bench_putf(t, "procedure n%d;\n", d);
+        bench_putf(t, "var x%d;\n", d);
+    }
+    for (int d = shape->depth; d >= 1; d--)
+    {
+        bench_putf(t, "begin\n  x%d := ", d);
+        bench_expression(t, "v", shape->identifiers, shape->expression);
+        bench_put(t, ";\n  v0 := x1");
+        if (d > 1)
+            bench_putf(t, " + x%d", d);
+        bench_put(t, d < shape->depth ? ";\n" : "\n");
+        if (d < shape->depth)
+            bench_putf(t, "  call n%d\n", d + 1);
+        bench_put(t, "end;\n");
+    }
+
+    for (int p = 0; p < shape->procedures; p++)
+    {
+        bench_putf(t, "procedure p%d;\nvar a;\nbegin\n  a := ", p);
+        bench_expression(t, "v", shape->identifiers, shape->expression);
+        bench_put(t, ";\n");
+        if (p > 0)
+            bench_putf(t, "  call p%d;\n", p - 1);
+        bench_put(t, "  v");
+        bench_putf(t, "%d := a\nend;\n", bench_random(t, shape->identifiers));
+    }
+
+    bench_put(t, "begin\n");
+    if (shape->depth > 0)
+        bench_put(t, "  call n1;\n");
+    if (shape->procedures > 0)
+        bench_putf(t, "  call p%d;\n", shape->procedures - 1);
+    for (int i = 0; i < shape->statements; i++)
+        bench_statement(t, "v", shape->identifiers, shape->expression, i == shape->statements - 1);
+    bench_put(t, "end.\n");
+}
+
+// Runs in the child: compiles the program of shape until a fifth of a second has passed
+static void bench_case(const bench_shape *shape, uint64_t seed, int opt_level, bench_result *r)
+{
+    pl0_compiler ctx;
+    pl0_init(&ctx);
+    ctx.opt_level = opt_level;
+    arena_pool gen_pool = {0};
+    arena text_mem = {0};
+    bench_text t = { .pool = &gen_pool, .mem = &text_mem };
+    bench_generate(&t, shape, seed);
+    r->bytes = t.size;
+    for (size_t i = 0; i < t.size; i++)
+        r->lines += t.data[i] == '\n';
+
+    double total = 0;
+    while (r->runs < 3 || (total < 0.2 && r->runs < 100))
+    {
+        pl0_result result;
+        r->error = pl0_compile(&ctx, t.data, t.size, &result);
+        if (r->error != 0)
+            break;
+        for (int p = 0; p < PHASES; p++)
+        {
+            if (r->runs == 0 || result.phase_seconds[p] < r->seconds[p])
+                r->seconds[p] = result.phase_seconds[p];
+            if (r->runs == 0) // Later runs reuse the memory of the first
+                r->peak[p] = result.phase_peak[p];
+            total += result.phase_seconds[p];
+        }
+        r->tokens = ctx.tkn_list.size;
+        r->instructions = result.count + result.removed + result.unreachable;
+        r->runs++;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    r->peak_rss_kb = usage.ru_maxrss;
+    pl0_free(&ctx);
+    arena_free_all(&gen_pool);
+}
+
+// Finds the tokens_per_sec of case name in a JSON file written by run_benchmarks(), or 0
+static double bench_baseline(const source_buf *baseline, const char *name)
+{
+    if (baseline == NULL)
+        return 0;
+    char key[64];
+    snprintf(key, sizeof key, "\"name\":\"%s\"", name);
+    const char *end = baseline->data + baseline->size;
+    for (const char *p = baseline->data; p + strlen(key) <= end; p++)
+    {
+        if (memcmp(p, key, strlen(key)) != 0)
+            continue;
+        static const char field[] = "\"tokens_per_sec\":";
+        for (const char *q = p; q + sizeof field <= end && *q != '}'; q++)
+            if (memcmp(q, field, sizeof field - 1) == 0)
+                return strtod(q + sizeof field - 1, NULL);
+        return 0;
+    }
+    return 0;
+}
+
+// Writes the program of the case called name to standard output. Returns 0, or 1 if there is
+// no such case.
+int write_benchmark_program(const char *name, uint64_t seed)
+{
+    for (int i = 0; i < BENCH_SHAPES; i++)
+    {
+        if (strcmp(bench_shapes[i].name, name) != 0)
+            continue;
+        arena_pool pool = {0};
+        arena text_mem = {0};
+        bench_text t = { .pool = &pool, .mem = &text_mem };
+        bench_generate(&t, &bench_shapes[i], seed);
+        fwrite(t.data, 1, t.size, stdout);
+        arena_free_all(&pool);
+        return 0;
+    }
+    printf("Unknown benchmark %s\n", name);
+    return 1;
+}
+
+// Runs every case whose name contains filter (all of them for NULL) and prints a table. Lexing
+// speed is in tokens per second, the front end in lines per second and code generation in
+// instructions per second of parsing. The results go to json_path too, and the change in
+// tokens per second is shown against baseline_path, when those are given. Returns 0, or 1 if a
+// case did not compile or could not be run.
+int run_benchmarks(uint64_t seed, int opt_level, const char *filter, const char *json_path, const char *baseline_path)
+{
+    source_buf baseline;
+    int have_baseline = baseline_path != NULL && load_source(baseline_path, &baseline) == 0;
+    if (baseline_path != NULL && !have_baseline)
+        printf("Error opening %s\n", baseline_path);
+    FILE *json = NULL;
+    if (json_path != NULL && (json = fopen(json_path, "w")) == NULL)
+        printf("Error writing %s\n", json_path);
+    if (json != NULL)
+        fprintf(json, "{\"seed\":%llu,\"opt_level\":%d,\"build\":\"%s\",\"cases\":[", (unsigned long long) seed, opt_level,
+                CACHE_STAMP);
+
+    printf("%-14s %9s %8s %9s %8s %8s %8s %10s %10s %10s %9s %9s %9s %9s%s\n", "case", "tokens", "lines",
+           "instrs", "lex ms", "parse ms", "opt ms", "tokens/s", "lines/s", "instrs/s", "lex KB", "parse KB",
+           "opt KB", "RSS KB", have_baseline ? "  vs base" : "");
+    int status = 0, written = 0;
+    for (int i = 0; i < BENCH_SHAPES; i++)
+    {
+        const bench_shape *shape = &bench_shapes[i];
+        if (filter != NULL && strstr(shape->name, filter) == NULL)
+            continue;
+        bench_result r = {0};
+        int fds[2];
+        pid_t child = -1;
+        if (pipe(fds) == 0)
+        {
+            fflush(stdout);
+            child = fork();
+            if (child == 0)
+            {
+                close(fds[0]);
+                bench_case(shape, seed, opt_level, &r);
+                ssize_t w = write(fds[1], &r, sizeof r);
+                _exit(w == (ssize_t) sizeof r ? 0 : 1);
+            }
+            close(fds[1]);
+            if (child < 0 || read(fds[0], &r, sizeof r) != (ssize_t) sizeof r)
+                r.error = -1;
+            close(fds[0]);
+            if (child > 0)
+                waitpid(child, NULL, 0);
+        }
+        else
+            r.error = -1;
+        if (r.error != 0)
+        {
+            printf("%-14s failed (%s)\n", shape->name, r.error < 0 ? "could not run" : pl0_error_text(r.error));
+            status = 1;
+            continue;
+        }
+
+        double lex = r.seconds[0], parse = r.seconds[1], opt = r.seconds[2];
+        double tokens_per_sec = lex > 0 ? r.tokens / lex : 0;
+        double lines_per_sec = lex + parse > 0 ? r.lines / (lex + parse) : 0;
+        double instructions_per_sec = parse > 0 ? r.instructions / parse : 0;
+        printf("%-14s %9d %8d %9d %8.2f %8.2f %8.2f %10.3g %10.3g %10.3g %9zu %9zu %9zu %9ld", shape->name,
+               r.tokens, r.lines, r.instructions, lex * 1e3, parse * 1e3, opt * 1e3, tokens_per_sec, lines_per_sec,
+               instructions_per_sec, r.peak[0] >> 10, r.peak[1] >> 10, r.peak[2] >> 10, r.peak_rss_kb);
+        double base = have_baseline ? bench_baseline(&baseline, shape->name) : 0;
+        if (base > 0)
+            printf("  %+7.1f%%", (tokens_per_sec / base - 1) * 100);
+        printf("\n");
+        if (json != NULL)
+            fprintf(json, "%s\n{\"name\":\"%s\",\"bytes\":%zu,\"tokens\":%d,\"lines\":%d,\"instructions\":%d,"
+                    "\"runs\":%d,\"lex_ms\":%.3f,\"parse_ms\":%.3f,\"optimize_ms\":%.3f,\"tokens_per_sec\":%.0f,"
+                    "\"lines_per_sec\":%.0f,\"instructions_per_sec\":%.0f,\"lex_peak_bytes\":%zu,"
+                    "\"parse_peak_bytes\":%zu,\"optimize_peak_bytes\":%zu,\"peak_rss_kb\":%ld}",
+                    written++ > 0 ? "," : "", shape->name, r.bytes, r.tokens, r.lines, r.instructions, r.runs,
+                    lex * 1e3, parse * 1e3, opt * 1e3, tokens_per_sec, lines_per_sec, instructions_per_sec,
+                    r.peak[0], r.peak[1], r.peak[2], r.peak_rss_kb);
+    }
+    if (json != NULL)
+    {
+        fprintf(json, "\n]}\n");
+        if (fclose(json) != 0)
+            status = 1;
+    }
+    if (have_baseline)
+        free_source(&baseline);
+    return status;
+}
+
+// Leaves through pool->on_full when memory runs out, or reports it and exits if nobody is there
+// to handle it
+static void arena_out_of_memory(arena_pool *pool)
+{
+    if (pool->on_full != NULL)
+        longjmp(*pool->on_full, 1);
+    printf("Error: out of memory\n");
+    exit(1);
+}
+
+// Makes sure arena a holds at least bytes, doubling its capacity as often as needed, and
+// returns its (possibly moved) base. New space is zeroed. The arena joins pool the first time
+// it gets memory.
+void *arena_fit(arena_pool *pool, arena *a, size_t bytes)
+{
+    if (bytes <= a->cap)
+        return a->base;
+    size_t cap = a->cap > 0 ? a->cap : 4096;
+    while (cap < bytes)
+        cap *= 2;
+    if (a->pool == NULL && pool->count == MAX_ARENAS)
+        arena_out_of_memory(pool);
+    void *base = realloc(a->base, cap);
+    if (base == NULL)
+        arena_out_of_memory(pool);
+    memset((char *) base + a->cap, 0, cap - a->cap);
+    if (a->pool == NULL)
+    {
+        pool->list[pool->count++] = a;
+        a->pool = pool;
+    }
+    a->pool->bytes += cap - a->cap;
+    if (a->pool->bytes > a->pool->peak_bytes)
+        a->pool->peak_bytes = a->pool->bytes;
+    a->base = base;
+    a->cap = cap;
+    return base;
+}
+
+// Releases a single arena and takes it off its pool's list
+void arena_free(arena *a)
+{
+    arena_pool *pool = a->pool;
+    if (pool == NULL)
+        return;
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->list[i] == a)
+        {
+            pool->list[i] = pool->list[--pool->count];
+            break;
+        }
+    }
+    free(a->base);
+    pool->bytes -= a->cap;
+    a->base = NULL;
+    a->cap = 0;
+    a->pool = NULL;
+}
+
+// Releases every arena in pool at once
+void arena_free_all(arena_pool *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        free(pool->list[i]->base);
+        pool->list[i]->base = NULL;
+        pool->list[i]->cap = 0;
+        pool->list[i]->pool = NULL;
+    }
+    pool->count = 0;
+    pool->bytes = 0;
+}
+
+// Loads the program at path (or standard input for "-") into a contiguous read-only buffer.
+// Regular files are mmap'd; pipes and terminals are read in large chunks into a growing buffer.
+// Returns 0 on success, -1 if the file could not be opened or read.
+int load_source(const char *path, source_buf *src)
+{
+    int fd = 0;
+    if (strcmp(path, "-") != 0)
+    {
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return -1;
+    }
+
+    src->data = "";
+    src->size = 0;
+    src->mapped = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+            src->data = map;
+            src->size = (size_t) st.st_size;
+            src->mapped = 1;
+            if (fd != 0)
+                close(fd);
+            return 0;
+        }
+    }
+
+    // Not mappable (pipe, stdin, empty file), so read it in with a geometrically growing buffer
+    size_t cap = READ_CHUNK_SIZE;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    while (buf != NULL)
+    {
+        if (len == cap)
+        {
+            char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL)
+                break;
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t got = read(fd, buf + len, cap - len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got == 0)
+        {
+            src->data = buf;
+            src->size = len;
+            if (fd != 0)
+                close(fd);
+            return 0;
+        }
+        if (got < 0)
+            break;
+        len += (size_t) got;
+    }
+    free(buf);
+    if (fd != 0)
+        close(fd);
+    return -1;
+}
+
+// Releases the buffer returned by load_source
+void free_source(source_buf *src)
+{
+    if (src->mapped)
+        munmap((void *) src->data, src->size);
+    else
+        free((void *) src->data);
+    src->data = "";
+    src->size = 0;
+    src->mapped = 0;
+}
+
+// Character classes for the lexer's dispatch table. Control characters and bytes above 127
+// count as whitespace, matching the old signed "currentChar < 33" test.
+#define CC_INVALID 0
+#define CC_SPACE 1
+#define CC_DIGIT 2
+#define CC_LETTER 3
+#define CC_SINGLE 4 // one-character symbol, token value is in single_token[]
+#define CC_COLON 5
+#define CC_LESS 6
+#define CC_GREATER 7
+#define CC_SLASH 8
+
+static const unsigned char char_class[256] = {
+    [0 ... 32] = CC_SPACE,
+    [128 ... 255] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT,
+    ['A' ... 'Z'] = CC_LETTER,
+    ['a' ... 'z'] = CC_LETTER,
+    ['+'] = CC_SINGLE, ['-'] = CC_SINGLE, ['*'] = CC_SINGLE, ['='] = CC_SINGLE,
+    ['('] = CC_SINGLE, [')'] = CC_SINGLE, [','] = CC_SINGLE, ['.'] = CC_SINGLE,
+    [';'] = CC_SINGLE,
+    [':'] = CC_COLON,
+    ['<'] = CC_LESS,
+    ['>'] = CC_GREATER,
+    ['/'] = CC_SLASH,
+};
+
+static const unsigned char single_token[256] = {
+    ['+'] = 4, ['-'] = 5, ['*'] = 6, ['='] = 9, ['('] = 15, [')'] = 16,
+    [','] = 17, ['.'] = 19, [';'] = 18,
+};
+
+// Perfect hash over the keywords: (length + asso[second char] + asso[last char]) & 15 gives a
+// distinct slot for every keyword, so a lookup is one hash and at most one memcmp.
+static const unsigned char keyword_asso[256] = {
+    ['a'] = 11, ['d'] = 5, ['e'] = 12, ['f'] = 12, ['h'] = 7,
+    ['l'] = 2, ['n'] = 8, ['o'] = 5, ['r'] = 1, ['t'] = 1,
+};
+
+static const struct keyword
+{
+    const char *name;
+    int len;
+    int token;
+} keyword_table[16] = {
+    {"end", 3, 22}, {"call", 4, 27}, {"write", 5, 31}, {"then", 4, 24},
+    {"", 0, 2}, {"read", 4, 32}, {"procedure", 9, 30}, {"", 0, 2},
+    {"while", 5, 25}, {"begin", 5, 21}, {"if", 2, 23}, {"const", 5, 28},
+    {"do", 2, 26}, {"odd", 3, 1}, {"become", 6, 20}, {"var", 3, 29},
+};
+
+// Returns the index of the first byte at or after i that is not whitespace
+static size_t skip_space(const char *src, size_t i, size_t size)
+{
+#if defined(__AVX2__)
+    const __m256i limit32 = _mm256_set1_epi8(32);
+    while (i + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, limit32));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i limit = _mm_set1_epi8(32);
+    while (i + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpgt_epi8(v, limit));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < size && char_class[(unsigned char) src[i]] == CC_SPACE)
+        i++;
+    return i;
+}
+
+// Returns the index of the first byte at or after i that is not a letter or digit. With
+// letters set to 0 only digits are skipped.
+static size_t skip_alnum(const char *src, size_t i, size_t size, int letters)
+{
+#if defined(__AVX2__)
+    const __m256i zero32 = _mm256_set1_epi8('0'), nine32 = _mm256_set1_epi8(9);
+    const __m256i a32 = _mm256_set1_epi8('a'), z32 = _mm256_set1_epi8(25), case32 = _mm256_set1_epi8(0x20);
+    while (i + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i ok = _mm256_cmpeq_epi8(_mm256_max_epu8(_mm256_sub_epi8(v, zero32), nine32), nine32);
+        if (letters) {
+            __m256i lower = _mm256_sub_epi8(_mm256_or_si256(v, case32), a32);
+            ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(_mm256_max_epu8(lower, z32), z32));
+        }
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(ok);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+    const __m128i a = _mm_set1_epi8('a'), z = _mm_set1_epi8(25), lowercase = _mm_set1_epi8(0x20);
+    while (i + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i ok = _mm_cmpeq_epi8(_mm_max_epu8(_mm_sub_epi8(v, zero), nine), nine);
+        if (letters) {
+            __m128i lower = _mm_sub_epi8(_mm_or_si128(v, lowercase), a);
+            ok = _mm_or_si128(ok, _mm_cmpeq_epi8(_mm_max_epu8(lower, z), z));
+        }
+        unsigned mask = ~(unsigned) _mm_movemask_epi8(ok) & 0xFFFF;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < size) {
+        int cc = char_class[(unsigned char) src[i]];
+        if (cc != CC_DIGIT && !(letters && cc == CC_LETTER))
+            break;
+        i++;
+    }
+    return i;
+}
+
+// Doubles the intern hash table and reinserts every id
+static void grow_intern_slots(pl0_compiler *ctx)
+{
+    intern_table *in = &ctx->interns;
+    int slot_count = in->mask > 0 ? (in->mask + 1) * 2 : 1024;
+    int *slots = arena_fit(&ctx->lex_pool, &in->slots_mem, (size_t) slot_count * sizeof *slots);
+    memset(slots, -1, (size_t) slot_count * sizeof *slots);
+    for (int id = 0; id < in->size; id++) {
+        uint32_t h = in->hashes[id] & (uint32_t) (slot_count - 1);
+        while (slots[h] != -1)
+            h = (h + 1) & (uint32_t) (slot_count - 1);
+        slots[h] = id;
+    }
+    in->slots = slots;
+    in->mask = slot_count - 1;
+}
+
+// Returns the id of the identifier spanning len bytes at offset in src, adding it if it is new.
+// Counts the slots it compares in probes.
+static int intern(pl0_compiler *ctx, const char *src, size_t offset, size_t len, unsigned long long *probes)
+{
+    intern_table *in = &ctx->interns;
+    const char *name = src + offset;
+
+    // FNV-1a; identifiers are at most 11 characters
+    uint32_t hash = 2166136261u;
+    for (size_t j = 0; j < len; j++)
+        hash = (hash ^ (unsigned char) name[j]) * 16777619u;
+
+    if (in->size * 2 >= in->mask)
+        grow_intern_slots(ctx);
+    uint32_t h = hash & (uint32_t) in->mask;
+    while (in->slots[h] != -1) {
+        int id = in->slots[h];
+        (*probes)++;
+        if (in->hashes[id] == hash && in->lengths[id] == len && memcmp(src + in->offsets[id], name, len) == 0)
+            return id;
+        h = (h + 1) & (uint32_t) in->mask;
+    }
+
+    if (in->size == in->capacity) {
+        int capacity = in->capacity > 0 ? in->capacity * 2 : 1024;
+        in->hashes = arena_fit(&ctx->lex_pool, &in->hashes_mem, (size_t) capacity * sizeof *in->hashes);
+        in->offsets = arena_fit(&ctx->lex_pool, &in->offsets_mem, (size_t) capacity * sizeof *in->offsets);
+        in->lengths = arena_fit(&ctx->lex_pool, &in->lengths_mem, (size_t) capacity * sizeof *in->lengths);
+        in->capacity = capacity;
+    }
+    int id = in->size++;
+    in->hashes[id] = hash;
+    in->offsets[id] = (uint32_t) offset;
+    in->lengths[id] = (uint32_t) len;
+    in->slots[h] = id;
+    return id;
+}
+
+// Looks up an identifier in the keyword table and returns its token value (2 if it is not a keyword)
+static int keyword_lookup(const char *name, size_t len)
+{
+    if (len < 2 || len > 9)
+        return 2;
+    const struct keyword *kw = &keyword_table[(len + keyword_asso[(unsigned char) name[1]]
+                                               + keyword_asso[(unsigned char) name[len - 1]]) & 15];
+    if ((size_t) kw->len == len && memcmp(kw->name, name, len) == 0)
+        return kw->token;
+    return 2;
+}
+
+// Makes the token arrays hold at least capacity tokens
+static void fit_tokens(pl0_compiler *ctx, int capacity)
+{
+    token_list *list = &ctx->tkn_list;
+    if (capacity <= list->capacity)
+        return;
+    list->tokens = arena_fit(&ctx->pool, &list->tokens_mem, (size_t) capacity * sizeof *list->tokens);
+    list->offsets = arena_fit(&ctx->pool, &list->offsets_mem, (size_t) capacity * sizeof *list->offsets);
+    list->lengths = arena_fit(&ctx->pool, &list->lengths_mem, (size_t) capacity * sizeof *list->lengths);
+    list->values = arena_fit(&ctx->pool, &list->values_mem, (size_t) capacity * sizeof *list->values);
+    list->capacity = capacity;
+}
+
+// Waits until the parser has let go of enough of the ring for the lexer to make another token,
+// publishing what was made so far so that the parser cannot be waiting for it
+static void wait_for_room(token_list *list)
+{
+    atomic_store_explicit(&list->produced, list->lexed, memory_order_release);
+    for (;;)
+    {
+        int consumed = atomic_load_explicit(&list->consumed, memory_order_acquire);
+        if (list->lexed - consumed < PIPELINE_RING)
+        {
+            list->room = consumed > INT_MAX - PIPELINE_RING ? INT_MAX : consumed + PIPELINE_RING;
+            return;
+        }
+        sched_yield();
+    }
+}
+
+// Appends a token spanning len bytes at offset in the source to the global token list,
+// growing its arenas when they are full. A pipelined lexer waits for a free slot instead, and
+// publishes its tokens in batches.
+static void add_token(pl0_compiler *ctx, int token, size_t offset, size_t len, int value)
+{
+    token_list *list = &ctx->tkn_list;
+    if (list->ring)
+    {
+        if (list->lexed == list->room)
+            wait_for_room(list);
+    }
+    else if (list->lexed == list->capacity)
+        fit_tokens(ctx, list->capacity > 0 ? list->capacity * 2 : 4096);
+    int slot = list->lexed & list->mask;
+    list->tokens[slot] = (unsigned char) token;
+    list->offsets[slot] = (uint32_t) offset;
+    list->lengths[slot] = (uint32_t) len;
+    list->values[slot] = value;
+    list->lexed++;
+    if (list->ring && (list->lexed & 255) == 0)
+        atomic_store_explicit(&list->produced, list->lexed, memory_order_release);
+}
+
+// Returns the lexeme of the token at index. It is not NUL-terminated; use lexeme_len.
+const char *lexeme(pl0_compiler *ctx, int index)
+{
+    return ctx->tkn_list.src + ctx->tkn_list.offsets[index & ctx->tkn_list.mask];
+}
+
+// Returns the length of the lexeme of the token at index
+int lexeme_len(pl0_compiler *ctx, int index)
+{
+    return (int) ctx->tkn_list.lengths[index & ctx->tkn_list.mask];
+}
+
+// Returns the value of the current token
+static int token_value(pl0_compiler *ctx)
+{
+    return ctx->tkn_list.values[ctx->tkn_list.current_index & ctx->tkn_list.mask];
+}
+
+// Lexes the source program of the token list. Each token starts in the state picked by its first
+// character's class; identifiers, numbers and whitespace runs are then consumed in bulk.
+static void lex_tokens(pl0_compiler *ctx)
+{
+    const char *src = ctx->tkn_list.src;
+    size_t size = ctx->tkn_list.src_size;
+    ctx->tkn_list.lexed = 0;
+    unsigned long long keyword_lookups = 0, intern_probes = 0;
+    size_t i = skip_space(src, 0, size);
+    while (i < size)
+    {
+        size_t start = i;
+        unsigned char ch = (unsigned char) src[i];
+        switch (char_class[ch])
+        {
+            case CC_DIGIT:
+                i = skip_alnum(src, i, size, 0);
+                if (i - start < 6) {
+                    int value = 0;
+                    for (size_t j = start; j < i; j++)
+                        value = value * 10 + (src[j] - '0');
+                    add_token(ctx, 3, start, i - start, value);
+                }
+                else
+                    add_token(ctx, 36, start, i - start, 0);
+                break;
+            case CC_LETTER:
+                i = skip_alnum(src, i, size, 1);
+                if (i - start < 12) {
+                    int token = keyword_lookup(src + start, i - start);
+                    keyword_lookups++;
+                    add_token(ctx, token, start, i - start, token == 2 ? intern(ctx, src, start, i - start, &intern_probes) : 0);
+                }
+                else
+                    add_token(ctx, 35, start, i - start, 0);
+                break;
+            case CC_SINGLE:
+                add_token(ctx, single_token[ch], start, 1, 0);
+                i++;
+                break;
+            case CC_COLON:
+                if (i + 1 < size && src[i + 1] == '=') {
+                    add_token(ctx, 20, start, 2, 0);
+                    i += 2;
+                }
+                else {
+                    add_token(ctx, 34, start, 1, 0);
+                    i++;
+                }
+                break;
+            case CC_LESS:
+                if (i + 1 < size && src[i + 1] == '>') {
+                    add_token(ctx, 10, start, 2, 0);
+                    i += 2;
+                }
+                else if (i + 1 < size && src[i + 1] == '=') {
+                    add_token(ctx, 12, start, 2, 0);
+                    i += 2;
+                }
+                else {
+                    add_token(ctx, 11, start, 1, 0);
+                    i++;
+                }
+                break;
+            case CC_GREATER:
+                if (i + 1 < size && src[i + 1] == '=') {
+                    add_token(ctx, 14, start, 2, 0);
+                    i += 2;
+                }
+                else {
+                    add_token(ctx, 13, start, 1, 0);
+                    i++;
+                }
+                break;
+            case CC_SLASH:
+                // A comment starts with "/*" and runs up to the next '/'
+                if (i + 1 < size && src[i + 1] == '*') {
+                    const char *end = i + 2 < size ? memchr(src + i + 2, '/', size - i - 2) : NULL;
+                    i = end != NULL ? (size_t) (end - src) + 1 : size;
+                }
+                else {
+                    add_token(ctx, 7, start, 1, 0);
+                    i++;
+                }
+                break;
+            default:
+                // Otherwise, the symbol is invalid and will throw a corresponding error in the Lexeme Table
+                add_token(ctx, 34, start, 1, 0);
+                i++;
+        }
+        i = skip_space(src, i, size);
+    }
+    ctx->stats.tokens = (unsigned long long) ctx->tkn_list.lexed;
+    ctx->stats.keyword_lookups = keyword_lookups;
+    ctx->stats.intern_probes = intern_probes;
+}
+
+// Splits the source program into tokens
+void lex(pl0_compiler *ctx, const char *src, size_t size)
+{
+    ctx->tkn_list.src = src;
+    ctx->tkn_list.src_size = size;
+    ctx->tkn_list.size = 0;
+    ctx->tkn_list.mask = -1;
+
+    // Spans are 32 bits wide
+    if (size > UINT32_MAX)
+        error(ctx, 21);
+
+    lex_tokens(ctx);
+    ctx->tkn_list.size = ctx->tkn_list.lexed;
+}
+
+// Makes room in the per-identifier indexes for ids below count, with the new ids unused
+static void fit_ids(pl0_compiler *ctx, int count)
+{
+    symbol_table *t = &ctx->sym_table;
+    if (count <= t->id_count)
+        return;
+    if (count < 2 * t->id_count)
+        count = 2 * t->id_count;
+    size_t bytes = (size_t) count * sizeof(int), old = (size_t) t->id_count * sizeof(int);
+    t->newest = arena_fit(&ctx->pool, &t->newest_mem, bytes);
+    t->newest_const = arena_fit(&ctx->pool, &t->newest_const_mem, bytes);
+    t->visible = arena_fit(&ctx->pool, &t->visible_mem, bytes);
+    memset((char *) t->newest + old, -1, bytes - old);
+    memset((char *) t->newest_const + old, -1, bytes - old);
+    memset((char *) t->visible + old, -1, bytes - old);
+    t->id_count = count;
+}
+
+// Hands the slots of the tokens before keep back to the lexer
+static void release_tokens(token_list *list, int keep)
+{
+    if (keep <= list->released)
+        return;
+    list->released = keep;
+    atomic_store_explicit(&list->consumed, keep, memory_order_release);
+}
+
+// Returns 1 if the token at index exists. A pipelined compile first waits until the lexer has
+// published it or finished, handing back every slot the parser is done with: once it moves to
+// index, only that token and the one before it are looked at again. The lexical errors among the
+// tokens received are reported then, as a serial compile reports them all before parsing.
+static int have_token(pl0_compiler *ctx, int index)
+{
+    token_list *list = &ctx->tkn_list;
+    if (index < list->size || !list->ring)
+        return index < list->size;
+    release_tokens(list, index - 1);
+    int produced;
+    for (;;)
+    {
+        produced = atomic_load_explicit(&list->produced, memory_order_acquire);
+        if (produced > index)
+            break;
+        if (atomic_load_explicit(&list->done, memory_order_acquire))
+        {
+            produced = atomic_load_explicit(&list->produced, memory_order_acquire);
+            break;
+        }
+        sched_yield();
+    }
+    int first = list->size, ids = 0;
+    list->size = produced;
+    for (int i = first; i < produced; i++)
+    {
+        int slot = i & list->mask;
+        if (list->tokens[slot] > 33)
+            report(ctx, list->tokens[slot], i);
+        else if (list->tokens[slot] == 2 && list->values[slot] >= ids)
+            ids = list->values[slot] + 1;
+    }
+    fit_ids(ctx, ids);
+    return index < list->size;
+}
+
+// Lexes on the lexer thread of a pipelined compile
+static void *lex_thread(void *arg)
+{
+    pl0_compiler *ctx = arg;
+    token_list *list = &ctx->tkn_list;
+    jmp_buf full;
+    ctx->lex_pool.on_full = &full;
+    if (setjmp(full) == 0)
+        lex_tokens(ctx);
+    else
+        list->lex_failed = 1;
+    ctx->lex_pool.on_full = NULL;
+    atomic_store_explicit(&list->produced, list->lexed, memory_order_release);
+    atomic_store_explicit(&list->done, 1, memory_order_release);
+    return NULL;
+}
+
+// Starts lexing src on a thread of its own for a pipelined compile. Returns 0 if it has to be
+// lexed the usual way instead.
+int start_lexer(pl0_compiler *ctx, const char *src, size_t size)
+{
+    token_list *list = &ctx->tkn_list;
+    if (!ctx->pipelined || ctx->procs.enabled || size > UINT32_MAX)
+        return 0;
+    fit_tokens(ctx, PIPELINE_RING);
+    list->src = src;
+    list->src_size = size;
+    list->size = 0;
+    list->mask = PIPELINE_RING - 1;
+    list->lexed = 0;
+    list->room = PIPELINE_RING;
+    list->lex_failed = 0;
+    list->released = 0;
+    atomic_store(&list->produced, 0);
+    atomic_store(&list->consumed, 0);
+    atomic_store(&list->done, 0);
+    list->ring = 1;
+    if (pthread_create(&list->lexer, NULL, lex_thread, ctx) != 0)
+    {
+        list->ring = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// Waits for the lexer thread to exit. With drain set, the rest of the program is lexed first
+// and its lexical errors are reported; otherwise the lexer is let go without its tokens being
+// looked at. The ring does not hold the whole token list, so none of it is kept. Returns 1 if
+// the lexer ran out of memory.
+int stop_lexer(pl0_compiler *ctx, int drain)
+{
+    token_list *list = &ctx->tkn_list;
+    while (drain && have_token(ctx, list->size))
+        ;
+    release_tokens(list, INT_MAX);
+    pthread_join(list->lexer, NULL);
+    list->ring = 0;
+    list->size = 0;
+    // The errors found in a program that was cut short say nothing about it
+    if (list->lex_failed)
+        ctx->diagnostic_count = 0;
+    return list->lex_failed;
+}
+
+// Returns the index of the next token so long as the accessed index is valid
+int get_next_token(pl0_compiler *ctx){
+    if (ctx->tkn_list.next_index < 0 || !have_token(ctx, ctx->tkn_list.next_index))
+        return -1;
+    return ctx->tkn_list.next_index;
+}
+
+// Updates the token list so that it shifts to the next index. Past the end of the
+// list the current token becomes 0, which matches no symbol.
+void update_tokens(pl0_compiler *ctx, int index){
+    token_list *list = &ctx->tkn_list;
+    // Invalid lexemes are reported while lexing, so the parser never sees them
+    while (index >= 0 && have_token(ctx, index) && list->tokens[index & list->mask] > 33)
+        index++;
+    list->current_index = index;
+    list->next_index = list->current_index + 1;
+    if (index < 0 || !have_token(ctx, index))
+        list->token = 0;
+    else
+        list->token = list->tokens[list->current_index & list->mask];
+    if (list->ring && index - list->released > 1024)
+        release_tokens(list, index - 1);
+}
+
+// Checks if the symbol table contains the current token index name .
+// Returns the index if it is in the symbol table, returns -1 otherwise.
+// While declaring, only consts and symbols of the current scope count as a match. Otherwise the
+// newest symbol with the name decides: a const or open-scope symbol is returned, and a symbol
+// whose scope has already closed is reported as out of scope.
+int symbol_table_check(pl0_compiler *ctx){
+    int id = token_value(ctx);
+    ctx->stats.symbol_lookups++;
+    if (ctx->sym_table.declare == 1) {
+        int found = ctx->sym_table.newest_const[id];
+        int local = ctx->sym_table.visible[id];
+        ctx->stats.symbol_comparisons += (found != -1) + (local != -1);
+        if (local > found && ctx->sym_table.table[local].level == ctx->sym_table.current_level)
+            found = local;
+        return note_lookup(ctx, found);
+    }
+    int newest = ctx->sym_table.newest[id];
+    ctx->stats.symbol_comparisons += newest != -1;
+    if (newest != -1 && ctx->sym_table.table[newest].kind != 1 && ctx->sym_table.table[newest].mark == 1)
+        error(ctx, 20);
+    return note_lookup(ctx, newest);
+}
+
+// Indexes the symbol at the end of the table under its name, and puts vars and procedures on
+// the scope stack of the current level. Call before incrementing the table size.
+void index_symbol(pl0_compiler *ctx){
+    int i = ctx->sym_table.size;
+    int id = ctx->sym_table.table[i].id;
+    ctx->sym_table.newest[id] = i;
+    if (ctx->sym_table.table[i].kind == 1) {
+        ctx->sym_table.newest_const[id] = i;
+        ctx->sym_table.table[i].shadow = -1;
+        return;
+    }
+    ctx->sym_table.table[i].shadow = ctx->sym_table.visible[id];
+    ctx->sym_table.visible[id] = i;
+    if ((size_t) (ctx->sym_table.scope_size + 1) * sizeof(int) > ctx->sym_table.scope_stack_mem.cap)
+        ctx->sym_table.scope_stack = arena_fit(&ctx->pool, &ctx->sym_table.scope_stack_mem, (size_t) (ctx->sym_table.scope_size + 1) * sizeof(int));
+    ctx->sym_table.scope_stack[ctx->sym_table.scope_size++] = i;
+}
+
+// Opens the scope of a new block one level deeper
+void open_scope(pl0_compiler *ctx){
+    ctx->stats.scopes_opened++;
+    ctx->sym_table.current_level++;
+    if ((size_t) (ctx->sym_table.current_level + 1) * sizeof(int) > ctx->sym_table.scope_start_mem.cap)
+        ctx->sym_table.scope_start = arena_fit(&ctx->pool, &ctx->sym_table.scope_start_mem, (size_t) (ctx->sym_table.current_level + 1) * sizeof(int));
+    ctx->sym_table.scope_start[ctx->sym_table.current_level] = ctx->sym_table.scope_size;
+}
+
+// Closes the current scope: its vars and procedures are marked unavailable and stop hiding
+// the outer symbols they shadowed
+void close_scope(pl0_compiler *ctx){
+    ctx->stats.scopes_closed++;
+    int start = ctx->sym_table.scope_start[ctx->sym_table.current_level];
+    while (ctx->sym_table.scope_size > start) {
+        int i = ctx->sym_table.scope_stack[--ctx->sym_table.scope_size];
+        ctx->sym_table.table[i].mark = 1;
+        ctx->sym_table.visible[ctx->sym_table.table[i].id] = ctx->sym_table.table[i].shadow;
+    }
+    ctx->sym_table.current_level--;
+}
+
+// Returns the text of an error number, without the "Error: " prefix. 34 to 36 are the lexical
+// errors, numbered like the tokens the lexer marks them with.
+const char *pl0_error_text(int error_num){
+    switch (error_num) {
+        case 1: return "program must end with period";
+        case 2: return "const, var, procedure, and read keywords must be followed by identifier";
+        case 3: return "symbol name has already been declared";
+        case 4: return "constants must be assigned with =";
+        case 5: return "constants must be assigned an integer value";
+        case 6: return "constant, variable, and procedure declarations must be followed by a semicolon";
+        case 7: return "undeclared identifier";
+        case 8: return "only variable values may be altered";
+        case 9: return "assignment statements must use :=";
+        case 10: return "begin must be followed by end";
+        case 11: return "if must be followed by then";
+        case 12: return "while must be followed by do";
+        case 13: return "condition must contain comparison operator";
+        case 14: return "right parenthesis must follow left parenthesis";
+        case 15: return "arithmetic equations must contain operands, parentheses, numbers, or symbols";
+        case 16: return "call must be followed by an identifier";
+        case 17: return "variables and constants cannot be accessed using call";
+        case 18: return "incorrect symbol during procedure declaration";
+        case 19: return "procedure and const cannot be reassigned";
+        case 20: return "identifier is out of scope";
+        case 21: return "program is too large";
+        case 25: return "out of memory";
+        case 34: return "Symbol is invalid";
+        case 35: return "Name is too long";
+        case 36: return "Too many digits";
+        default: return "unkown error type ???";
+    }
+}
+
+// Adds a diagnostic for the given error number at the token at index
+void report(pl0_compiler *ctx, int error_num, int index){
+    if (index < 0 || index >= ctx->tkn_list.size)
+        index = -1;
+    // Room for one more is kept at all times, so that running out of memory can be reported
+    size_t bytes = (size_t) (ctx->diagnostic_count + 2) * sizeof(pl0_diagnostic);
+    if (bytes > ctx->diagnostics_mem.cap)
+        ctx->diagnostics = arena_fit(&ctx->pool, &ctx->diagnostics_mem, bytes);
+    pl0_diagnostic *d = &ctx->diagnostics[ctx->diagnostic_count++];
+    d->error = error_num;
+    d->token = index;
+    d->offset = index >= 0 ? ctx->tkn_list.offsets[index & ctx->tkn_list.mask] : (uint32_t) ctx->tkn_list.src_size;
+    d->line = d->column = 0;
+    if (error_num == 7 && index >= 0)
+        snprintf(d->message, sizeof d->message, "%s %.*s", pl0_error_text(7), lexeme_len(ctx, index), lexeme(ctx, index));
+    else
+        snprintf(d->message, sizeof d->message, "%s", pl0_error_text(error_num));
+}
+
+// Reports the given error number at the current token and resumes at the innermost recovery
+// point. An error at the token the last recovery stopped at, or right after an invalid lexeme, is
+// usually a consequence of the one reported there, so it is not reported again. Errors outside
+// every recovery point, and running out of room, end the compilation.
+void error(pl0_compiler *ctx, int error_num){
+    int index = ctx->tkn_list.current_index;
+    int after_lexical = index > 0 && index < ctx->tkn_list.size
+        && ctx->tkn_list.tokens[(index - 1) & ctx->tkn_list.mask] > 33;
+    if ((index != ctx->sync_index && !after_lexical) || ctx->diagnostic_count == 0)
+        report(ctx, error_num, index);
+    if (ctx->recover == NULL || error_num == 21 || error_num == 25)
+        longjmp(ctx->fail, 2);
+    longjmp(*ctx->recover, 1);
+}
+
+// Skips ahead to the next token that is in the sync set (a bit per token value) or ends the program
+static void skip_to(pl0_compiler *ctx, uint64_t sync){
+    while (ctx->tkn_list.token != 0 && !(sync >> ctx->tkn_list.token & 1))
+        update_tokens(ctx, get_next_token(ctx));
+    ctx->sync_index = ctx->tkn_list.current_index;
+}
+
+// Parses with parse, and if it reports an error skips ahead to the next token that is in the
+// sync set or ends the program. A ';' the skip stops at is consumed when eat_semicolon is set.
+// Returns 1 if there was an error.
+static int parse_or_sync(pl0_compiler *ctx, void (*parse)(pl0_compiler *ctx), uint64_t sync, int eat_semicolon){
+    jmp_buf here;
+    jmp_buf *outer = ctx->recover;
+    volatile int failed = 0;
+    ctx->recover = &here;
+    if (setjmp(here) == 0)
+        parse(ctx);
+    else
+        failed = 1;
+    ctx->recover = outer;
+    if (failed) {
+        skip_to(ctx, sync);
+        if (eat_semicolon && ctx->tkn_list.token == 18) {
+            update_tokens(ctx, get_next_token(ctx));
+            ctx->sync_index = ctx->tkn_list.current_index;
+        }
+    }
+    return failed;
+}
+
+// Stores a new instruction to the assembly code array, growing it when it is full
+void emit(pl0_compiler *ctx, int OP, int L, int M) {
+    // Without code, jumps are patched in the slot at index 1 and nothing is ever folded
+    if (ctx->syntax_only)
+        return;
+
+    if ((size_t) (ctx->code.cx + 1) * sizeof(assembly) > ctx->code.mem.cap)
+        ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, (size_t) (ctx->code.cx + 1) * sizeof(assembly));
+    ctx->code.code[ctx->code.cx].OP = OP; //opcode
+    ctx->code.code[ctx->code.cx].L = L; // lexicographical level
+    ctx->code.code[ctx->code.cx].M = M; // modifier
+    ctx->code.cx++;
+    ctx->code.size++;
+    ctx->stats.instructions++;
+}
+
+// Makes room for one more symbol at the end of the symbol table
+void reserve_symbol(pl0_compiler *ctx) {
+    if ((size_t) (ctx->sym_table.size + 1) * sizeof(symbol) > ctx->sym_table.table_mem.cap)
+        ctx->sym_table.table = arena_fit(&ctx->pool, &ctx->sym_table.table_mem, (size_t) (ctx->sym_table.size + 1) * sizeof(symbol));
+}
+
+// Abstract syntax tree
+//
+// The parser checks the program and resolves every name, building a tree of the whole program:
+// a block node for the main block and each procedure, holding the size of its frame, its
+// procedures and its statement. Declarations need no other nodes, as their effect is in the
+// symbol table. Once program() returns, fold_statement() turns every constant expression into a
+// number node and gen_program() walks the tree to emit the code: each block's JMP over its
+// procedures, the procedures with their RTN, its INC and its statement, and the final halt. A
+// procedure's address is set as its block is generated. The nodes live in one array in the
+// context that only grows at the end, so building a node is a bump of its count.
+//
+// With ctx->streaming set, or when procedures are reused from a store or compiled in parallel,
+// which both work on code as it is parsed, the parser emits the JMP, INC and RTN of each block
+// itself and generates each statement of a block's begin as soon as it is parsed, dropping its
+// nodes by putting the count back, so a huge main block does not hold its whole tree. Setting
+// ctx->ast.keep then keeps every block's nodes instead, linked under block nodes for list_ast();
+// the procedures of the main block are not compiled in parallel, as workers build their trees
+// in contexts of their own.
+
+// Adds a node of kind with children a and b, returning its index
+static int ast_new(pl0_compiler *ctx, int kind, int a, int b){
+    ast_tree *t = &ctx->ast;
+    if ((size_t) (t->count + 1) * sizeof(ast_node) > t->mem.cap)
+        t->nodes = arena_fit(&ctx->pool, &t->mem, (size_t) (t->count + 1) * sizeof(ast_node));
+    ast_node *n = &t->nodes[t->count];
+    n->kind = (unsigned char) kind;
+    n->op = 0;
+    n->a = a;
+    n->b = b;
+    n->next = -1;
+    n->sym = -1;
+    n->L = 0;
+    n->M = 0;
+    ctx->stats.ast_nodes++;
+    return t->count++;
+}
+
+// Adds a node of kind naming symbol sym, with its level and address as the current block sees
+// them and its value in a
+static int ast_symbol(pl0_compiler *ctx, int kind, int sym){
+    int n = ast_new(ctx, kind, ctx->sym_table.table[sym].val, -1);
+    ast_node *node = &ctx->ast.nodes[n];
+    node->sym = sym;
+    node->L = ctx->sym_table.current_level - ctx->sym_table.table[sym].level;
+    node->M = ctx->sym_table.table[sym].addr;
+    return n;
+}
+
+// Adds a block node for the procedure whose heading is symbol sym (-1 for the main block) as
+// the last procedure of ctx->ast.parent
+static int ast_block(pl0_compiler *ctx, int sym){
+    int n = ast_new(ctx, AST_BLOCK, -1, -1);
+    ast_node *nodes = ctx->ast.nodes;
+    nodes[n].sym = sym >= 0 && ctx->sym_table.table[sym].kind == 3 ? sym : -1;
+    nodes[n].L = -1; // Its last procedure while they are parsed
+    int parent = ctx->ast.parent;
+    if (parent < 0)
+        ctx->ast.root = n;
+    else {
+        if (nodes[parent].L < 0)
+            nodes[parent].b = n;
+        else
+            nodes[nodes[parent].L].next = n;
+        nodes[parent].L = n;
+    }
+    return n;
+}
+
+// Folds the constants of statement n and emits its code, for a compile that streams
+static void stream_statement(pl0_compiler *ctx, int n){
+    if (ctx->opt_level > 0)
+        fold_statement(ctx, n);
+    gen_statement(ctx, n);
+}
+
+// Parses the next statement of begin node list and puts it after last, returning the new last.
+// While streaming, the statement's code is generated and its nodes dropped instead.
+static int begin_statement(pl0_compiler *ctx, int list, int last){
+    int mark = ctx->ast.count;
+    int s = statement(ctx);
+    if (ctx->ast.stream) {
+        stream_statement(ctx, s);
+        ctx->ast.count = mark;
+        return last;
+    }
+    if (s < 0)
+        return last;
+    if (last < 0)
+        ctx->ast.nodes[list].a = s;
+    else
+        ctx->ast.nodes[last].next = s;
+    return s;
+}
+
+// Incremental compilation
+//
+// With a procedure store, the block of every procedure is fingerprinted by the hash of its
+// source and by what each name it looks up outside itself resolves to: a const's value, a var's
+// level and address, a procedure's level. A procedure whose block and outside lookups are the
+// same as in the last compile is not parsed again. Its code is copied from the store with jump
+// and CAL addresses inside it moved to where it now starts and calls to outside procedures
+// pointed at their current address, and its symbols are put back as a compile would have left
+// them. The output is the same as compiling everything.
+
+// Records the lookup of the current token for every procedure being compiled that it resolved
+// outside of. Returns found.
+int note_lookup(pl0_compiler *ctx, int found){
+    proc_store *st = &ctx->procs;
+    if (st->depth > 0 && found < st->frames[st->depth - 1].first) {
+        size_t bytes = (size_t) (st->lookup_count + 1) * sizeof(proc_lookup);
+        if (bytes > st->lookups_mem.cap)
+            st->lookups = arena_fit(&ctx->pool, &st->lookups_mem, bytes);
+        proc_lookup *l = &st->lookups[st->lookup_count++];
+        l->token = ctx->tkn_list.current_index;
+        l->declare = ctx->sym_table.declare;
+        l->found = found;
+    }
+    return found;
+}
+
+// Returns the index of the token starting at offset
+static int token_at(pl0_compiler *ctx, uint32_t offset){
+    int lo = 0, hi = ctx->tkn_list.size - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ctx->tkn_list.offsets[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Hash of the source of tokens first up to first + count
+static uint64_t span_hash(pl0_compiler *ctx, int first, int count){
+    int last = first + count - 1;
+    uint32_t from = ctx->tkn_list.offsets[first];
+    uint32_t to = ctx->tkn_list.offsets[last] + ctx->tkn_list.lengths[last];
+    return hash64(ctx->tkn_list.src + from, to - from, (uint64_t) count);
+}
+
+// What a lookup that went outside a block gives now, before the block is entered
+static int outside_lookup(pl0_compiler *ctx, int declare, int id){
+    return declare ? ctx->sym_table.newest_const[id] : ctx->sym_table.newest[id];
+}
+
+// Appends old entries first up to first + count, with their symbols and externals, to the new
+// store. Their code is left where it is until the store is saved.
+static void keep_entries(pl0_compiler *ctx, int first, int count){
+    proc_store *st = &ctx->procs;
+    for (int e = first; e < first + count; e++) {
+        proc_entry entry = st->old_entries[e];
+        st->entries = arena_fit(&ctx->pool, &st->entries_mem, (size_t) (st->entry_count + 1) * sizeof(proc_entry));
+        st->symbols = arena_fit(&ctx->pool, &st->symbols_mem, (size_t) (st->symbol_count + entry.symbol_count + 1) * sizeof(proc_symbol));
+        st->externals = arena_fit(&ctx->pool, &st->externals_mem, (size_t) (st->external_count + entry.external_count + 1) * sizeof(proc_external));
+        memcpy(st->symbols + st->symbol_count, st->old_symbols + entry.symbol, entry.symbol_count * sizeof(proc_symbol));
+        memcpy(st->externals + st->external_count, st->old_externals + entry.external, entry.external_count * sizeof(proc_external));
+        entry.kept = 1;
+        entry.symbol = (uint32_t) st->symbol_count;
+        entry.external = (uint32_t) st->external_count;
+        st->code_total += (int) entry.code_count;
+        st->symbol_count += (int) entry.symbol_count;
+        st->external_count += (int) entry.external_count;
+        st->entries[st->entry_count++] = entry;
+    }
+}
+
+// Puts the block of the procedure with the given path in place from the store, if its source
+// and everything it looks up outside itself are unchanged. The current token is the first of
+// the block. Returns 1 if it did.
+static int reuse_procedure(pl0_compiler *ctx, uint64_t path){
+    proc_store *st = &ctx->procs;
+    if (st->old == NULL || st->old->stamp != st->stamp)
+        return 0;
+    int e = -1;
+    for (uint32_t h = (uint32_t) path & (uint32_t) st->old_mask; st->old_index[h] != -1; h = (h + 1) & (uint32_t) st->old_mask) {
+        if (st->old_entries[st->old_index[h]].path == path) {
+            e = st->old_index[h];
+            break;
+        }
+    }
+    if (e < 0)
+        return 0;
+    const proc_entry *entry = &st->old_entries[e];
+    int first = ctx->tkn_list.current_index;
+    if ((int) entry->level != ctx->sym_table.current_level || first < 0
+        || entry->span_tokens > (uint32_t) (ctx->tkn_list.size - first)
+        || span_hash(ctx, first, (int) entry->span_tokens) != entry->span_hash)
+        return 0;
+
+    const proc_external *ext = st->old_externals + entry->external;
+    for (uint32_t i = 0; i < entry->external_count; i++) {
+        int found = outside_lookup(ctx, ext[i].declare, ctx->tkn_list.values[first + ext[i].token]);
+        if ((found >= 0) != (ext[i].found != 0))
+            return 0;
+        if (found < 0)
+            continue;
+        const symbol *sym = &ctx->sym_table.table[found];
+        if (sym->kind != ext[i].kind || sym->val != ext[i].val || sym->level != ext[i].level
+            || sym->mark != ext[i].mark || (sym->kind != 3 && sym->addr != ext[i].addr))
+            return 0;
+    }
+
+    // The code, with its own jumps and calls moved and calls out of it redirected
+    int start = ctx->code.cx;
+    int delta = 3 * (start - (int) entry->start);
+    size_t bytes = (size_t) (start + (int) entry->code_count) * sizeof(assembly);
+    if (bytes > ctx->code.mem.cap)
+        ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, bytes);
+    assembly *code = ctx->code.code + start;
+    memcpy(code, st->old_code + entry->code, entry->code_count * sizeof(assembly));
+    ctx->code.cx += (int) entry->code_count;
+    ctx->code.size += (int) entry->code_count;
+    ctx->stats.instructions += entry->code_count;
+    for (uint32_t i = 0; i < entry->code_count; i++) {
+        if (code[i].OP < 5 || code[i].OP > 8 || code[i].OP == 6)
+            continue;
+        int target = code[i].M / 3 + 1;
+        if (code[i].OP != 5 || (target >= (int) entry->start && target < (int) (entry->start + entry->code_count))) {
+            code[i].M += delta;
+            continue;
+        }
+        for (uint32_t k = 0; k < entry->external_count; k++) {
+            if (ext[k].found && ext[k].kind == 3 && ext[k].addr == code[i].M) {
+                int id = ctx->tkn_list.values[first + ext[k].token];
+                code[i].M = ctx->sym_table.table[outside_lookup(ctx, ext[k].declare, id)].addr;
+                break;
+            }
+        }
+    }
+
+    // The symbols declared inside it, as closing its scope left them
+    const proc_symbol *sym = st->old_symbols + entry->symbol;
+    for (uint32_t i = 0; i < entry->symbol_count; i++) {
+        int token = first + sym[i].token;
+        int id = ctx->tkn_list.values[token];
+        reserve_symbol(ctx);
+        symbol *s = &ctx->sym_table.table[ctx->sym_table.size];
+        s->kind = sym[i].kind;
+        s->name = lexeme(ctx, token);
+        s->name_len = lexeme_len(ctx, token);
+        s->id = id;
+        s->val = sym[i].val;
+        s->level = sym[i].level;
+        s->addr = sym[i].addr + (sym[i].kind == 3 ? delta : 0);
+        s->mark = sym[i].mark;
+        s->shadow = sym[i].kind == 1 ? -1 : ctx->sym_table.visible[id];
+        ctx->sym_table.newest[id] = ctx->sym_table.size;
+        if (sym[i].kind == 1)
+            ctx->sym_table.newest_const[id] = ctx->sym_table.size;
+        if (sym[i].kind == 3)
+            ctx->sym_table.procIdx = ctx->sym_table.size;
+        ctx->sym_table.size++;
+        ctx->sym_table.symIdx++;
+    }
+
+    // Its outside lookups are lookups of the procedures around it too
+    for (uint32_t i = 0; i < entry->external_count; i++) {
+        int token = first + ext[i].token;
+        int found = outside_lookup(ctx, ext[i].declare, ctx->tkn_list.values[token]);
+        int current = ctx->tkn_list.current_index, declare = ctx->sym_table.declare;
+        ctx->tkn_list.current_index = token;
+        ctx->sym_table.declare = ext[i].declare;
+        note_lookup(ctx, found);
+        ctx->tkn_list.current_index = current;
+        ctx->sym_table.declare = declare;
+    }
+
+    keep_entries(ctx, e - (int) entry->nested, (int) entry->nested + 1);
+    st->reused += (int) entry->nested + 1;
+    update_tokens(ctx, first + (int) entry->span_tokens);
+    ctx->sym_table.declare = 0; // As block() leaves it
+    return 1;
+}
+
+// Adds the procedure whose block was just compiled to the new store
+static void save_procedure(pl0_compiler *ctx, const proc_frame *f){
+    proc_store *st = &ctx->procs;
+    int span_tokens = ctx->tkn_list.current_index - f->token;
+    int code_count = ctx->code.cx - f->start;
+    int symbol_count = ctx->sym_table.size - f->first;
+    if (span_tokens <= 0 || ctx->tkn_list.current_index > ctx->tkn_list.size)
+        return;
+    st->entries = arena_fit(&ctx->pool, &st->entries_mem, (size_t) (st->entry_count + 1) * sizeof(proc_entry));
+    st->code = arena_fit(&ctx->pool, &st->code_mem, (size_t) (st->code_count + code_count) * sizeof(assembly));
+    st->symbols = arena_fit(&ctx->pool, &st->symbols_mem, (size_t) (st->symbol_count + symbol_count + 1) * sizeof(proc_symbol));
+
+    proc_entry *entry = &st->entries[st->entry_count];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = f->path;
+    entry->span_hash = span_hash(ctx, f->token, span_tokens);
+    entry->span_tokens = (uint32_t) span_tokens;
+    entry->level = (uint32_t) (ctx->sym_table.current_level);
+    entry->start = (uint32_t) f->start;
+    entry->code = (uint32_t) st->code_count;
+    entry->code_count = (uint32_t) code_count;
+    memcpy(st->code + st->code_count, ctx->code.code + f->start, (size_t) code_count * sizeof(assembly));
+    st->code_count += code_count;
+    st->code_total += code_count;
+
+    entry->symbol = (uint32_t) st->symbol_count;
+    entry->symbol_count = (uint32_t) symbol_count;
+    for (int i = f->first; i < ctx->sym_table.size; i++) {
+        const symbol *s = &ctx->sym_table.table[i];
+        proc_symbol *p = &st->symbols[st->symbol_count++];
+        p->kind = s->kind;
+        p->val = s->val;
+        p->level = s->level;
+        p->addr = s->addr;
+        p->mark = s->mark;
+        p->token = token_at(ctx, (uint32_t) (s->name - ctx->tkn_list.src)) - f->token;
+    }
+
+    // Each outside name once per kind of lookup
+    entry->external = (uint32_t) st->external_count;
+    int stamp = st->entry_count + 1;
+    for (int i = f->lookups; i < st->lookup_count; i++) {
+        const proc_lookup *l = &st->lookups[i];
+        if (l->found >= f->first)
+            continue;
+        int id = ctx->tkn_list.values[l->token];
+        int *seen = &st->seen[2 * id + (l->declare != 0)];
+        if (*seen == stamp)
+            continue;
+        *seen = stamp;
+        st->externals = arena_fit(&ctx->pool, &st->externals_mem, (size_t) (st->external_count + 1) * sizeof(proc_external));
+        proc_external *x = &st->externals[st->external_count++];
+        memset(x, 0, sizeof(*x));
+        x->token = l->token - f->token;
+        x->declare = l->declare != 0;
+        x->found = l->found >= 0;
+        if (l->found >= 0) {
+            const symbol *s = &ctx->sym_table.table[l->found];
+            x->kind = s->kind;
+            x->val = s->val;
+            x->level = s->level;
+            x->addr = s->addr;
+            x->mark = s->mark;
+        }
+    }
+    entry->external_count = (uint32_t) (st->external_count - (int) entry->external);
+    entry->nested = (uint32_t) (st->entry_count - f->entries);
+    st->entry_count++;
+}
+
+// Compiles the block of the procedure whose heading was just parsed, or takes it from the
+// procedure store when nothing it depends on has changed
+static void procedure_body(pl0_compiler *ctx){
+    proc_store *st = &ctx->procs;
+    if (!st->enabled || ctx->syntax_only || ctx->diagnostic_count > 0) {
+        block(ctx);
+        if (!ctx->ast.deferred)
+            emit(ctx, 2, 0, 0);
+        return;
+    }
+    const symbol *proc = &ctx->sym_table.table[ctx->sym_table.size - 1];
+    uint64_t path = hash64(proc->name, (size_t) proc->name_len, st->depth > 0 ? st->frames[st->depth - 1].path : 0);
+    int heading = ctx->sym_table.size - 1;
+    if (reuse_procedure(ctx, path)) {
+        if (ctx->ast.keep)
+            ctx->ast.nodes[ast_block(ctx, heading)].op = 1;
+        return;
+    }
+
+    st->frames = arena_fit(&ctx->pool, &st->frames_mem, (size_t) (st->depth + 1) * sizeof(proc_frame));
+    proc_frame *f = &st->frames[st->depth++];
+    f->path = path;
+    f->first = ctx->sym_table.size;
+    f->start = ctx->code.cx;
+    f->token = ctx->tkn_list.current_index;
+    f->entries = st->entry_count;
+    f->lookups = st->lookup_count;
+    int lookups = f->lookups; // block() may move the frames
+    block(ctx);
+    emit(ctx, 2, 0, 0);
+    st->depth--;
+    if (ctx->diagnostic_count == 0)
+        save_procedure(ctx, &st->frames[st->depth]);
+    st->recompiled++;
+
+    // Only lookups that went outside the enclosing procedure too are still needed
+    int kept = lookups;
+    for (int i = lookups; st->depth > 0 && i < st->lookup_count; i++)
+        if (st->lookups[i].found < st->frames[st->depth - 1].first)
+            st->lookups[kept++] = st->lookups[i];
+    st->lookup_count = kept;
+}
+
+void program(pl0_compiler *ctx){
+    // BLOCK
+    // if token != periodsym
+    //      error
+    // emit HALT
+
+    ctx->sym_table.size = 0;
+    ctx->sym_table.scope_size = 0;
+    // A pipelined compile does not know how many ids there are yet; they are fitted as they come
+    ctx->sym_table.id_count = 0;
+    fit_ids(ctx, ctx->tkn_list.ring ? 1024 : ctx->interns.size > 0 ? ctx->interns.size : 1);
+    ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, 1024 * sizeof(assembly));
+    ctx->code.cx = 1;
+    update_tokens(ctx, 0);
+    block(ctx);
+    if (ctx->tkn_list.token != 19)
+         error(ctx, 1);
+    if (!ctx->ast.deferred)
+        emit(ctx, 9, 0, 3);
+}
+
+void block(pl0_compiler *ctx){
+    // CONST-DECLARATION
+    // numVars = VAR-DECLARATION
+    // emit INC (M = 3 + numVars)
+    // STATEMENT
+    // A procedure's block comes right after its heading. When the code is generated after
+    // parsing, the block only builds its node; gen_program() emits the JMP and INC.
+    int deferred = ctx->ast.deferred;
+    int node = -1, outer = ctx->ast.parent;
+    if (ctx->ast.keep || deferred)
+        node = ast_block(ctx, ctx->sym_table.current_level > 0 ? ctx->sym_table.size - 1 : -1);
+    open_scope(ctx);
+    ctx->sym_table.declare = 1;
+    int jmpaddr = ctx->code.cx;
+    if (!deferred)
+        emit (ctx, 7, 0, jmpaddr);
+    const_declaration(ctx);
+    int num_vars = var_declaration(ctx);
+    ctx->ast.parent = node;
+    procedure_declaration(ctx);
+    ctx->ast.parent = outer;
+    if (!deferred) {
+        ctx->code.code[jmpaddr].M = (ctx->code.cx - 1) * 3;
+        emit(ctx, 6, 0, 3 + num_vars);
+    }
+    ctx->sym_table.declare = 0;
+    // A streamed block's procedures have dropped their nodes already, so this drops them all
+    int mark = ctx->ast.count;
+    ctx->ast.stream = node < 0 && !ctx->syntax_only;
+    int body = statement(ctx);
+    ctx->ast.stream = 0;
+    if (!deferred && !ctx->syntax_only)
+        stream_statement(ctx, body);
+    if (node >= 0) {
+        ctx->ast.nodes[node].a = body;
+        ctx->ast.nodes[node].M = 3 + num_vars;
+    }
+    else
+        ctx->ast.count = mark;
+    close_scope(ctx);
+}
+
+static void const_declaration_body(pl0_compiler *ctx){
+    // if (token == 28)
     // {
     //     // do {
     //     //     get next token
@@ -824,516 +4262,3694 @@ void const_declaration(){
     //     // get next token
     // }
     
-    if (global_tkn_list.token == 28)
+    if (ctx->tkn_list.token == 28)
+    {
+        do {
+            update_tokens(ctx, get_next_token(ctx));
+            if (ctx->tkn_list.token != 2)
+                error(ctx, 2);
+            if (symbol_table_check(ctx) != -1)
+                error(ctx, 19);
+            reserve_symbol(ctx);
+            // save ident name
+            ctx->sym_table.table[ctx->sym_table.size].name = lexeme(ctx, ctx->tkn_list.current_index);
+            ctx->sym_table.table[ctx->sym_table.size].name_len = lexeme_len(ctx, ctx->tkn_list.current_index);
+            ctx->sym_table.table[ctx->sym_table.size].id = token_value(ctx);
+            update_tokens(ctx, get_next_token(ctx));
+            if (ctx->tkn_list.token != 9)
+                error(ctx, 4);
+            update_tokens(ctx, get_next_token(ctx));
+            if (ctx->tkn_list.token!= 3)
+                error(ctx, 5);
+            // add to symbol table (kind 1, value, L, M, mark)
+            ctx->sym_table.table[ctx->sym_table.size].kind = 1;
+            ctx->sym_table.table[ctx->sym_table.size].val = token_value(ctx);
+            ctx->sym_table.table[ctx->sym_table.size].level = 0; 
+            ctx->sym_table.table[ctx->sym_table.size].addr = 0;
+            ctx->sym_table.table[ctx->sym_table.size].mark = 0;
+            index_symbol(ctx);
+            ctx->sym_table.size++;
+            update_tokens(ctx, get_next_token(ctx));
+        } while (ctx->tkn_list.token == 17);
+        if (ctx->tkn_list.token!= 18)
+            error(ctx, 6);
+        update_tokens(ctx, get_next_token(ctx));
+    }
+}
+
+// Declarations resume at the next declaration or statement keyword, or after the next ';'
+#define SYNC(token) ((uint64_t) 1 << (token))
+#define SYNC_STATEMENT (SYNC(18) | SYNC(19) | SYNC(22))
+#define SYNC_CONDITION (SYNC_STATEMENT | SYNC(24) | SYNC(26))
+#define STARTS_STATEMENT(token) ((SYNC(2) | SYNC(21) | SYNC(23) | SYNC(25) | SYNC(27) | SYNC(31) | SYNC(32)) >> (token) & 1)
+#define SYNC_DECLARATION (SYNC(18) | SYNC(19) | SYNC(21) | SYNC(23) | SYNC(25) | SYNC(27) | SYNC(28) \
+                          | SYNC(29) | SYNC(30) | SYNC(31) | SYNC(32))
+
+void const_declaration(pl0_compiler *ctx){
+    parse_or_sync(ctx, const_declaration_body, SYNC_DECLARATION, 1);
+}
+
+static void var_declaration_body(pl0_compiler *ctx){
+    // if (token == varsym) {
+    //     do {
+    //     num_vars++
+    //     get next token
+    //     if token != identsym
+    //         error
+    //     if symbol_table_check (token) != -1
+    //         error
+    //     add to symbol table (kind 2, ident, 0, 0, var# + 2)
+    //     get next token
+    //     } while (token == commasym)
+    //     if (token != semicolonsym)
+    //         error
+    //     get next token
+    // }
+    
+    if (ctx->tkn_list.token == 29) {
+        int space = 3;
+        do {
+        update_tokens(ctx, get_next_token(ctx));
+        if (ctx->tkn_list.token != 2)
+            error(ctx, 2);
+        if (symbol_table_check(ctx) != -1)
+            error(ctx, 3);
+        reserve_symbol(ctx);
+        // add to symbol table (kind 2, name, 0, L, M, mark)
+        ctx->sym_table.table[ctx->sym_table.size].kind = 2;
+        ctx->sym_table.table[ctx->sym_table.size].name = lexeme(ctx, ctx->tkn_list.current_index);
+        ctx->sym_table.table[ctx->sym_table.size].name_len = lexeme_len(ctx, ctx->tkn_list.current_index);
+        ctx->sym_table.table[ctx->sym_table.size].id = token_value(ctx);
+        ctx->sym_table.table[ctx->sym_table.size].val = 0;
+        ctx->sym_table.table[ctx->sym_table.size].level = ctx->sym_table.current_level;
+        ctx->sym_table.table[ctx->sym_table.size].addr = space;
+        ctx->sym_table.table[ctx->sym_table.size].mark = 0;
+        index_symbol(ctx);
+        ctx->sym_table.size++;
+        ctx->sym_table.symIdx++;
+        space++;
+        update_tokens(ctx, get_next_token(ctx));
+        } while (ctx->tkn_list.token == 17);
+        if (ctx->tkn_list.token != 18)
+            error(ctx, 6);
+        update_tokens(ctx, get_next_token(ctx));
+    }
+}
+
+// Returns the number of variables declared
+int var_declaration(pl0_compiler *ctx){
+    int first = ctx->sym_table.size;
+    parse_or_sync(ctx, var_declaration_body, SYNC_DECLARATION, 1);
+    return ctx->sym_table.size - first;
+}
+
+// "procedure" ident ";"
+static void procedure_heading(pl0_compiler *ctx){
+    update_tokens(ctx, get_next_token(ctx));  
+    if (ctx->tkn_list.token != 2)         // ident
+        error(ctx, 2);
+    if (symbol_table_check(ctx) != -1)         // Check if procedure has been declared already
+        error(ctx, 19);
+    reserve_symbol(ctx);
+    // add to symbol table (kind 3, ident, 0, 0, var# + 2)
+    ctx->sym_table.table[ctx->sym_table.size].kind = 3;
+    ctx->sym_table.table[ctx->sym_table.size].name = lexeme(ctx, ctx->tkn_list.current_index);
+    ctx->sym_table.table[ctx->sym_table.size].name_len = lexeme_len(ctx, ctx->tkn_list.current_index);
+    ctx->sym_table.table[ctx->sym_table.size].id = token_value(ctx);
+    ctx->sym_table.table[ctx->sym_table.size].val = 0;
+    ctx->sym_table.table[ctx->sym_table.size].level = ctx->sym_table.current_level;
+    // The procedure starts at the JMP its block is about to emit
+    ctx->sym_table.table[ctx->sym_table.size].addr = 3 * (ctx->code.cx - 1);
+    ctx->sym_table.table[ctx->sym_table.size].mark = 0;
+    ctx->sym_table.procIdx = ctx->sym_table.size;
+    index_symbol(ctx);
+    ctx->sym_table.size++;
+    ctx->sym_table.symIdx++; 
+    update_tokens(ctx, get_next_token(ctx));  
+    if (ctx->tkn_list.token != 18)        // ";"
+        error(ctx, 18);                           
+    update_tokens(ctx, get_next_token(ctx));
+}
+
+// The ";" after a procedure's block
+static void procedure_end(pl0_compiler *ctx){
+    if (ctx->tkn_list.token != 18)        // ";"
+        error(ctx, 6);                         
+    update_tokens(ctx, get_next_token(ctx)); 
+}
+
+// "procedure" ident ";" block ";"
+static void procedure_unit(pl0_compiler *ctx){
+    parse_or_sync(ctx, procedure_heading, SYNC_DECLARATION, 1);
+    procedure_body(ctx);
+    parse_or_sync(ctx, procedure_end, SYNC_DECLARATION, 1);
+}
+
+void procedure_declaration(pl0_compiler *ctx){
+    //  {"procedure" ident ";" block ";"}
+    if (ctx->tkn_list.token == 30 && ctx->sym_table.current_level == 1)
+        compile_parallel(ctx);
+    while (ctx->tkn_list.token == 30)         // "procedure"
+        procedure_unit(ctx);
+}
+
+// Parallel compilation
+//
+// The procedures of the main block only depend on what was declared before them, so with
+// --threads they are compiled at the same time. A pre-scan finds where each one ends from the
+// shape of blocks alone. Every worker takes a run of consecutive procedures, with a copy of the
+// main block's scope that has the headings of the procedures before its run declared at
+// placeholder addresses, and compiles them into a code array of its own. The results are then
+// spliced into the context in source order: the code is moved to where it lands, calls to the
+// procedures of earlier runs get their real address, and each name a procedure resolved outside
+// itself is looked up again, as for the procedure store, to catch what its worker could not see,
+// such as names declared inside the procedures of other runs. The first procedure that had an
+// error or does not splice is compiled again the usual way along with everything after it, so
+// the output is always that of a serial compile.
+
+#define PARALLEL_MIN_TOKENS 4096 // Procedures with fewer tokens than this are not worth the threads
+
+// Returns the index of the ";" or "." that ends the block starting at token i, or -1 if it does
+// not have the shape of a block
+static int scan_block(const token_list *list, int i){
+    const unsigned char *t = list->tokens;
+    int n = list->size;
+    for (int decl = 28; decl <= 29; decl++) {       // const, then var
+        if (i < n && t[i] == decl) {
+            while (i < n && t[i] != 18)
+                i++;
+            i++;
+        }
+    }
+    while (i < n && t[i] == 30) {
+        if (i + 2 >= n || t[i + 1] != 2 || t[i + 2] != 18)
+            return -1;
+        i = scan_block(list, i + 3);
+        if (i < 0 || t[i] != 18)
+            return -1;
+        i++;
+    }
+    // A statement only holds a ";" between begin and end
+    for (int depth = 0; i < n; i++) {
+        if (t[i] == 21)
+            depth++;
+        else if (t[i] == 22 && --depth < 0)
+            return -1;
+        else if (t[i] >= 28 && t[i] <= 30)
+            return -1;
+        else if (depth == 0 && (t[i] == 18 || t[i] == 19))
+            return i;
+    }
+    return -1;
+}
+
+// Adds the counters of after that are past those of before to to
+static void add_stats(pl0_stats *to, const pl0_stats *after, const pl0_stats *before){
+    to->tokens += after->tokens - before->tokens;
+    to->keyword_lookups += after->keyword_lookups - before->keyword_lookups;
+    to->intern_probes += after->intern_probes - before->intern_probes;
+    to->symbol_lookups += after->symbol_lookups - before->symbol_lookups;
+    to->symbol_comparisons += after->symbol_comparisons - before->symbol_comparisons;
+    to->scopes_opened += after->scopes_opened - before->scopes_opened;
+    to->scopes_closed += after->scopes_closed - before->scopes_closed;
+    to->instructions += after->instructions - before->instructions;
+    to->ast_nodes += after->ast_nodes - before->ast_nodes;
+}
+
+// Makes room for count worker contexts. Their arenas are registered by address, so existing
+// workers are released before the array can move.
+static void fit_workers(pl0_compiler *ctx, int count){
+    parallel_state *par = &ctx->par;
+    if (count <= par->worker_count)
+        return;
+    for (int i = 0; i < par->worker_count; i++)
+        pl0_free(&par->workers[i]);
+    size_t align = _Alignof(pl0_compiler);
+    char *base = arena_fit(&ctx->pool, &par->workers_mem, (size_t) count * sizeof(pl0_compiler) + align);
+    memset(base, 0, par->workers_mem.cap);
+    par->workers = (pl0_compiler *) (((uintptr_t) base + align - 1) & ~(uintptr_t) (align - 1));
+    for (int i = 0; i < count; i++)
+        pl0_init(&par->workers[i]);
+    par->worker_count = count;
+}
+
+// Sets up w to compile from the first unit of chunk c on: the tokens and the main block's
+// scope of ctx, with the headings of the units before the chunk declared
+static void start_worker(pl0_compiler *ctx, par_chunk *c){
+    pl0_compiler *w = c->worker;
+    symbol_table *t = &w->sym_table, *m = &ctx->sym_table;
+    w->opt_level = ctx->opt_level;
+    w->diagnostic_count = 0;
+    w->sync_index = -2;
+    w->recover = NULL;
+    memset(&w->stats, 0, sizeof(w->stats));
+    w->tkn_list.src = ctx->tkn_list.src;
+    w->tkn_list.src_size = ctx->tkn_list.src_size;
+    w->tkn_list.tokens = ctx->tkn_list.tokens;
+    w->tkn_list.offsets = ctx->tkn_list.offsets;
+    w->tkn_list.lengths = ctx->tkn_list.lengths;
+    w->tkn_list.values = ctx->tkn_list.values;
+    w->tkn_list.size = ctx->tkn_list.size;
+    w->tkn_list.mask = -1;
+
+    t->table = arena_fit(&w->pool, &t->table_mem, (size_t) (m->size + c->first + 1) * sizeof(symbol));
+    memcpy(t->table, m->table, (size_t) m->size * sizeof(symbol));
+    t->size = m->size;
+    t->id_count = 0;
+    fit_ids(w, m->id_count);
+    memcpy(t->newest, m->newest, (size_t) m->id_count * sizeof(int));
+    memcpy(t->newest_const, m->newest_const, (size_t) m->id_count * sizeof(int));
+    memcpy(t->visible, m->visible, (size_t) m->id_count * sizeof(int));
+    t->scope_stack = arena_fit(&w->pool, &t->scope_stack_mem, (size_t) (m->scope_size + c->first + 1) * sizeof(int));
+    memcpy(t->scope_stack, m->scope_stack, (size_t) m->scope_size * sizeof(int));
+    t->scope_size = m->scope_size;
+    t->scope_start = arena_fit(&w->pool, &t->scope_start_mem, (size_t) (m->current_level + 1) * sizeof(int));
+    memcpy(t->scope_start, m->scope_start, (size_t) (m->current_level + 1) * sizeof(int));
+    t->current_level = m->current_level;
+    // The block of the procedure before leaves declare off
+    t->declare = c->first == 0 ? m->declare : 0;
+    for (int u = 0; u < c->first; u++) {
+        int name = ctx->par.units[u].first + 1;
+        symbol *s = &t->table[t->size];
+        s->kind = 3;
+        s->name = lexeme(w, name);
+        s->name_len = lexeme_len(w, name);
+        s->id = w->tkn_list.values[name];
+        s->val = 0;
+        s->level = t->current_level;
+        s->addr = -3 * (u + 1); // Where unit u ends up is not known yet
+        s->mark = 0;
+        index_symbol(w);
+        t->size++;
+    }
+
+    w->code.code = arena_fit(&w->pool, &w->code.mem, 1024 * sizeof(assembly));
+    w->code.cx = 1;
+    w->code.size = 0;
+    w->procs.frames = arena_fit(&w->pool, &w->procs.frames_mem, sizeof(proc_frame));
+    w->procs.depth = 1;
+    w->procs.lookup_count = 0;
+}
+
+// Compiles the units of a chunk on a worker, stopping at the first one with an error
+static void *parallel_worker(void *arg){
+    par_chunk *c = arg;
+    pl0_compiler *w = c->worker;
+    w->pool.on_full = &w->fail;
+    if (setjmp(w->fail) == 0) {
+        start_worker(c->main, c);
+        for (int u = c->first; u < c->end; u++) {
+            par_unit *unit = &c->main->par.units[u];
+            pl0_stats before = w->stats;
+            unit->code = w->code.cx;
+            unit->symbol = w->sym_table.size;
+            unit->lookup = w->procs.lookup_count;
+            w->procs.frames[0].first = w->sym_table.size;
+            update_tokens(w, unit->first);
+            procedure_unit(w);
+            if (w->diagnostic_count > 0 || w->tkn_list.current_index != unit->end)
+                break;
+            unit->code_end = w->code.cx;
+            unit->symbol_end = w->sym_table.size;
+            unit->lookup_end = w->procs.lookup_count;
+            memset(&unit->stats, 0, sizeof(unit->stats));
+            add_stats(&unit->stats, &w->stats, &before);
+            unit->ok = 1;
+        }
+    }
+    w->pool.on_full = NULL;
+    return NULL;
+}
+
+// Where the symbol at index i of the worker of chunk c is in the context's table
+static int splice_index(pl0_compiler *ctx, const par_chunk *c, int i){
+    parallel_state *par = &ctx->par;
+    if (i < par->outer)
+        return i;
+    if (i < par->outer + c->first)
+        return par->heads[i - par->outer];
+    return par->heads[c->first] + (i - par->outer - c->first);
+}
+
+// Appends unit u of chunk c to the context, as if it had just been compiled there. Returns 0,
+// leaving the context alone, if it had an error or looked up a name that resolves differently
+// here.
+static int splice_unit(pl0_compiler *ctx, const par_chunk *c, int u){
+    parallel_state *par = &ctx->par;
+    const par_unit *unit = &par->units[u];
+    const pl0_compiler *w = c->worker;
+    symbol_table *t = &ctx->sym_table;
+    if (!unit->ok)
+        return 0;
+    par->heads[u] = t->size;
+    for (int i = unit->lookup; i < unit->lookup_end; i++) {
+        const proc_lookup *l = &w->procs.lookups[i];
+        int found = l->found >= 0 ? splice_index(ctx, c, l->found) : -1;
+        if (outside_lookup(ctx, l->declare, ctx->tkn_list.values[l->token]) != found)
+            return 0;
+    }
+
+    // The code, with its own jumps and calls moved and calls to earlier runs pointed at them
+    int count = unit->code_end - unit->code;
+    int delta = 3 * (ctx->code.cx - unit->code);
+    size_t bytes = (size_t) (ctx->code.cx + count) * sizeof(assembly);
+    if (bytes > ctx->code.mem.cap)
+        ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, bytes);
+    assembly *code = ctx->code.code + ctx->code.cx;
+    memcpy(code, w->code.code + unit->code, (size_t) count * sizeof(assembly));
+    for (int i = 0; i < count; i++) {
+        if (code[i].OP == 5 && code[i].M < 0)
+            code[i].M = t->table[par->heads[-code[i].M / 3 - 1]].addr;
+        else if (code[i].OP == 5 || code[i].OP == 7 || code[i].OP == 8)
+            code[i].M += delta;
+    }
+    ctx->code.cx += count;
+    ctx->code.size += count;
+
+    // The heading stays declared; what the block declared is out of scope again
+    for (int i = unit->symbol; i < unit->symbol_end; i++) {
+        reserve_symbol(ctx);
+        symbol *s = &t->table[t->size];
+        *s = w->sym_table.table[i];
+        if (s->kind == 3)
+            s->addr += delta;
+        if (i == unit->symbol)
+            index_symbol(ctx);
+        else {
+            if (s->shadow >= 0)
+                s->shadow = splice_index(ctx, c, s->shadow);
+            t->newest[s->id] = t->size;
+            if (s->kind == 1)
+                t->newest_const[s->id] = t->size;
+        }
+        t->size++;
+    }
+    add_stats(&ctx->stats, &unit->stats, &(pl0_stats) {0});
+    return 1;
+}
+
+// Compiles the procedures declared next, in the main block, on par.threads threads. Leaves the
+// current token at the first procedure it did not compile.
+void compile_parallel(pl0_compiler *ctx){
+    parallel_state *par = &ctx->par;
+    token_list *list = &ctx->tkn_list;
+    if (par->threads < 2 || ctx->syntax_only || ctx->procs.enabled || list->ring || ctx->diagnostic_count > 0
+        || ctx->ast.keep)
+        return;
+
+    // Find the procedures
+    int first = list->current_index, i = first;
+    par->unit_count = 0;
+    while (i + 2 < list->size && list->tokens[i] == 30 && list->tokens[i + 1] == 2 && list->tokens[i + 2] == 18) {
+        int end = scan_block(list, i + 3);
+        if (end < 0 || list->tokens[end] != 18)
+            break;
+        par->units = arena_fit(&ctx->pool, &par->units_mem, (size_t) (par->unit_count + 1) * sizeof(par_unit));
+        par_unit *unit = &par->units[par->unit_count++];
+        memset(unit, 0, sizeof(*unit));
+        unit->first = i;
+        unit->end = i = end + 1;
+    }
+    if (par->unit_count < 2 || i - first < PARALLEL_MIN_TOKENS)
+        return;
+
+    // Share them out in runs of about the same number of tokens
+    int chunk_count = par->threads < par->unit_count ? par->threads : par->unit_count;
+    fit_workers(ctx, chunk_count);
+    par->chunks = arena_fit(&ctx->pool, &par->chunks_mem, (size_t) chunk_count * sizeof(par_chunk));
+    par->heads = arena_fit(&ctx->pool, &par->heads_mem, (size_t) par->unit_count * sizeof(int));
+    par->outer = ctx->sym_table.size;
+    for (int k = 0, u = 0; k < chunk_count; k++) {
+        par_chunk *c = &par->chunks[k];
+        c->main = ctx;
+        c->worker = &par->workers[k];
+        c->first = u;
+        long long goal = first + (long long) (i - first) * (k + 1) / chunk_count;
+        u++;
+        while (u < par->unit_count - (chunk_count - k - 1) && par->units[u].first < goal)
+            u++;
+        c->end = k == chunk_count - 1 ? par->unit_count : u;
+    }
+    for (int k = 1; k < chunk_count; k++)
+        par->chunks[k].started = pthread_create(&par->chunks[k].thread, NULL, parallel_worker, &par->chunks[k]) == 0;
+    parallel_worker(&par->chunks[0]);
+    for (int k = 1; k < chunk_count; k++) {
+        if (par->chunks[k].started)
+            pthread_join(par->chunks[k].thread, NULL);
+        else
+            parallel_worker(&par->chunks[k]);
+    }
+
+    // Splice them in order
+    int stop = first;
+    for (int k = 0; k < chunk_count; k++) {
+        const par_chunk *c = &par->chunks[k];
+        int u = c->first;
+        while (u < c->end && splice_unit(ctx, c, u))
+            stop = par->units[u++].end;
+        if (u < c->end)
+            break;
+    }
+    if (stop != first) {
+        ctx->sym_table.declare = 0;
+        update_tokens(ctx, stop);
+    }
+}
+
+static void statement_body(pl0_compiler *ctx){
+    // if (token == identsym) {
+    //     symIdx = symbol_table_check (token)
+    //     if (symIdx == -1)
+    //         error
+    //     if (table[symIdx].kind != 2 (not a var))
+    //         error
+    //     get next token
+    //     if (token != becomessym)
+    //         error
+    //     get next token
+    //     expression();
+    //     emit STO (M = table[symIdx].addr)
+    //     return
+    // }
+    // if (token == beginsym) {
+    //     do {
+    //     get next token
+    //     statement();
+    //     } while token == semicolonsym
+    //     if (token != endsym)
+    //         error
+    //     get next token
+    //     return
+    // }
+    // if (token == ifsym) {
+    //     get next token
+    //     condition();
+    //     jpcIdx = current code index
+    //     emit JPC
+    //     if (token != thensym)
+    //         error
+    //     get next token
+    //     statement();
+    //     code[jpcIdx].M = current code index
+    //     return
+    // }
+    // if (token == whilesym) {
+    //     get next token
+    //     loopIdx = current code index
+    //     condition();
+    //     if (token != dosym)
+    //         error
+    //     get next token
+    //     jpcIdx = current code index
+    //     emit JPC
+    //     statement();
+    //     emit JMP (M = loopIdx)
+    //     code[jpcIdx].M = current code index
+    //     return
+    // }
+    // if (token == readsym) {
+    //     get next token
+    //     if (token != identsym)
+    //         error
+    //     symIdx = symbol_table_check (token)
+    //     if (symIdx == -1)
+    //         error
+    //     if (table[symIdx].kind != 2 (not a var))
+    //         error
+    //     get next token
+    //     emit READ
+    //     emit STO (M = table[symIdx].addr)
+    //     return
+    // }
+    // if (token == writesym) {
+    //     get next token
+    //     expression();
+    //     emit WRITE
+    //     return
+    // }
+
+    ctx->ast.result = -1;
+    if (ctx->tkn_list.token == 2) {
+        ctx->sym_table.symIdx = symbol_table_check(ctx);
+        if (ctx->sym_table.symIdx == -1)
+            error(ctx, 7);
+        if (ctx->sym_table.table[ctx->sym_table.symIdx].kind != 2)
+            error(ctx, 8);
+        update_tokens(ctx, get_next_token(ctx));
+        if (ctx->tkn_list.token != 20)
+            error(ctx, 9);
+        int n = ast_symbol(ctx, AST_ASSIGN, ctx->sym_table.symIdx);
+        update_tokens(ctx, get_next_token(ctx));
+        int value = expression(ctx);
+        ctx->ast.nodes[n].a = value;
+        ctx->ast.result = n;
+        return;
+    }
+    if (ctx->tkn_list.token == 27) {
+        update_tokens(ctx, get_next_token(ctx));
+        if (ctx->tkn_list.token != 2)
+            error(ctx, 16); 
+        ctx->sym_table.symIdx = symbol_table_check(ctx);
+        if (ctx->sym_table.symIdx == -1)
+            error(ctx, 7);
+        if (ctx->sym_table.table[ctx->sym_table.symIdx].kind != 3)
+            error(ctx, 17); 
+        ctx->ast.result = ast_symbol(ctx, AST_CALL, ctx->sym_table.symIdx);
+        update_tokens(ctx, get_next_token(ctx));
+        return;
+
+    }
+    if (ctx->tkn_list.token == 21) {
+        int n = ast_new(ctx, AST_BEGIN, -1, -1), last = -1;
+        do {
+            update_tokens(ctx, get_next_token(ctx));
+            last = begin_statement(ctx, n, last);
+            // Anything else than ';' or "end" after a statement is an error. Another statement
+            // is only missing its ';', the rest is skipped.
+            while (!(SYNC_STATEMENT >> ctx->tkn_list.token & 1) && ctx->tkn_list.token != 0) {
+                report(ctx, 10, ctx->tkn_list.current_index);
+                if (STARTS_STATEMENT(ctx->tkn_list.token))
+                    last = begin_statement(ctx, n, last);
+                else
+                    skip_to(ctx, SYNC_STATEMENT);
+            }
+        } while (ctx->tkn_list.token == 18);
+        if (ctx->tkn_list.token != 22)
+            error(ctx, 10);
+        update_tokens(ctx, get_next_token(ctx));
+        ctx->ast.result = n;
+        return;
+    }
+    if (ctx->tkn_list.token == 23) {
+        // The body's code goes after the condition's, so it waits for the whole statement. An
+        // error leaves stream off for the rest of the block, which only costs memory.
+        int stream = ctx->ast.stream;
+        ctx->ast.stream = 0;
+        update_tokens(ctx, get_next_token(ctx));
+        int cond = condition(ctx);
+        if (ctx->tkn_list.token != 24)
+            error(ctx, 11);
+        update_tokens(ctx, get_next_token(ctx));
+        int body = statement(ctx);
+        ctx->ast.result = ast_new(ctx, AST_IF, cond, body);
+        ctx->ast.stream = stream;
+        return;
+    }
+    if (ctx->tkn_list.token == 25) {
+        int stream = ctx->ast.stream;
+        ctx->ast.stream = 0;
+        update_tokens(ctx, get_next_token(ctx));
+        int cond = condition(ctx);
+        if (ctx->tkn_list.token != 26)
+            error(ctx, 12);
+        update_tokens(ctx, get_next_token(ctx));
+        int body = statement(ctx);
+        ctx->ast.result = ast_new(ctx, AST_WHILE, cond, body);
+        ctx->ast.stream = stream;
+        return;
+    }
+    if (ctx->tkn_list.token == 32) {
+        update_tokens(ctx, get_next_token(ctx));
+        if (ctx->tkn_list.token != 2)
+            error(ctx, 2);
+        ctx->sym_table.symIdx = symbol_table_check(ctx);
+        if (ctx->sym_table.symIdx == -1)
+            error(ctx, 7);
+        if (ctx->sym_table.table[ctx->sym_table.symIdx].kind != 2)
+            error(ctx, 8);
+        ctx->ast.result = ast_symbol(ctx, AST_READ, ctx->sym_table.symIdx);
+        update_tokens(ctx, get_next_token(ctx));
+        return;
+    }
+    if (ctx->tkn_list.token == 31) {
+        update_tokens(ctx, get_next_token(ctx));
+        int value = expression(ctx);
+        ctx->ast.result = ast_new(ctx, AST_WRITE, value, -1);
+        return;
+    }
+}
+
+// Returns the statement's node, -1 if it is empty or had an error
+int statement(pl0_compiler *ctx){
+    if (parse_or_sync(ctx, statement_body, SYNC_STATEMENT, 0))
+        return -1;
+    return ctx->ast.result;
+}
+
+static void condition_body(pl0_compiler *ctx){
+    // if (token == oddsym){ 
+    //     get next token
+    //     expression();
+    //     emit ODD
+    // }
+    // else {
+    //     EXPRESSION
+    //     if (token == eqlsym) {
+    //         get next token
+    //         expression();
+    //         emit EQL
+    //     }
+    //     else if (token == neqsym) {
+    //         get next token
+    //         expression();
+    //         emit NEQ
+    //     }
+    //     else if (token == lessym) {
+    //         get next token
+    //         expression();
+    //         emit LSS
+    //     }
+    //     else if (token == leqsym) {
+    //         get next token
+    //         expression();
+    //         emit LEQ
+    //     }
+    //     else if (token == gtrsym) {
+    //         get next token
+    //         expression();
+    //         emit GTR
+    //     }
+    //     else if (token == geqsym) {
+    //         get next token
+    //         expression();
+    //         emit GEQ
+    //     }
+    //     else
+    //         error
+    // 
+    // }
+
+    if (ctx->tkn_list.token == 1){ 
+        update_tokens(ctx, get_next_token(ctx));
+        int operand = expression(ctx);
+        ctx->ast.result = ast_new(ctx, AST_ODD, operand, -1);
+    }
+    else {
+        int left = expression(ctx);
+        // "=" "<>" "<" "<=" ">" ">=" are tokens 9 to 14 and OPR 5 to 10
+        if (ctx->tkn_list.token < 9 || ctx->tkn_list.token > 14)
+            error(ctx, 13);
+        int op = ctx->tkn_list.token - 4;
+        update_tokens(ctx, get_next_token(ctx));
+        int right = expression(ctx);
+        ctx->ast.result = ast_new(ctx, AST_BINARY, left, right);
+        ctx->ast.nodes[ctx->ast.result].op = (unsigned char) op;
+    }
+}
+
+// Returns the condition's node, -1 if it had an error
+int condition(pl0_compiler *ctx){
+    if (parse_or_sync(ctx, condition_body, SYNC_CONDITION, 0))
+        return -1;
+    return ctx->ast.result;
+}
+
+int expression(pl0_compiler *ctx){
+    // if (token == minussym) {
+    //     get next token
+    //     term();
+    //     emit NEG
+    //     while (token == plussym || token == minussym) {
+    //         if (token == plussym) {
+    //             get next token
+    //             term();
+    //             emit ADD
+    //         }
+    //         else {
+    //             get next token
+    //             term();
+    //             emit SUB
+    //         }
+    //     }
+    // }
+    // else {
+    //     if (token == plussym)
+    //         get next token
+    //     term();
+    //     while (token == plussym || token == minussym)
+    //     {
+    //         if (token == plussym) {
+    //             get next token
+    //             term();
+    //             emit ADD
+    //         }
+    //         else {
+    //             get next token
+    //             term();
+    //             emit SUB
+    //         }
+    //     }
+    // }
+    
+    int n;
+    if (ctx->tkn_list.token == 5) {
+        update_tokens(ctx, get_next_token(ctx));
+        int operand = term(ctx);
+        n = ast_new(ctx, AST_NEGATE, operand, -1);
+    }
+    else {
+        if (ctx->tkn_list.token == 4)
+            update_tokens(ctx, get_next_token(ctx));
+        n = term(ctx);
+    }
+    // Operators of the same precedence nest to the left: a - b + c is (a - b) + c
+    while (ctx->tkn_list.token == 4 || ctx->tkn_list.token == 5) {
+        int op = ctx->tkn_list.token == 4 ? 1 : 2;
+        update_tokens(ctx, get_next_token(ctx));
+        int right = term(ctx);
+        n = ast_new(ctx, AST_BINARY, n, right);
+        ctx->ast.nodes[n].op = (unsigned char) op;
+    }
+    return n;
+}
+
+int term(pl0_compiler *ctx){
+    // factor();
+    // while (token == multsym || token == slashsym || token == modsym) {
+    //     if (token == multsym) {
+    //         get next token
+    //         factor();
+    //         emit MUL
+    //     }
+    //     else if (token == slashsym) {
+    //         get next token
+    //         factor();
+    //         emit DIV
+    //     }
+    //     else {
+    //         get next token
+    //         factor();
+    //         emit MOD
+    //     }
+    // }        
+    int n = factor(ctx);
+    while (ctx->tkn_list.token == 6 || ctx->tkn_list.token == 7) {
+        int op = ctx->tkn_list.token == 6 ? 3 : 4;
+        update_tokens(ctx, get_next_token(ctx));
+        int right = factor(ctx);
+        n = ast_new(ctx, AST_BINARY, n, right);
+        ctx->ast.nodes[n].op = (unsigned char) op;
+    }
+    return n;
+}
+
+int factor(pl0_compiler *ctx){ 
+    // if token == identsym
+    //      symIdx = SYMBOLTABLECHECK (token)
+    //      if symIdx == -1
+    //          error
+    //      if table[symIdx].kind == 1 (const)
+    //          emit LIT (M = table[symIdx].Value)
+    //      else (var)
+    //          emit LOD (M = table[symIdx].addr)
+    //      get next token
+    // else if token == numbersym
+    //      emit LIT
+    //      get next token
+    // else if token == lparentsym
+    //      get next token
+    //      EXPRESSION
+    //      if token != rparentsym
+    //          error
+    //      get next token
+    // else
+    //      error
+
+    
+    int n;
+    if (ctx->tkn_list.token == 2) { 
+        int temp_idx = symbol_table_check(ctx);
+        if (temp_idx == -1)
+            error(ctx, 7);
+        n = ast_symbol(ctx, ctx->sym_table.table[temp_idx].kind == 1 ? AST_NUMBER : AST_LOAD, temp_idx);
+        update_tokens(ctx, get_next_token(ctx));
+    }
+    else if (ctx->tkn_list.token == 3) {
+        n = ast_new(ctx, AST_NUMBER, token_value(ctx), -1);
+        update_tokens(ctx, get_next_token(ctx));
+    }
+    else if (ctx->tkn_list.token == 15) {
+        update_tokens(ctx, get_next_token(ctx));
+        n = expression(ctx);
+        if (ctx->tkn_list.token != 16)
+            error(ctx, 14);
+        update_tokens(ctx, get_next_token(ctx));
+    }
+    else
+        error(ctx, 15);
+    return n;
+}
+
+// Turns node n into a number node holding OPR M applied to a and b, with the operand in b for
+// odd. Returns 0 and leaves n as it is for a division by zero, which is left for run time to
+// report; everything else wraps to 32 bits like the machine does.
+static int fold_node(pl0_compiler *ctx, int n, int M, int32_t a, int32_t b){
+    int32_t v;
+    switch (M) {
+        case 1: v = (int32_t) ((uint32_t) a + (uint32_t) b); break;
+        case 2: v = (int32_t) ((uint32_t) a - (uint32_t) b); break;
+        case 3: v = (int32_t) ((uint32_t) a * (uint32_t) b); break;
+        case 4:
+            if (b == 0)
+                return 0;
+            v = b == -1 ? (int32_t) (0u - (uint32_t) a) : a / b;
+            break;
+        case 5: v = a == b; break;
+        case 6: v = a != b; break;
+        case 7: v = a < b; break;
+        case 8: v = a <= b; break;
+        case 9: v = a > b; break;
+        case 10: v = a >= b; break;
+        default: v = b & 1; break;
+    }
+    ast_node *node = &ctx->ast.nodes[n];
+    node->kind = AST_NUMBER;
+    node->op = 0;
+    node->a = v;
+    node->b = -1;
+    node->sym = -1;
+    node->L = node->M = 0;
+    return 1;
+}
+
+// Folds every operation of expression or condition n whose operands are numbers into a number
+// node, innermost first. Returns 1 if n itself is now a number.
+int fold_expression(pl0_compiler *ctx, int n){
+    ast_node *nodes = ctx->ast.nodes; // Folding adds no nodes, so this stays put
+    if (n < 0)
+        return 0;
+    switch (nodes[n].kind) {
+        case AST_NUMBER:
+            return 1;
+        case AST_NEGATE:
+        case AST_ODD: {
+            int a = nodes[n].a;
+            if (!fold_expression(ctx, a))
+                return 0;
+            // -t is 0 - t, as there is no negate instruction
+            return nodes[n].kind == AST_NEGATE ? fold_node(ctx, n, 2, 0, nodes[a].a)
+                                               : fold_node(ctx, n, 11, nodes[a].a, nodes[a].a);
+        }
+        case AST_BINARY: {
+            // Long chains are walked with a loop, turning the links around like gen_expression()
+            int up = -1;
+            while (n >= 0 && nodes[n].kind == AST_BINARY) {
+                int down = nodes[n].a;
+                nodes[n].a = up;
+                up = n;
+                n = down;
+            }
+            int constant = fold_expression(ctx, n);
+            while (up >= 0) {
+                int next = nodes[up].a;
+                nodes[up].a = n;
+                n = up;
+                up = next;
+                int right = fold_expression(ctx, nodes[n].b);
+                constant = constant && right && fold_node(ctx, n, nodes[n].op, nodes[nodes[n].a].a, nodes[nodes[n].b].a);
+            }
+            return constant;
+        }
+    }
+    return 0;
+}
+
+// Folds the constant expressions of statement or block n and everything in it
+void fold_statement(pl0_compiler *ctx, int n){
+    if (n < 0)
+        return;
+    ast_node *nodes = ctx->ast.nodes;
+    switch (nodes[n].kind) {
+        case AST_BLOCK:
+            for (int p = nodes[n].b; p >= 0; p = nodes[p].next)
+                fold_statement(ctx, p);
+            fold_statement(ctx, nodes[n].a);
+            break;
+        case AST_ASSIGN:
+        case AST_WRITE:
+            fold_expression(ctx, nodes[n].a);
+            break;
+        case AST_BEGIN:
+            for (int s = nodes[n].a; s >= 0; s = nodes[s].next)
+                fold_statement(ctx, s);
+            break;
+        case AST_IF:
+        case AST_WHILE:
+            fold_expression(ctx, nodes[n].a);
+            fold_statement(ctx, nodes[n].b);
+            break;
+    }
+}
+
+// Emits the code of block node n: a JMP over its procedures, each procedure followed by its RTN,
+// then its INC and its statement. A procedure starts at its JMP.
+static void gen_block(pl0_compiler *ctx, int n){
+    const ast_node *node = &ctx->ast.nodes[n];
+    if (node->sym >= 0)
+        ctx->sym_table.table[node->sym].addr = 3 * (ctx->code.cx - 1);
+    int jmpaddr = ctx->code.cx;
+    emit(ctx, 7, 0, jmpaddr);
+    for (int p = node->b; p >= 0; p = ctx->ast.nodes[p].next) {
+        gen_block(ctx, p);
+        emit(ctx, 2, 0, 0);
+    }
+    ctx->code.code[jmpaddr].M = (ctx->code.cx - 1) * 3;
+    emit(ctx, 6, 0, node->M);
+    gen_statement(ctx, node->a);
+}
+
+// Emits the code of the whole tree built by program(), ending with the halt
+void gen_program(pl0_compiler *ctx){
+    gen_block(ctx, ctx->ast.root);
+    emit(ctx, 9, 0, 3);
+}
+
+// Emits the code of statement n and everything in it. A condition folded to a number needs no
+// JPC: the body is left out when it is false, and a loop that is always true only jumps back.
+void gen_statement(pl0_compiler *ctx, int n){
+    if (n < 0)
+        return;
+    ast_node *node = &ctx->ast.nodes[n]; // Generating adds no nodes, so this stays put
+    int constant = (node->kind == AST_IF || node->kind == AST_WHILE) && ctx->opt_level > 0 && node->a >= 0
+                   && ctx->ast.nodes[node->a].kind == AST_NUMBER;
+    switch (node->kind) {
+        case AST_ASSIGN:
+            gen_expression(ctx, node->a);
+            emit(ctx, 4, node->L, node->M);
+            break;
+        case AST_CALL:
+            // A procedure's address is only known once its block is generated
+            node->M = ctx->sym_table.table[node->sym].addr;
+            emit(ctx, 5, node->L, node->M);
+            break;
+        case AST_BEGIN:
+            for (int s = node->a; s >= 0; s = ctx->ast.nodes[s].next)
+                gen_statement(ctx, s);
+            break;
+        case AST_IF: {
+            if (constant) {
+                if (ctx->ast.nodes[node->a].a != 0)
+                    gen_statement(ctx, node->b);
+                break;
+            }
+            gen_expression(ctx, node->a);
+            int jpcIdx = ctx->code.cx;
+            emit(ctx, 8, 0, jpcIdx);
+            gen_statement(ctx, node->b);
+            ctx->code.code[jpcIdx].M = 3 * (ctx->code.cx - 1);
+            break;
+        }
+        case AST_WHILE: {
+            int loopIdx = 3 * (ctx->code.cx - 1);
+            if (constant) {
+                if (ctx->ast.nodes[node->a].a != 0) {
+                    gen_statement(ctx, node->b);
+                    emit(ctx, 7, 0, loopIdx);
+                }
+                break;
+            }
+            gen_expression(ctx, node->a);
+            int jpcIdx = ctx->code.cx;
+            emit(ctx, 8, 0, jpcIdx);
+            gen_statement(ctx, node->b);
+            emit(ctx, 7, 0, loopIdx);
+            ctx->code.code[jpcIdx].M = 3 * (ctx->code.cx - 1);
+            break;
+        }
+        case AST_READ:
+            emit(ctx, 9, 0, 2);
+            emit(ctx, 4, node->L, node->M);
+            break;
+        case AST_WRITE:
+            gen_expression(ctx, node->a);
+            emit(ctx, 9, 0, 1);
+            break;
+    }
+}
+
+// Emits the code of expression or condition n
+void gen_expression(pl0_compiler *ctx, int n){
+    ast_node *nodes = ctx->ast.nodes;
+    if (n < 0)
+        return;
+    switch (nodes[n].kind) {
+        case AST_NUMBER:
+            emit(ctx, 1, 0, nodes[n].a);
+            break;
+        case AST_LOAD:
+            emit(ctx, 3, nodes[n].L, nodes[n].M);
+            break;
+        case AST_NEGATE:
+            // There is no negate instruction, so -t is computed as 0 - t
+            emit(ctx, 1, 0, 0);
+            gen_expression(ctx, nodes[n].a);
+            emit(ctx, 2, 0, 2);
+            break;
+        case AST_ODD:
+            gen_expression(ctx, nodes[n].a);
+            emit(ctx, 2, 0, 11);
+            break;
+        case AST_BINARY: {
+            // A chain like a + b + ... + z nests to the left as deep as it is long, so its left
+            // operands are reached with a loop: the links are turned around on the way down to
+            // the first operand and put back on the way up
+            int up = -1;
+            while (n >= 0 && nodes[n].kind == AST_BINARY) {
+                int down = nodes[n].a;
+                nodes[n].a = up;
+                up = n;
+                n = down;
+            }
+            gen_expression(ctx, n);
+            while (up >= 0) {
+                int next = nodes[up].a;
+                nodes[up].a = n;
+                n = up;
+                up = next;
+                gen_expression(ctx, nodes[n].b);
+                emit(ctx, 2, 0, nodes[n].op);
+            }
+            break;
+        }
+    }
+}
+// Peephole optimizer
+//
+// Rewrites short instruction sequences in the code using the rules in peephole_rules. An
+// instruction is deleted by setting its OP to 0; after each sweep the code is compacted and every
+// JMP, JPC and CAL target, as well as every procedure's address in the symbol table, is moved to
+// the instruction's new index. A reference to a deleted instruction moves to the next one that
+// survives, which is what falling through it would have reached. Sweeps repeat until nothing
+// changes, so chains like JMP to JMP to JMP collapse fully.
+//
+// There is no rule for STO x; LOD x. PM/0 has no instruction that duplicates the stack top, so the
+// value cannot be both stored and left on the stack without reloading it.
+
+// Returns the code index an address M refers to
+static int code_index(int M) {
+    return M / 3 + 1;
+}
+
+// Returns 1 if code[i] is a live instruction with the given OP and M
+static int code_is(pl0_compiler *ctx, int i, int OP, int M) {
+    return i <= ctx->code.size && ctx->code.code[i].OP == OP && ctx->code.code[i].M == M;
+}
+
+// A JMP, JPC or CAL whose target is a JMP goes straight to that JMP's target
+static int rule_jump_to_jump(pl0_compiler *ctx, int i, const char *is_target) {
+    (void) is_target;
+    assembly *in = &ctx->code.code[i];
+    if (in->OP != 5 && in->OP != 7 && in->OP != 8)
+        return 0;
+    int t = code_index(in->M);
+    if (t < 1 || t > ctx->code.size || ctx->code.code[t].OP != 7 || ctx->code.code[t].M == in->M
+        || code_index(ctx->code.code[t].M) == t)
+        return 0;
+    in->M = ctx->code.code[t].M;
+    return 1;
+}
+
+// A JMP to the instruction right after it does nothing
+static int rule_jump_to_next(pl0_compiler *ctx, int i, const char *is_target) {
+    (void) is_target;
+    if (ctx->code.code[i].OP != 7 || code_index(ctx->code.code[i].M) != i + 1)
+        return 0;
+    ctx->code.code[i].OP = 0;
+    return 1;
+}
+
+// LIT 0; OPR ADD and LIT 0; OPR SUB leave the value below unchanged
+static int rule_add_zero(pl0_compiler *ctx, int i, const char *is_target) {
+    if (!code_is(ctx, i, 1, 0) || is_target[i + 1] || !(code_is(ctx, i + 1, 2, 1) || code_is(ctx, i + 1, 2, 2)))
+        return 0;
+    ctx->code.code[i].OP = 0;
+    ctx->code.code[i + 1].OP = 0;
+    return 1;
+}
+
+// LIT 1; OPR MUL and LIT 1; OPR DIV leave the value below unchanged
+static int rule_mul_one(pl0_compiler *ctx, int i, const char *is_target) {
+    if (!code_is(ctx, i, 1, 1) || is_target[i + 1] || !(code_is(ctx, i + 1, 2, 3) || code_is(ctx, i + 1, 2, 4)))
+        return 0;
+    ctx->code.code[i].OP = 0;
+    ctx->code.code[i + 1].OP = 0;
+    return 1;
+}
+
+// LIT c; JPC never jumps when c is not 0 and always jumps when it is
+static int rule_constant_jpc(pl0_compiler *ctx, int i, const char *is_target) {
+    if (ctx->code.code[i].OP != 1 || is_target[i + 1] || i + 1 > ctx->code.size || ctx->code.code[i + 1].OP != 8)
+        return 0;
+    if (ctx->code.code[i].M != 0)
+        ctx->code.code[i + 1].OP = 0;
+    else
+        ctx->code.code[i + 1].OP = 7;
+    ctx->code.code[i].OP = 0;
+    return 1;
+}
+
+const peephole_rule peephole_rules[PEEPHOLE_RULES] = {
+    { "jump to jump", rule_jump_to_jump },
+    { "jump to next instruction", rule_jump_to_next },
+    { "add/subtract 0", rule_add_zero },
+    { "multiply/divide by 1", rule_mul_one },
+    { "constant condition", rule_constant_jpc },
+};
+
+// Drops the instructions whose OP is 0. Every JMP, JPC and CAL target and every procedure's
+// address moves to where its instruction went, or to the next survivor if it was dropped.
+static void compact_code(pl0_compiler *ctx, arena *map_mem) {
+    int size = ctx->code.size;
+    // map[i] is the new index of instruction i, or of the next survivor if i was deleted
+    int *map = arena_fit(&ctx->pool, map_mem, (size_t) (size + 2) * sizeof(int));
+    int next = 1;
+    for (int i = 1; i <= size + 1; i++) {
+        map[i] = next;
+        if (i <= size && ctx->code.code[i].OP != 0)
+            ctx->code.code[next++] = ctx->code.code[i];
+    }
+    ctx->code.size = next - 1;
+    ctx->code.cx = next;
+    for (int i = 1; i <= ctx->code.size; i++) {
+        assembly *in = &ctx->code.code[i];
+        int t = code_index(in->M);
+        if ((in->OP == 5 || in->OP == 7 || in->OP == 8) && in->M >= 0 && t <= size + 1)
+            in->M = 3 * (map[t] - 1);
+    }
+    for (int i = 0; i < ctx->sym_table.size; i++) {
+        symbol *sym = &ctx->sym_table.table[i];
+        if (sym->kind == 3 && sym->addr >= 0 && code_index(sym->addr) <= size + 1)
+            sym->addr = 3 * (map[code_index(sym->addr)] - 1);
+    }
+}
+
+// Runs the peephole rules over the code until none of them applies. Returns the number of
+// instructions removed.
+int peephole(pl0_compiler *ctx) {
+    int before = ctx->code.size;
+    arena target_mem = {0};
+    arena map_mem = {0};
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        int size = ctx->code.size;
+        char *is_target = arena_fit(&ctx->pool, &target_mem, (size_t) size + 2);
+        memset(is_target, 0, (size_t) size + 2);
+        for (int i = 1; i <= size; i++) {
+            int OP = ctx->code.code[i].OP;
+            int t = code_index(ctx->code.code[i].M);
+            if ((OP == 5 || OP == 7 || OP == 8) && t >= 1 && t <= size + 1)
+                is_target[t] = 1;
+        }
+
+        int deleted = 0;
+        for (int i = 1; i <= size; i++)
+            for (int r = 0; r < PEEPHOLE_RULES && ctx->code.code[i].OP != 0; r++)
+                if (peephole_rules[r].apply(ctx, i, is_target)) {
+                    ctx->peephole_hits[r]++;
+                    changed = 1;
+                }
+        for (int i = 1; i <= size; i++)
+            deleted += ctx->code.code[i].OP == 0;
+        if (deleted > 0)
+            compact_code(ctx, &map_mem);
+    }
+    arena_free(&target_mem);
+    arena_free(&map_mem);
+    return before - ctx->code.size;
+}
+
+// Inlining
+//
+// Replaces the calls to small procedures with a copy of their body, which saves the CAL, the INC
+// that sets up the frame and the return, and lets the copied code reach the caller's variables
+// without walking static links. It runs on the generated code before the peephole rules, block
+// by block in code order, so a procedure's body is final, with its own calls inlined, by the
+// time a caller copies it: every call that cannot lead back to the caller goes to a procedure
+// that comes earlier. The only calls that go forward are those to the procedure itself or to an
+// enclosing one, and a procedure making one, or calling a procedure that may recurse, is never
+// copied.
+//
+// A copy leaves out the body's INC and return. The callee's variables move to slots added at the
+// end of the caller's frame, shared by every procedure that caller inlines; like the slots of a
+// new frame they hold whatever was there before. An outer name the callee reached L levels out
+// is d + L - 1 levels out from the caller, d being the level difference of the CAL it replaces.
+// A procedure whose code still calls its own procedures once their calls have been inlined is
+// not copied, since they need its frame for their static link. Procedures whose calls were all inlined are left for dead code elimination.
+
+// Copies the bodies of the procedures no longer than ctx->inline_limit instructions into their
+// callers. Returns the number of calls replaced.
+int inline_procedures(pl0_compiler *ctx) {
+    int size = ctx->code.size;
+    assembly *code = ctx->code.code;
+    arena at_mem = {0}, map_mem = {0}, fix_mem = {0}, out_mem = {0};
+    // at[i] is the procedure whose entry or INC is code[i], -1 if none
+    int *at = arena_fit(&ctx->pool, &at_mem, (size_t) (size + 2) * sizeof(int));
+    memset(at, -1, (size_t) (size + 2) * sizeof(int));
+    int count = 0;
+    for (int i = 0; i < ctx->sym_table.size; i++)
+        count += ctx->sym_table.table[i].kind == 3 && ctx->sym_table.table[i].addr >= 0;
+    ctx->inlines = arena_fit(&ctx->pool, &ctx->inlines_mem, (size_t) (count + 1) * sizeof(inline_proc));
+    ctx->inline_count = 0;
+    for (int i = 0; i < ctx->sym_table.size; i++) {
+        const symbol *sym = &ctx->sym_table.table[i];
+        int entry = sym->addr >= 0 ? code_index(sym->addr) : 0;
+        if (sym->kind != 3 || entry < 1 || entry > size)
+            continue;
+        int inc = code[entry].OP == 7 ? code_index(code[entry].M) : entry;
+        if (inc < 1 || inc > size || code[inc].OP != 6)
+            continue;
+        inline_proc *p = &ctx->inlines[ctx->inline_count];
+        memset(p, 0, sizeof(*p));
+        p->symbol = i;
+        p->inc = inc;
+        p->reason = INLINE_RECURSIVE;
+        at[entry] = at[inc] = ctx->inline_count++;
+    }
+
+    // map[i] is the new index of code[i]. JMP and JPC targets inside a body are moved once the
+    // body is out, the others and every CAL once all the code is.
+    int *map = arena_fit(&ctx->pool, &map_mem, (size_t) (size + 2) * sizeof(int));
+    int *fix = arena_fit(&ctx->pool, &fix_mem, (size_t) (size + 1) * sizeof(int));
+    assembly *out = NULL;
+    int n = 1, fixes = 0, inlined = 0;
+    for (int i = 1; i <= size; i++) {
+        out = arena_fit(&ctx->pool, &out_mem, (size_t) (n + 2) * sizeof(assembly));
+        map[i] = n;
+        if (code[i].OP != 6) {
+            if (code[i].OP == 7)
+                fix[fixes++] = n;
+            out[n++] = code[i];
+            continue;
+        }
+
+        // A block: its INC and the body after it, up to its return or the halt
+        int block = i, inc = n, start = n + 1, frame = code[i].M, outer = fixes;
+        int recursive = 0, nested = 0;
+        out[n++] = code[i];
+        int j = i + 1;
+        for (; j <= size && !(code[j].OP == 2 && code[j].M == 0) && !(code[j].OP == 9 && code[j].M == 3); j++) {
+            out = arena_fit(&ctx->pool, &out_mem, (size_t) (n + 2) * sizeof(assembly));
+            map[j] = n;
+            int t = -1;
+            if (code[j].OP == 5) {
+                int e = code_index(code[j].M);
+                t = e >= 1 && e <= size ? at[e] : -1;
+                // Procedures not done yet, the caller itself included, still count as recursive
+                recursive |= t < 0 || ctx->inlines[t].reason == INLINE_RECURSIVE;
+            }
+            if (t < 0 || ctx->inlines[t].reason != 0) {
+                // Only calls left in the code count: a nested procedure inlined here needs no frame
+                nested |= code[j].OP == 5 && code[j].L == 0;
+                if (code[j].OP == 7 || code[j].OP == 8)
+                    fix[fixes++] = n;
+                out[n++] = code[j];
+                continue;
+            }
+
+            // The callee's body as it was put out, its own calls already inlined
+            inline_proc *callee = &ctx->inlines[t];
+            int d = code[j].L;
+            out = arena_fit(&ctx->pool, &out_mem, (size_t) (n + callee->size + 2) * sizeof(assembly));
+            for (int k = 0; k < callee->size; k++) {
+                assembly in = out[callee->body + k];
+                if ((in.OP == 3 || in.OP == 4) && in.L == 0)
+                    in.M += code[block].M - 3;
+                else if (in.OP == 3 || in.OP == 4 || in.OP == 5)
+                    in.L += d - 1;
+                else if (in.OP == 7 || in.OP == 8)
+                    in.M = 3 * (n + code_index(in.M) - callee->body - 1);
+                nested |= in.OP == 5 && in.L == 0;
+                out[n + k] = in;
+            }
+            n += callee->size;
+            if (code[block].M + callee->frame - 3 > frame)
+                frame = code[block].M + callee->frame - 3;
+            callee->calls++;
+            inlined++;
+        }
+        if (j <= size) {
+            map[j] = n;
+            out[n++] = code[j];
+            i = j;
+        }
+        out[inc].M = frame;
+        for (int f = outer; f < fixes; f++)
+            out[fix[f]].M = 3 * (map[code_index(out[fix[f]].M)] - 1);
+        fixes = outer;
+
+        if (at[block] < 0 || j > size || code[j].OP != 2)
+            continue; // The main block
+        inline_proc *p = &ctx->inlines[at[block]];
+        p->frame = frame;
+        p->body = start;
+        p->size = n - 1 - start;
+        p->reason = recursive ? INLINE_RECURSIVE : nested ? INLINE_NESTED
+                  : p->size > ctx->inline_limit ? INLINE_TOO_LARGE : 0;
+    }
+
+    if (inlined > 0) {
+        for (int f = 0; f < fixes; f++)
+            out[fix[f]].M = 3 * (map[code_index(out[fix[f]].M)] - 1);
+        for (int k = 1; k < n; k++)
+            if (out[k].OP == 5)
+                out[k].M = 3 * (map[code_index(out[k].M)] - 1);
+        for (int i = 0; i < ctx->sym_table.size; i++) {
+            symbol *sym = &ctx->sym_table.table[i];
+            if (sym->kind == 3 && sym->addr >= 0 && code_index(sym->addr) <= size)
+                sym->addr = 3 * (map[code_index(sym->addr)] - 1);
+        }
+        ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, (size_t) (n + 1) * sizeof(assembly));
+        memcpy(ctx->code.code + 1, out + 1, (size_t) (n - 1) * sizeof(assembly));
+        ctx->code.size = n - 1;
+        ctx->code.cx = n;
+    }
+    arena_free(&at_mem);
+    arena_free(&map_mem);
+    arena_free(&fix_mem);
+    arena_free(&out_mem);
+    return inlined;
+}
+
+// Tail calls
+//
+// A procedure that calls itself as the last thing it does needs nothing of its frame once the
+// call returns, so the call can become a jump back to the start of its body that reuses the
+// frame: deep recursion then runs in constant stack. Only calls to the procedure itself qualify,
+// since PM/0 has no way to give another procedure's frame a different size or static link. A
+// call is last when the code after it reaches the return through nothing but JMPs.
+//
+// A call may also be followed by one update of an outer variable, x := x + e, x := x - e,
+// x := x * e or x := e + x or e * x, where e only reads the procedure's own variables and
+// constants, as in the factorial that multiplies its result on the way back. Each level of the
+// recursion would apply its update after the deeper levels are done, in reverse order. Addition
+// and multiplication wrap around like the machine's, so the order does not matter and the
+// updates can be collected instead: the call becomes an update of an accumulator in a slot added
+// to the frame, set to 0 or 1 on entry, and the return first applies the accumulator to x. e is
+// computed at the jump, which is the same since nothing the deeper levels do can change the
+// caller's variables. Updates of different variables, or a mix of addition and multiplication,
+// cannot share the accumulator; calls with such an update stay calls.
+
+typedef struct tail_proc
+{
+    int entry, inc, ret; // Indexes of its first instruction, its INC and its return
+    int op; // OPR M the accumulator is applied with, 0 if it has none
+    int L, M; // The variable it is applied to
+} tail_proc;
+
+typedef struct tail_site
+{
+    int proc; // The procedure the call is in
+    int op; // OPR M of its update, 0 for a plain tail call
+    int first, end; // The instructions of e
+    int L, M; // The variable it updates
+} tail_site;
+
+// Returns 1 if code[first] to code[end - 1] computes a single value from constants and the
+// procedure's own variables, without anything that can fail at run time
+static int pure_value(const assembly *code, int first, int end) {
+    int depth = 0;
+    for (int i = first; i < end; i++) {
+        if (code[i].OP == 1 || (code[i].OP == 3 && code[i].L == 0))
+            depth++;
+        else if (code[i].OP == 2 && code[i].M >= 1 && code[i].M <= 10 && code[i].M != 4 && depth >= 2)
+            depth--;
+        else if (!(code[i].OP == 2 && code[i].M == 11 && depth >= 1))
+            return 0;
+    }
+    return depth == 1;
+}
+
+// Returns the instruction the code from code[i] on really starts with, past the JMPs
+static int skip_jumps(const assembly *code, int size, int i) {
+    for (int hops = 0; i >= 1 && i <= size && code[i].OP == 7 && hops < 16; hops++)
+        i = code_index(code[i].M);
+    return i;
+}
+
+// Checks the code after the CAL at index j, which returns from procedure p, for the shape of a
+// tail call. Fills in site and returns 1 if it has one.
+static int tail_shape(const assembly *code, int size, const tail_proc *p, int j, tail_site *site) {
+    int k = skip_jumps(code, size, j + 1);
+    site->op = 0;
+    if (k == p->ret)
+        return 1;
+    // x := x op e or x := e op x, then the return
+    int s = k;
+    while (s < p->ret && code[s].OP != 4) {
+        if (code[s].OP != 1 && code[s].OP != 2 && code[s].OP != 3)
+            return 0;
+        s++;
+    }
+    if (s >= p->ret || code[s].L == 0 || s - k < 3 || skip_jumps(code, size, s + 1) != p->ret)
+        return 0;
+    int op = code[s - 1].OP == 2 ? code[s - 1].M : 0;
+    if (op != 1 && op != 2 && op != 3)
+        return 0;
+    if (code[k].OP == 3 && code[k].L == code[s].L && code[k].M == code[s].M && pure_value(code, k + 1, s - 1)) {
+        site->first = k + 1;
+        site->end = s - 1;
+    }
+    else if (op != 2 && code[s - 2].OP == 3 && code[s - 2].L == code[s].L && code[s - 2].M == code[s].M
+             && pure_value(code, k, s - 2)) {
+        site->first = k;
+        site->end = s - 2;
+    }
+    else
+        return 0;
+    site->op = op;
+    site->L = code[s].L;
+    site->M = code[s].M;
+    // The updates of one procedure all go into the same accumulator
+    int apply = op == 3 ? 3 : 1;
+    return p->op == 0 || (p->op == apply && p->L == site->L && p->M == site->M);
+}
+
+// Turns the calls procedures make to themselves as the last thing they do into jumps. Returns
+// the number of calls replaced and adds those that go through an accumulator to *accumulated.
+int eliminate_tail_calls(pl0_compiler *ctx, int *accumulated) {
+    int size = ctx->code.size;
+    assembly *code = ctx->code.code;
+    arena procs_mem = {0}, sites_mem = {0}, at_mem = {0}, map_mem = {0}, out_mem = {0};
+    tail_proc *procs = arena_fit(&ctx->pool, &procs_mem, (size_t) (ctx->sym_table.size + 1) * sizeof(tail_proc));
+    // at[i] is the procedure whose INC or return is code[i], or -2 - s if code[i] is the call of
+    // tail site s, and -1 otherwise
+    int *at = arena_fit(&ctx->pool, &at_mem, (size_t) (size + 2) * sizeof(int));
+    memset(at, -1, (size_t) (size + 2) * sizeof(int));
+    tail_site *sites = NULL;
+    int proc_count = 0, site_count = 0;
+    for (int i = 0; i < ctx->sym_table.size; i++) {
+        const symbol *sym = &ctx->sym_table.table[i];
+        int entry = sym->addr >= 0 ? code_index(sym->addr) : 0;
+        if (sym->kind != 3 || entry < 1 || entry > size)
+            continue;
+        tail_proc *p = &procs[proc_count];
+        p->entry = entry;
+        p->inc = code[entry].OP == 7 ? code_index(code[entry].M) : entry;
+        if (p->inc < 1 || p->inc > size || code[p->inc].OP != 6)
+            continue;
+        p->ret = p->inc + 1;
+        while (p->ret <= size && !(code[p->ret].OP == 2 && code[p->ret].M == 0))
+            p->ret++;
+        if (p->ret > size)
+            continue;
+        p->op = 0;
+        for (int j = p->inc + 1; j < p->ret; j++) {
+            tail_site site;
+            if (code[j].OP != 5 || code[j].L != 1 || code_index(code[j].M) != entry
+                || !tail_shape(code, size, p, j, &site))
+                continue;
+            if (site.op != 0 && p->op == 0) {
+                p->op = site.op == 3 ? 3 : 1;
+                p->L = site.L;
+                p->M = site.M;
+            }
+            site.proc = proc_count;
+            sites = arena_fit(&ctx->pool, &sites_mem, (size_t) (site_count + 1) * sizeof(tail_site));
+            sites[site_count] = site;
+            at[j] = -2 - site_count++;
+        }
+        at[p->inc] = at[p->ret] = proc_count++;
+    }
+    if (site_count == 0) {
+        arena_free(&procs_mem);
+        arena_free(&at_mem);
+        return 0;
+    }
+
+    // Every target still refers to the old code and is moved through map at the end. A
+    // procedure's return becomes a target of the code applying its accumulator, and the jumps
+    // that replace calls go to the instruction after its INC, past the accumulator's setup.
+    int *map = arena_fit(&ctx->pool, &map_mem, (size_t) (size + 2) * sizeof(int));
+    assembly *out = NULL;
+    int n = 1;
+    for (int i = 1; i <= size; i++) {
+        out = arena_fit(&ctx->pool, &out_mem, (size_t) (n + 8) * sizeof(assembly));
+        map[i] = n;
+        if (at[i] < -1) {
+            const tail_site *site = &sites[-2 - at[i]];
+            const tail_proc *p = &procs[site->proc];
+            if (site->op != 0) {
+                out = arena_fit(&ctx->pool, &out_mem, (size_t) (n + 8 + site->end - site->first) * sizeof(assembly));
+                out[n++] = (assembly) { .OP = 3, .L = 0, .M = code[p->inc].M };
+                for (int k = site->first; k < site->end; k++)
+                    out[n++] = code[k];
+                out[n++] = (assembly) { .OP = 2, .L = 0, .M = site->op };
+                out[n++] = (assembly) { .OP = 4, .L = 0, .M = code[p->inc].M };
+                (*accumulated)++;
+            }
+            out[n++] = (assembly) { .OP = 7, .L = 0, .M = 3 * p->inc };
+            continue;
+        }
+        const tail_proc *p = at[i] >= 0 ? &procs[at[i]] : NULL;
+        if (p != NULL && p->op != 0 && i == p->inc) {
+            // The accumulator takes the slot past the frame and starts out as 0 or 1
+            out[n++] = (assembly) { .OP = 6, .L = 0, .M = code[i].M + 1 };
+            out[n++] = (assembly) { .OP = 1, .L = 0, .M = p->op == 3 };
+            out[n++] = (assembly) { .OP = 4, .L = 0, .M = code[i].M };
+            continue;
+        }
+        if (p != NULL && p->op != 0 && i == p->ret) {
+            out[n++] = (assembly) { .OP = 3, .L = p->L, .M = p->M };
+            out[n++] = (assembly) { .OP = 3, .L = 0, .M = code[p->inc].M };
+            out[n++] = (assembly) { .OP = 2, .L = 0, .M = p->op };
+            out[n++] = (assembly) { .OP = 4, .L = p->L, .M = p->M };
+        }
+        out[n++] = code[i];
+    }
+    for (int k = 1; k < n; k++)
+        if (out[k].OP == 5 || out[k].OP == 7 || out[k].OP == 8)
+            out[k].M = 3 * (map[code_index(out[k].M)] - 1);
+    for (int i = 0; i < ctx->sym_table.size; i++) {
+        symbol *sym = &ctx->sym_table.table[i];
+        if (sym->kind == 3 && sym->addr >= 0 && code_index(sym->addr) <= size)
+            sym->addr = 3 * (map[code_index(sym->addr)] - 1);
+    }
+    ctx->code.code = arena_fit(&ctx->pool, &ctx->code.mem, (size_t) (n + 1) * sizeof(assembly));
+    memcpy(ctx->code.code + 1, out + 1, (size_t) (n - 1) * sizeof(assembly));
+    ctx->code.size = n - 1;
+    ctx->code.cx = n;
+    arena_free(&procs_mem);
+    arena_free(&sites_mem);
+    arena_free(&at_mem);
+    arena_free(&map_mem);
+    arena_free(&out_mem);
+    return site_count;
+}
+
+// Dead code elimination
+//
+// Builds the call graph of the program from its CAL instructions and keeps only the code that
+// can run. The walk starts at the main block and follows the control flow of each procedure it
+// reaches: an instruction falls through to the next one unless it is a JMP, a return or the
+// halt, and a JMP or JPC also leads to its target. A CAL is an edge of the call graph, and the
+// procedure it calls is walked in turn. Procedures no walk reaches, including those only called
+// by themselves or by other unused procedures, are dropped, and so is every instruction the walks
+// missed inside the procedures that stay, such as the statements after a loop whose condition
+// is constantly true. The code is then compacted as after a peephole sweep.
+
+// Drops the code that cannot run. Returns the number of instructions removed and adds the number
+// of procedures removed to *procedures.
+int eliminate_dead_code(pl0_compiler *ctx, int *procedures) {
+    int size = ctx->code.size;
+    assembly *code = ctx->code.code;
+    arena live_mem = {0}, stack_mem = {0}, map_mem = {0};
+    char *live = arena_fit(&ctx->pool, &live_mem, (size_t) size + 2);
+    // Every push is a JPC or CAL seen once, plus the main block
+    int *stack = arena_fit(&ctx->pool, &stack_mem, (size_t) (size + 1) * sizeof(int));
+    int depth = 0, reached = 0;
+    stack[depth++] = 1;
+    while (depth > 0) {
+        int i = stack[--depth];
+        while (i >= 1 && i <= size && !live[i]) {
+            live[i] = 1;
+            reached++;
+            int OP = code[i].OP, M = code[i].M;
+            if (OP == 7) {
+                i = code_index(M);
+                continue;
+            }
+            if ((OP == 5 || OP == 8) && code_index(M) >= 1 && code_index(M) <= size && !live[code_index(M)])
+                stack[depth++] = code_index(M);
+            if ((OP == 2 && M == 0) || (OP == 9 && M == 3))
+                break;
+            i++;
+        }
+    }
+
+    int removed = size - reached;
+    if (removed > 0) {
+        // A procedure starts with the JMP over its own procedures, which calls may already skip
+        // straight to its INC, or with the INC when the peephole rules dropped that JMP
+        for (int i = 0; i < ctx->sym_table.size; i++) {
+            symbol *sym = &ctx->sym_table.table[i];
+            int t = sym->addr >= 0 ? code_index(sym->addr) : 0;
+            if (sym->kind != 3 || t < 1 || t > size || live[t])
+                continue;
+            if (code[t].OP == 7 && code_index(code[t].M) >= 1 && code_index(code[t].M) <= size)
+                t = code_index(code[t].M);
+            if (live[t])
+                sym->addr = 3 * (t - 1);
+            else {
+                sym->addr = -1;
+                (*procedures)++;
+            }
+        }
+        for (int i = 1; i <= size; i++)
+            if (!live[i])
+                code[i].OP = 0;
+        compact_code(ctx, &map_mem);
+    }
+    arena_free(&live_mem);
+    arena_free(&stack_mem);
+    arena_free(&map_mem);
+    return removed;
+}
+
+// Object files
+//
+// write_object() stores the program in a binary image that loaders can mmap and use in place:
+//
+//     header      32 bytes, see obj_header
+//     code        count instructions, each three 32-bit words OP, L, M (the layout of assembly)
+//     symbols     symbol_count entries of 32 bytes, see obj_symbol (absent when stripped)
+//
+// All fields are in the byte order of the machine that wrote the file; a loader on a machine of
+// the other order sees a wrong magic number and rejects the file. The image is assembled in memory
+// and written with a single write().
+
+_Static_assert(sizeof(assembly) == 12, "object files store instructions as assembly");
+_Static_assert(sizeof(obj_header) == 32, "object header must stay 32 bytes");
+_Static_assert(sizeof(obj_symbol) == 32, "object symbols must stay 32 bytes");
+
+// Writes the count instructions in code and the symbol_count entries of symbols to path.
+// Returns 0 on success or -1 if the file could not be written.
+int write_object(arena_pool *pool, const char *path, const assembly *code, int count,
+                 const symbol *symbols, int symbol_count) {
+    size_t code_bytes = (size_t) count * sizeof(assembly);
+    size_t size = sizeof(obj_header) + code_bytes + (size_t) symbol_count * sizeof(obj_symbol);
+    arena image_mem = {0};
+    char *image = arena_fit(pool, &image_mem, size);
+
+    obj_header *header = (obj_header *) image;
+    header->magic = OBJ_MAGIC;
+    header->version = OBJ_VERSION;
+    header->count = (uint32_t) count;
+    header->entry = 0;
+    for (int i = 0; i < count; i++)
+        if (code[i].OP == 6 && (uint32_t) code[i].M > header->max_frame)
+            header->max_frame = (uint32_t) code[i].M;
+    header->symbol_count = (uint32_t) symbol_count;
+    header->symbol_offset = symbol_count > 0 ? (uint32_t) (sizeof(obj_header) + code_bytes) : 0;
+    memcpy(image + sizeof(obj_header), code, code_bytes);
+
+    obj_symbol *sym = (obj_symbol *) (image + sizeof(obj_header) + code_bytes);
+    for (int i = 0; i < symbol_count; i++) {
+        const symbol *s = &symbols[i];
+        sym[i].kind = s->kind;
+        sym[i].val = s->val;
+        sym[i].level = s->level;
+        sym[i].addr = s->addr;
+        sym[i].mark = s->mark;
+        memcpy(sym[i].name, s->name, (size_t) s->name_len); // names are at most 11 characters
+    }
+
+    int status = write_file(path, image, size);
+    arena_free(&image_mem);
+    return status;
+}
+
+// Writes the size bytes at data to path with a single write(). Returns 0 on success or -1.
+int write_file(const char *path, const void *data, size_t size) {
+    int status = -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write(fd, data, size) == (ssize_t) size)
+            status = 0;
+        if (close(fd) != 0)
+            status = -1;
+    }
+    return status;
+}
+
+// Returns 1 if M is the address of an instruction in a program of count instructions
+static int valid_target(int M, int count) {
+    return M >= 0 && M % 3 == 0 && M / 3 < count;
+}
+
+// Checks that the code of an object file cannot take the machine outside its stack, as the
+// engines trust the code they run. Every instruction must be one the compiler can generate, with
+// its jump or call target in the code, its level difference below the number of INCs (one per
+// block, a bound on how deeply blocks nest) and its address inside the largest frame, which must
+// be the header's max_frame. Then the words an activation record holds above its base are followed
+// through every path from the entry and from each procedure: they must be the same wherever
+// paths meet, pops may only take values above the three link words, pushes may only go above
+// them too, and a LOD or STO of the current record must stay below its top. Returns NULL, or
+// what is wrong with the instruction at *at.
+static const char *check_code(const assembly *code, int count, uint32_t max_frame, int *at) {
+    arena_pool pool = {0};
+    arena depth_mem = {0}, work_mem = {0};
+    long *depth = arena_fit(&pool, &depth_mem, (size_t) count * sizeof(long));
+    int *work = arena_fit(&pool, &work_mem, (size_t) (count + 1) * sizeof(int));
+    const char *problem = NULL;
+    int blocks = 0, work_count = 0;
+    long frame = 0;
+    for (int i = 0; i < count; i++)
+        depth[i] = -1;
+    for (int i = 0; i < count; i++) {
+        blocks += code[i].OP == 6;
+        // Procedures start with nothing above the base of their record
+        if (code[i].OP == 5 && valid_target(code[i].M, count) && depth[code[i].M / 3] == -1) {
+            depth[code[i].M / 3] = 0;
+            work[work_count++] = code[i].M / 3;
+        }
+    }
+    if (depth[0] != 0) {
+        depth[0] = 0;
+        work[work_count++] = 0;
+    }
+
+    for (int i = 0; i < count && problem == NULL; i++) {
+        int OP = code[i].OP, L = code[i].L, M = code[i].M;
+        *at = i;
+        if (OP < 1 || OP > 9 || (OP == 2 && (M < 0 || M > 11)) || (OP == 9 && (M < 1 || M > 3))
+            || ((OP == 5 || OP == 7 || OP == 8) && !valid_target(M, count))
+            || ((OP == 3 || OP == 4 || OP == 5) && (L < 0 || L >= blocks))
+            || ((OP == 3 || OP == 4) && (M < 0 || (uint32_t) M >= max_frame)) || (OP == 4 && M < 3)
+            || (OP == 6 && (M < 0 || (uint32_t) M > max_frame)))
+            problem = "has an invalid instruction";
+        else if (OP == 6 && M > frame)
+            frame = M;
+    }
+    if (problem == NULL && (uint32_t) frame != max_frame) {
+        *at = -1;
+        problem = "has a wrong frame size";
+    }
+
+    while (problem == NULL && work_count > 0) {
+        int i = work[--work_count];
+        int OP = code[i].OP, L = code[i].L, M = code[i].M;
+        long d = depth[i];
+        *at = i;
+        // Words popped and pushed, and where control goes next
+        int pops = OP == 4 || OP == 8 || (OP == 9 && M == 1) ? 1 : OP == 2 && M >= 1 && M <= 10 ? 2 : OP == 2 && M == 11 ? 1 : 0;
+        int pushes = OP == 1 || OP == 3 || (OP == 2 && M >= 1) || (OP == 9 && M == 2) ? 1 : 0;
+        if (pops > 0 && d - pops < 3)
+            problem = "takes a value the stack does not hold";
+        else if (pushes > 0 && d - pops < 3)
+            problem = "writes over the links of an activation record";
+        else if (L == 0 && ((OP == 3 && M >= d) || (OP == 4 && M >= d - 1)))
+            problem = "reaches past the top of its activation record";
+        if (problem != NULL)
+            break;
+        d += (OP == 6 ? M : 0) - pops + pushes;
+        int next[2], next_count = 0;
+        if (OP == 7 || OP == 8)
+            next[next_count++] = M / 3;
+        if (OP != 7 && !(OP == 2 && M == 0) && !(OP == 9 && M == 3) && i + 1 < count)
+            next[next_count++] = i + 1;
+        for (int k = 0; k < next_count; k++) {
+            int j = next[k];
+            if (depth[j] == -1) {
+                depth[j] = d;
+                work[work_count++] = j;
+            }
+            else if (depth[j] != d) {
+                *at = j;
+                problem = "is reached with different stack depths";
+            }
+        }
+    }
+    arena_free_all(&pool);
+    return problem;
+}
+
+// Maps the object file at path and points obj at its header, code and symbols without copying
+// them. Returns 0 on success, or -1 after printing why the file cannot be used.
+int load_object(const char *path, pl0_object *obj) {
+    memset(obj, 0, sizeof(*obj));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error opening file\n");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = size >= sizeof(obj_header) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Error: %s is not a PM/0 object file\n", path);
+        return -1;
+    }
+
+    const obj_header *header = map;
+    const char *problem = NULL;
+    if (header->magic != OBJ_MAGIC)
+        problem = "is not a PM/0 object file";
+    else if (header->version != OBJ_VERSION)
+        problem = "was written for another object format version";
+    else if (header->count == 0 || header->count > (size - sizeof(obj_header)) / sizeof(assembly)
+             || header->count > INT32_MAX)
+        problem = "has a truncated code section";
+    else if (header->entry != 0)
+        problem = "has an unsupported entry point";
+    else if (header->symbol_count > 0
+             && (header->symbol_offset % 4 != 0 || header->symbol_offset > size
+                 || header->symbol_count > (size - header->symbol_offset) / sizeof(obj_symbol)))
+        problem = "has a truncated symbol section";
+    int at = -1;
+    if (problem == NULL)
+        problem = check_code((const assembly *) ((const char *) map + sizeof(obj_header)), (int) header->count,
+                             header->max_frame, &at);
+    if (problem != NULL) {
+        if (at >= 0)
+            printf("Error: %s %s at address %d\n", path, problem, at * 3);
+        else
+            printf("Error: %s %s\n", path, problem);
+        munmap(map, size);
+        return -1;
+    }
+
+    obj->header = header;
+    obj->code = (const assembly *) ((const char *) map + sizeof(obj_header));
+    obj->symbols = header->symbol_count > 0 ? (const obj_symbol *) ((const char *) map + header->symbol_offset) : NULL;
+    obj->map = map;
+    obj->map_size = size;
+    return 0;
+}
+
+// Unmaps an object file opened by load_object
+void free_object(pl0_object *obj) {
+    if (obj->map != NULL)
+        munmap(obj->map, obj->map_size);
+    obj->map = NULL;
+}
+
+// Compile cache
+//
+// With --cache DIR a program that was compiled before is not compiled again. An entry is named
+// after a 64-bit hash of the source bytes, the compiler build and every option that changes the
+// output, and holds the object file (KEY.bin) and everything that was listed (KEY.out). Files
+// are written under a temporary name and renamed into place, so processes sharing a directory
+// only ever see complete files, and two that race to store an entry write the same bytes. The
+// listing goes last and marks the entry complete. A hit touches both files; once the directory
+// grows past its limit, the files used least recently are deleted first. DIR/stats counts hits
+// and misses across runs.
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+// XXH64 of the len bytes at data: four independent lanes over 32-byte stripes, then the tail
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    }
+    else
+        h = seed + XXH_P5;
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        h = rotl64(h ^ (uint64_t) v * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+// Writes the path of the entry file with extension ext to out. Returns -1 if it does not fit.
+static int cache_path(char *out, size_t n, const pl0_cache *cache, uint64_t key, const char *ext)
+{
+    int len = snprintf(out, n, "%s/%016llx%s", cache->dir, (unsigned long long) key, ext);
+    return len > 0 && (size_t) len < n ? 0 : -1;
+}
+
+// Counters kept in DIR/stats
+enum { CACHE_HITS, CACHE_MISSES, CACHE_BYTES, CACHE_COUNTERS };
+
+// Adds amount to a counter in DIR/stats, or sets it to amount if replace is set, under a lock
+// shared by all processes. Returns the new value.
+static uint64_t cache_tally(const pl0_cache *cache, int counter, uint64_t amount, int replace)
+{
+    char path[1024];
+    if (snprintf(path, sizeof path, "%s/stats", cache->dir) >= (int) sizeof path)
+        return 0;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return 0;
+    uint64_t counts[CACHE_COUNTERS] = {0};
+    if (flock(fd, LOCK_EX) == 0)
+    {
+        if (pread(fd, counts, sizeof counts, 0) != (ssize_t) sizeof counts)
+            memset(counts, 0, sizeof counts);
+        counts[counter] = replace ? amount : counts[counter] + amount;
+        if (pwrite(fd, counts, sizeof counts, 0) != (ssize_t) sizeof counts)
+            counts[counter] = 0;
+    }
+    close(fd); // Also drops the lock
+    return counts[counter];
+}
+
+// Looks up the entry for key. On a hit, maps its listing into listing and its code into obj,
+// marks it as just used and returns 0. Returns -1 on a miss.
+int cache_lookup(const pl0_cache *cache, uint64_t key, source_buf *listing, pl0_object *obj)
+{
+    char bin[1024], out[1024];
+    struct stat st;
+    if (cache_path(bin, sizeof bin, cache, key, ".bin") != 0 || cache_path(out, sizeof out, cache, key, ".out") != 0
+        || stat(out, &st) != 0 || stat(bin, &st) != 0)
+    {
+        cache_tally(cache, CACHE_MISSES, 1, 0);
+        return -1;
+    }
+    if (load_source(out, listing) != 0)
     {
-        do {
-            update_tokens(get_next_token());
-            if (global_tkn_list.token != 2)
-                error(2);
-            if (symbol_table_check() != -1)
-                error(19);
-            // save ident name
-            strcpy(global_sym_table.table[global_sym_table.size].name, global_tkn_list.names[global_tkn_list.current_index]);
-            update_tokens(get_next_token());
-            if (global_tkn_list.token != 9)
-                error(4);
-            update_tokens(get_next_token());
-            if (global_tkn_list.token!= 3)
-                error(5);
-            // add to symbol table (kind 1, value, L, M, mark)
-            global_sym_table.table[global_sym_table.size].kind = 1;
-            global_sym_table.table[global_sym_table.size].val = global_tkn_list.nums[global_tkn_list.num_count];
-            global_sym_table.table[global_sym_table.size].level = 0; 
-            global_sym_table.table[global_sym_table.size].addr = 0;
-            global_sym_table.table[global_sym_table.size].mark = 0;
-            global_sym_table.size++;
-            global_tkn_list.num_count++;
-            update_tokens(get_next_token());
-        } while (global_tkn_list.token == 17);
-        if (global_tkn_list.token!= 18)
-            error(6);
-        update_tokens(get_next_token());
-    }
-}
-
-int var_declaration(){
-    // if (token == varsym) {
-    //     do {
-    //     num_vars++
-    //     get next token
-    //     if token != identsym
-    //         error
-    //     if symbol_table_check (token) != -1
-    //         error
-    //     add to symbol table (kind 2, ident, 0, 0, var# + 2)
-    //     get next token
-    //     } while (token == commasym)
-    //     if (token != semicolonsym)
-    //         error
-    //     get next token
-    // }
-    
-    int num_vars = 0;
-    if (global_tkn_list.token == 29) {
-        int space = 3;
-        do {
-        num_vars++;
-        update_tokens(get_next_token());
-        if (global_tkn_list.token != 2)
-            error(2);
-        if (symbol_table_check() != -1)
-            error(3);
-        // add to symbol table (kind 2, name, 0, L, M, mark)
-        global_sym_table.table[global_sym_table.size].kind = 2;
-        strcpy(global_sym_table.table[global_sym_table.size].name, global_tkn_list.names[global_tkn_list.current_index]);
-        global_sym_table.table[global_sym_table.size].val = 0;
-        global_sym_table.table[global_sym_table.size].level = global_sym_table.current_level;
-        global_sym_table.table[global_sym_table.size].addr = space;
-        global_sym_table.table[global_sym_table.size].mark = 0;
-        global_sym_table.size++;
-        global_sym_table.symIdx++;
-        space++;
-        update_tokens(get_next_token());
-        } while (global_tkn_list.token == 17);
-        if (global_tkn_list.token != 18)
-            error(6);
-        update_tokens(get_next_token());
+        cache_tally(cache, CACHE_MISSES, 1, 0);
+        return -1;
+    }
+    if (load_object(bin, obj) != 0)
+    {
+        free_source(listing);
+        cache_tally(cache, CACHE_MISSES, 1, 0);
+        return -1;
     }
-    return num_vars;
+    utimensat(AT_FDCWD, bin, NULL, 0);
+    utimensat(AT_FDCWD, out, NULL, 0);
+    cache_tally(cache, CACHE_HITS, 1, 0);
+    return 0;
 }
 
-void procedure_declaration(int jmpaddr){
-    //  {"procedure" ident ";" block ";"}
-    while (global_tkn_list.token == 30) {       // "procedure"
-        update_tokens(get_next_token());  
-        if (global_tkn_list.token != 2)         // ident
-            error(2);
-        if (symbol_table_check() != -1)         // Check if procedure has been declared already
-            error(19);
-        // add to symbol table (kind 3, ident, 0, 0, var# + 2)
-        global_sym_table.table[global_sym_table.size].kind = 3;
-        strcpy(global_sym_table.table[global_sym_table.size].name, global_tkn_list.names[global_tkn_list.current_index]);
-        global_sym_table.table[global_sym_table.size].val = 0;
-        global_sym_table.table[global_sym_table.size].level = global_sym_table.current_level;
-        global_sym_table.table[global_sym_table.size].addr = jmpaddr * 3;
-        global_sym_table.table[global_sym_table.size].mark = 0;
-        global_sym_table.procIdx = global_sym_table.size;
-        global_sym_table.size++;
-        global_sym_table.symIdx++; 
-        update_tokens(get_next_token());  
-        if (global_tkn_list.token != 18)        // ";"
-            error(18);                           
-        update_tokens(get_next_token());
-        block(); 
-        emit(2, 0, 0);                          // block
-        if (global_tkn_list.token != 18)        // ";"
-            error(6);                         
-        update_tokens(get_next_token()); 
-    }
-}
-
-void statement(){
-    // if (token == identsym) {
-    //     symIdx = symbol_table_check (token)
-    //     if (symIdx == -1)
-    //         error
-    //     if (table[symIdx].kind != 2 (not a var))
-    //         error
-    //     get next token
-    //     if (token != becomessym)
-    //         error
-    //     get next token
-    //     expression();
-    //     emit STO (M = table[symIdx].addr)
-    //     return
-    // }
-    // if (token == beginsym) {
-    //     do {
-    //     get next token
-    //     statement();
-    //     } while token == semicolonsym
-    //     if (token != endsym)
-    //         error
-    //     get next token
-    //     return
-    // }
-    // if (token == ifsym) {
-    //     get next token
-    //     condition();
-    //     jpcIdx = current code index
-    //     emit JPC
-    //     if (token != thensym)
-    //         error
-    //     get next token
-    //     statement();
-    //     code[jpcIdx].M = current code index
-    //     return
-    // }
-    // if (token == whilesym) {
-    //     get next token
-    //     loopIdx = current code index
-    //     condition();
-    //     if (token != dosym)
-    //         error
-    //     get next token
-    //     jpcIdx = current code index
-    //     emit JPC
-    //     statement();
-    //     emit JMP (M = loopIdx)
-    //     code[jpcIdx].M = current code index
-    //     return
-    // }
-    // if (token == readsym) {
-    //     get next token
-    //     if (token != identsym)
-    //         error
-    //     symIdx = symbol_table_check (token)
-    //     if (symIdx == -1)
-    //         error
-    //     if (table[symIdx].kind != 2 (not a var))
-    //         error
-    //     get next token
-    //     emit READ
-    //     emit STO (M = table[symIdx].addr)
-    //     return
-    // }
-    // if (token == writesym) {
-    //     get next token
-    //     expression();
-    //     emit WRITE
-    //     return
-    // }
+typedef struct cache_file
+{
+    char name[24]; // KEY.bin or KEY.out
+    off_t size;
+    struct timespec used; // Last modified, which a hit also updates
+} cache_file;
+
+static int cache_file_older(const void *a, const void *b)
+{
+    const struct timespec *x = &((const cache_file *) a)->used, *y = &((const cache_file *) b)->used;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Lists the entry files in the cache directory into files. Returns how many there are, or -1
+// if the directory cannot be read.
+static int cache_files(const pl0_cache *cache, arena_pool *pool, arena *mem, cache_file **files, size_t *total)
+{
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL)
+        return -1;
+    int count = 0;
+    *total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // Entry names are 16 hex digits and an extension; temporary files and stats are not
+        const char *dot = strchr(entry->d_name, '.');
+        if (dot == NULL || dot - entry->d_name != 16 || (strcmp(dot, ".bin") != 0 && strcmp(dot, ".out") != 0))
+            continue;
+        struct stat st;
+        char path[1024];
+        if (snprintf(path, sizeof path, "%s/%s", cache->dir, entry->d_name) >= (int) sizeof path
+            || stat(path, &st) != 0)
+            continue;
+        *files = arena_fit(pool, mem, (size_t) (count + 1) * sizeof(cache_file));
+        memcpy((*files)[count].name, entry->d_name, 21); // 16 digits, the extension and the NUL
+        (*files)[count].size = st.st_size;
+        (*files)[count].used = st.st_mtim;
+        *total += (size_t) st.st_size;
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+// Deletes the files used least recently until the directory fits in max_bytes
+static void cache_trim(const pl0_cache *cache, arena_pool *pool)
+{
+    arena mem = {0};
+    cache_file *files = NULL;
+    size_t total;
+    int count = cache_files(cache, pool, &mem, &files, &total);
+    if (count < 0)
+        return;
+    if (total > cache->max_bytes)
+    {
+        qsort(files, (size_t) count, sizeof(cache_file), cache_file_older);
+        for (int i = 0; i < count && total > cache->max_bytes; i++)
+        {
+            char path[1024];
+            snprintf(path, sizeof path, "%s/%s", cache->dir, files[i].name);
+            if (unlink(path) == 0)
+                total -= (size_t) files[i].size;
+        }
+    }
+    cache_tally(cache, CACHE_BYTES, total, 1);
+    arena_free(&mem);
+}
+
+// Renames the temporary file tmp to the entry file with extension ext if it was written
+// (written is 0), or deletes it
+static int cache_commit(const pl0_cache *cache, uint64_t key, const char *ext, const char *tmp, int written)
+{
+    char path[1024];
+    if (written == 0 && cache_path(path, sizeof path, cache, key, ext) == 0 && rename(tmp, path) == 0)
+        return 0;
+    unlink(tmp);
+    return -1;
+}
 
-    if (global_tkn_list.token == 2) {
-        global_sym_table.symIdx = symbol_table_check();
-        if (global_sym_table.symIdx == -1)
-            error(7);
-        if (global_sym_table.table[global_sym_table.symIdx].kind != 2)
-            error(8);
-        update_tokens(get_next_token());
-        if (global_tkn_list.token != 20)
-            error(9);
-        update_tokens(get_next_token());
-        expression(); 
-        emit(4, global_sym_table.current_level - global_sym_table.table[global_sym_table.symIdx].level, global_sym_table.table[global_sym_table.symIdx].addr);
+// Stores the compiled code and its listing under key. The directory is only scanned and
+// trimmed once the running total of stored bytes in DIR/stats passes the limit.
+void cache_store(const pl0_cache *cache, arena_pool *pool, uint64_t key, const char *listing, size_t listing_size,
+                 const assembly *code, int count, const symbol *symbols, int symbol_count)
+{
+    static _Atomic unsigned temp_serial;
+    char tmp[1024];
+    if (snprintf(tmp, sizeof tmp, "%s/tmp.%ld.%u", cache->dir, (long) getpid(),
+                 atomic_fetch_add(&temp_serial, 1)) >= (int) sizeof tmp)
         return;
+    if (cache_commit(cache, key, ".bin", tmp, write_object(pool, tmp, code, count, symbols, symbol_count)) == 0
+        && cache_commit(cache, key, ".out", tmp, write_file(tmp, listing, listing_size)) == 0)
+    {
+        size_t bytes = sizeof(obj_header) + (size_t) count * sizeof(assembly) + (size_t) symbol_count * sizeof(obj_symbol)
+                       + listing_size;
+        if (cache_tally(cache, CACHE_BYTES, bytes, 0) > cache->max_bytes)
+            cache_trim(cache, pool);
+    }
+}
+
+// Prints what the cache directory holds and its hit and miss counts
+void cache_report(const pl0_cache *cache, arena_pool *pool)
+{
+    arena mem = {0};
+    cache_file *files = NULL;
+    size_t total = 0;
+    int count = cache_files(cache, pool, &mem, &files, &total);
+    int entries = 0;
+    for (int i = 0; i < count; i++)
+        entries += strstr(files[i].name, ".out") != NULL;
+    arena_free(&mem);
+
+    uint64_t counts[CACHE_COUNTERS] = {0};
+    char path[1024];
+    int fd = snprintf(path, sizeof path, "%s/stats", cache->dir) < (int) sizeof path ? open(path, O_RDONLY) : -1;
+    if (fd >= 0)
+    {
+        if (pread(fd, counts, sizeof counts, 0) != (ssize_t) sizeof counts)
+            memset(counts, 0, sizeof counts);
+        close(fd);
+    }
+    uint64_t lookups = counts[CACHE_HITS] + counts[CACHE_MISSES];
+    printf("Cache %s: %d entries, %zu of %zu bytes\n", cache->dir, entries, total, cache->max_bytes);
+    printf("%llu hits, %llu misses (%.1f%% hit rate)\n", (unsigned long long) counts[CACHE_HITS],
+           (unsigned long long) counts[CACHE_MISSES],
+           lookups > 0 ? 100.0 * (double) counts[CACHE_HITS] / (double) lookups : 0.0);
+}
+
+// Virtual machine
+//
+// Runs the PM/0 code in global_code directly. Jump and call targets are M / 3, the same
+// convention block() and statement() use when they patch addresses. Before running, every
+// instruction is translated into a threaded form that holds the address of its handler, so
+// dispatch is a single indirect jump (computed goto) with no decoding in the loop.
+//
+// The VM, the JIT and the register IR share one set of limits, so a program that runs out of
+// stack stops with the same error in all of them, and a RTN in the main block ends the program
+// like a halt in all of them.
+
+#define VM_STACK_WORDS (1L << 24) // Size of the PM/0 stack
+#define VM_CALL_DEPTH (1L << 23) // Most calls that may be active at once
+
+typedef struct vm_op
+{
+    const void *handler; // Label that executes this instruction
+    int L; // Lexicographical level
+    int M; // Operand; an instruction index for JMP, JPC and CAL
+} vm_op;
+
+// Returns the largest INC operand in the count instructions of code, 0 if there is none
+static long largest_frame(const assembly *code, int count) {
+    long frame = 0;
+    for (int i = 0; i < count; i++)
+        if (code[i].OP == 6 && code[i].M > frame)
+            frame = code[i].M;
+    return frame;
+}
+
+// Returns the largest stack top index INC may reach in the count instructions of code. The
+// words above it are left for expression temporaries, the link words of a call and the largest
+// frame, which LOD and STO may reach from the base of any activation record.
+static long stack_limit(const assembly *code, int count) {
+    return VM_STACK_WORDS - count - 4 - largest_frame(code, count);
+}
+
+// Runs the count instructions in code, starting at the first one, and fills in stats.
+// Returns 0 when the program halts, or 1 after reporting a runtime error.
+int run_vm(arena_pool *pool, const assembly *code, int count, vm_stats *stats) {
+    static const void *opr_handlers[12] = {
+        &&op_rtn, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_eql,
+        &&op_neq, &&op_lss, &&op_leq, &&op_gtr, &&op_geq, &&op_odd,
+    };
+    static const void *sys_handlers[4] = { &&bad_instr, &&op_write, &&op_read, &&op_halt };
+
+    arena prog_mem = {0};
+    arena stack_mem = {0};
+    vm_op *prog = arena_fit(pool, &prog_mem, (size_t) (count + 1) * sizeof(vm_op));
+    for (int i = 0; i < count; i++) {
+        int OP = code[i].OP, L = code[i].L, M = code[i].M;
+        prog[i].L = L;
+        prog[i].M = M;
+        switch (OP) {
+            case 1: prog[i].handler = &&op_lit; break;
+            case 2: prog[i].handler = M >= 0 && M <= 11 ? opr_handlers[M] : &&bad_instr; break;
+            case 3: prog[i].handler = &&op_lod; break;
+            case 4: prog[i].handler = &&op_sto; break;
+            case 5: prog[i].handler = valid_target(M, count) ? &&op_cal : &&bad_target; break;
+            case 6: prog[i].handler = &&op_inc; break;
+            case 7: prog[i].handler = valid_target(M, count) ? &&op_jmp : &&bad_target; break;
+            case 8: prog[i].handler = valid_target(M, count) ? &&op_jpc : &&bad_target; break;
+            case 9: prog[i].handler = M >= 1 && M <= 3 ? sys_handlers[M] : &&bad_instr; break;
+            default: prog[i].handler = &&bad_instr;
+        }
+        if (prog[i].handler == &&op_cal || prog[i].handler == &&op_jmp || prog[i].handler == &&op_jpc)
+            prog[i].M = M / 3;
+    }
+    // Running off the end of the program is treated like a halt
+    prog[count].handler = &&op_halt;
+
+    size_t stack_cap = 1 << 16;
+    int32_t *stack = arena_fit(pool, &stack_mem, stack_cap * sizeof(int32_t));
+    long sp = -1; // Index of the top of the stack
+    long bp = 0; // Base of the current activation record
+    long max_sp = -1;
+    long limit = stack_limit(code, count);
+    long reach = largest_frame(code, count); // Kept allocated above the stack top
+    long calls = 0; // Calls that have not returned yet
+    unsigned long long executed = 0;
+    int status = 0;
+    const vm_op *ip = prog;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Makes sure n more words fit above the stack top
+#define VM_RESERVE(n) \
+    do { \
+        if ((size_t) (sp + (n) + reach + 1) >= stack_cap) { \
+            while ((size_t) (sp + (n) + reach + 1) >= stack_cap) \
+                stack_cap *= 2; \
+            stack = arena_fit(pool, &stack_mem, stack_cap * sizeof(int32_t)); \
+        } \
+    } while (0)
+    // Finds the base of the activation record L static links up
+#define VM_BASE(L, out) \
+    do { \
+        long b_ = bp; \
+        for (int l_ = (L); l_ > 0; l_--) \
+            b_ = stack[b_]; \
+        (out) = b_; \
+    } while (0)
+#define VM_NEXT() do { executed++; goto *ip->handler; } while (0)
+#define VM_BINARY(expr) \
+    do { \
+        int32_t b = stack[sp--]; \
+        int32_t a = stack[sp]; \
+        stack[sp] = (expr); \
+        ip++; \
+        VM_NEXT(); \
+    } while (0)
+
+    VM_NEXT();
+
+op_lit:
+    VM_RESERVE(1);
+    stack[++sp] = ip->M;
+    ip++;
+    VM_NEXT();
+op_lod: {
+    long base;
+    VM_BASE(ip->L, base);
+    VM_RESERVE(1);
+    sp++;
+    stack[sp] = stack[base + ip->M];
+    ip++;
+    VM_NEXT();
+}
+op_sto: {
+    long base;
+    VM_BASE(ip->L, base);
+    stack[base + ip->M] = stack[sp--];
+    ip++;
+    VM_NEXT();
+}
+op_cal: {
+    if (++calls > VM_CALL_DEPTH)
+        goto overflow;
+    long base;
+    VM_BASE(ip->L, base);
+    VM_RESERVE(3);
+    stack[sp + 1] = (int32_t) base; // static link
+    stack[sp + 2] = (int32_t) bp; // dynamic link
+    stack[sp + 3] = (int32_t) (ip - prog + 1); // return address
+    bp = sp + 1;
+    ip = prog + ip->M;
+    VM_NEXT();
+}
+op_inc:
+    if (sp + ip->M > limit)
+        goto overflow;
+    VM_RESERVE(ip->M);
+    sp += ip->M;
+    if (sp > max_sp)
+        max_sp = sp;
+    ip++;
+    VM_NEXT();
+op_jmp:
+    ip = prog + ip->M;
+    VM_NEXT();
+op_jpc:
+    if (stack[sp--] == 0)
+        ip = prog + ip->M;
+    else
+        ip++;
+    VM_NEXT();
+op_rtn:
+    if (calls-- == 0) // Returning from the main block
+        goto op_halt;
+    sp = bp - 1;
+    ip = prog + stack[bp + 2];
+    bp = stack[bp + 1];
+    VM_NEXT();
+op_add:
+    VM_BINARY((int32_t) ((uint32_t) a + (uint32_t) b));
+op_sub:
+    VM_BINARY((int32_t) ((uint32_t) a - (uint32_t) b));
+op_mul:
+    VM_BINARY((int32_t) ((uint32_t) a * (uint32_t) b));
+op_div:
+    if (stack[sp] == 0) {
+        printf("Runtime error: division by zero\n");
+        status = 1;
+        goto op_halt;
+    }
+    VM_BINARY(b == -1 ? (int32_t) (0u - (uint32_t) a) : a / b);
+op_eql:
+    VM_BINARY(a == b);
+op_neq:
+    VM_BINARY(a != b);
+op_lss:
+    VM_BINARY(a < b);
+op_leq:
+    VM_BINARY(a <= b);
+op_gtr:
+    VM_BINARY(a > b);
+op_geq:
+    VM_BINARY(a >= b);
+op_odd:
+    stack[sp] &= 1;
+    ip++;
+    VM_NEXT();
+op_write:
+    printf("%d\n", stack[sp--]);
+    ip++;
+    VM_NEXT();
+op_read: {
+    int value;
+    if (scanf("%d", &value) != 1) {
+        printf("Runtime error: expected an integer on input\n");
+        status = 1;
+        goto op_halt;
+    }
+    VM_RESERVE(1);
+    stack[++sp] = value;
+    ip++;
+    VM_NEXT();
+}
+bad_instr:
+    printf("Runtime error: invalid instruction %d %d %d at address %d\n",
+           code[ip - prog].OP, ip->L, ip->M, (int) (ip - prog) * 3);
+    status = 1;
+    goto op_halt;
+bad_target:
+    printf("Runtime error: jump to invalid address %d at address %d\n", code[ip - prog].M, (int) (ip - prog) * 3);
+    status = 1;
+    goto op_halt;
+overflow:
+    printf("Runtime error: stack overflow\n");
+    status = 1;
+op_halt:
+#undef VM_RESERVE
+#undef VM_BASE
+#undef VM_NEXT
+#undef VM_BINARY
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->executed = executed;
+    stats->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    stats->max_stack = max_sp + 1;
+    stats->native_bytes = 0;
+    arena_free(&stack_mem);
+    arena_free(&prog_mem);
+    return status;
+}
+
+// Just-in-time compiler
+//
+// Translates the PM/0 code into x86-64 machine code and runs it. The PM/0 stack stays in memory
+// laid out exactly as the VM lays it out, so activation records, static links and dynamic links
+// keep the meaning block() and procedure_declaration() give them; only control flow is native:
+// CAL becomes a call and RTN a ret on a separate native stack. While generated code runs,
+//   rbx holds the PM/0 stack, r12 the stack top index, r13 the base of the current activation
+//   record, r14 the jit_ctx and r15 the native stack pointer to restore on exit.
+// SYS write and read, and runtime errors, call back into small C shims.
+
+#if defined(__x86_64__)
+
+#define JIT_NATIVE_STACK (VM_CALL_DEPTH * 8 + (1L << 16)) // A return address per call, and room for the C shims
+
+typedef struct jit_ctx
+{
+    long limit; // Largest stack top index INC may reach
+    char *native_limit; // Lowest native stack address CAL may go below
+    const assembly *code; // Program being run, for error messages
+} jit_ctx;
+
+typedef struct jit_fixup
+{
+    uint32_t at; // Offset of the rel32 to patch
+    int target; // Instruction index it refers to; -1 to -4 are the shared stubs
+} jit_fixup;
+
+typedef struct jit_buf
+{
+    unsigned char *bytes;
+    size_t size;
+    arena mem;
+    jit_fixup *fixups;
+    int fixup_count;
+    arena fixup_mem;
+    arena_pool *pool; // Backs mem and fixup_mem
+} jit_buf;
+
+enum { JIT_EXIT = -1, JIT_DIV_ZERO = -2, JIT_OVERFLOW = -3, JIT_FAIL = -4 };
+
+static void jit_emit(jit_buf *b, const void *bytes, size_t n) {
+    b->bytes = arena_fit(b->pool, &b->mem, b->size + n);
+    memcpy(b->bytes + b->size, bytes, n);
+    b->size += n;
+}
+
+#define JIT(...) \
+    do { \
+        static const unsigned char bytes_[] = { __VA_ARGS__ }; \
+        jit_emit(b, bytes_, sizeof(bytes_)); \
+    } while (0)
+
+static void jit_u32(jit_buf *b, uint32_t v) {
+    jit_emit(b, &v, 4);
+}
+
+// Emits a rel32 to instruction target (or a stub), patched once every address is known
+static void jit_rel32(jit_buf *b, int target) {
+    b->fixups = arena_fit(b->pool, &b->fixup_mem, (size_t) (b->fixup_count + 1) * sizeof(jit_fixup));
+    b->fixups[b->fixup_count].at = (uint32_t) b->size;
+    b->fixups[b->fixup_count].target = target;
+    b->fixup_count++;
+    jit_u32(b, 0);
+}
+
+// Emits op reg, dword [rbx + index*4 + disp] where index is a 64-bit register number
+static void jit_mem(jit_buf *b, int w, const unsigned char *op, int op_len, int reg, int index, int32_t disp) {
+    unsigned char rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2);
+    if (rex != 0x40)
+        jit_emit(b, &rex, 1);
+    jit_emit(b, op, op_len);
+    unsigned char mod = disp == 0 ? 0x00 : (disp >= -128 && disp <= 127 ? 0x40 : 0x80);
+    unsigned char modrm[2] = { (unsigned char) (mod | ((reg & 7) << 3) | 4), (unsigned char) (0x80 | ((index & 7) << 3) | 3) };
+    jit_emit(b, modrm, 2);
+    if (mod == 0x40) {
+        int8_t d = (int8_t) disp;
+        jit_emit(b, &d, 1);
+    }
+    else if (mod == 0x80)
+        jit_u32(b, (uint32_t) disp);
+}
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RDI 7
+#define R12 12
+#define R13 13
+
+// Loads the base of the activation record L static links up into rdx, or returns r13 when the
+// current record is meant. Returns the register holding it.
+static int jit_base(jit_buf *b, int L) {
+    if (L == 0)
+        return R13;
+    JIT(0x4C, 0x89, 0xEA); // mov rdx, r13
+    for (int l = 0; l < L; l++)
+        JIT(0x48, 0x63, 0x14, 0x93); // movsxd rdx, [rbx + rdx*4]
+    return RDX;
+}
+
+// Calls a C function at fn, aligning the native stack for it; arguments are already in place
+static void jit_call_c(jit_buf *b, void *fn) {
+    JIT(0x48, 0x89, 0xE5); // mov rbp, rsp
+    JIT(0x48, 0x83, 0xE4, 0xF0); // and rsp, -16
+    JIT(0x48, 0xB8); // mov rax, imm64
+    uint64_t addr = (uint64_t) (uintptr_t) fn;
+    jit_emit(b, &addr, 8);
+    JIT(0xFF, 0xD0); // call rax
+    JIT(0x48, 0x89, 0xEC); // mov rsp, rbp
+}
+
+static void jit_write(int32_t value) {
+    printf("%d\n", value);
+}
+
+static int jit_read(int32_t *slot) {
+    int value;
+    if (scanf("%d", &value) != 1) {
+        printf("Runtime error: expected an integer on input\n");
+        return 1;
+    }
+    *slot = value;
+    return 0;
+}
+
+// Reports the runtime error kind (one of the JIT_ stub numbers) raised at instruction index
+static void jit_fail(jit_ctx *ctx, int kind, int index) {
+    const assembly *in = &ctx->code[index];
+    if (kind == JIT_DIV_ZERO)
+        printf("Runtime error: division by zero\n");
+    else if (kind == JIT_OVERFLOW)
+        printf("Runtime error: stack overflow\n");
+    else if (in->OP == 5 || in->OP == 7 || in->OP == 8)
+        printf("Runtime error: jump to invalid address %d at address %d\n", in->M, index * 3);
+    else
+        printf("Runtime error: invalid instruction %d %d %d at address %d\n", in->OP, in->L, in->M, index * 3);
+}
+
+// Emits mov edx, index followed by a jump to a shared error stub
+static void jit_raise(jit_buf *b, int stub, int index) {
+    JIT(0xBA); // mov edx, imm32
+    jit_u32(b, (uint32_t) index);
+    JIT(0xE9); // jmp rel32
+    jit_rel32(b, stub);
+}
+
+// Emits mov edx, index followed by jcc rel32 to a shared error stub
+static void jit_raise_if(jit_buf *b, unsigned char cc, int stub, int index) {
+    unsigned char skip[2] = { (unsigned char) (0x70 | (cc ^ 1)), 10 }; // j!cc over the raise
+    jit_emit(b, skip, 2);
+    jit_raise(b, stub, index);
+}
+
+// Values pushed by LIT and LOD, and results of arithmetic, are not written to the PM/0 stack
+// right away. Up to JIT_PENDING of them are tracked at translation time as constants, variable
+// slots or "in eax", and only spilled to the stack when something needs the real stack: a jump
+// target, a call, a store that could alias, or too many of them. Between spills, expressions
+// compile to plain register arithmetic with memory and immediate operands.
+#define JIT_PENDING 4
+
+enum { JIT_CONST, JIT_VAR, JIT_EAX };
+
+typedef struct jit_value
+{
+    int kind; // JIT_CONST, JIT_VAR or JIT_EAX
+    int L; // Level difference for JIT_VAR
+    int M; // Constant, or offset in the activation record for JIT_VAR
+} jit_value;
+
+typedef struct jit_state
+{
+    jit_value pending[JIT_PENDING]; // Values above the real stack top, oldest first
+    int count;
+    size_t flags_at; // Code size right after the last compare, while its flags are still live
+    unsigned char flags_cc; // Condition code that is true when that compare held
+} jit_state;
+
+// Loads a pending value into reg (eax, ecx or edi)
+static void jit_load(jit_buf *b, const jit_value *v, int reg) {
+    static const unsigned char mov_load[] = { 0x8B };
+    if (v->kind == JIT_CONST) {
+        unsigned char op = (unsigned char) (0xB8 + reg); // mov reg, imm32
+        jit_emit(b, &op, 1);
+        jit_u32(b, (uint32_t) v->M);
+    }
+    else if (v->kind == JIT_VAR)
+        jit_mem(b, 0, mov_load, 1, reg, jit_base(b, v->L), v->M * 4);
+    else if (reg != RAX) {
+        unsigned char mov[2] = { 0x89, (unsigned char) (0xC0 | reg) }; // mov reg, eax
+        jit_emit(b, mov, 2);
+    }
+}
+
+// Writes the oldest pending value onto the real stack
+static void jit_spill_one(jit_buf *b, jit_state *st) {
+    static const unsigned char mov_store[] = { 0x89 };
+    jit_value v = st->pending[0];
+    JIT(0x49, 0xFF, 0xC4); // inc r12
+    if (v.kind == JIT_CONST) {
+        JIT(0x42, 0xC7, 0x04, 0xA3); // mov dword [rbx + r12*4], imm32
+        jit_u32(b, (uint32_t) v.M);
+    }
+    else {
+        int reg = v.kind == JIT_EAX ? RAX : RCX;
+        jit_load(b, &v, reg);
+        jit_mem(b, 0, mov_store, 1, reg, R12, 0);
+    }
+    st->count--;
+    memmove(st->pending, st->pending + 1, (size_t) st->count * sizeof(jit_value));
+}
+
+// Spills pending values until only keep of them remain
+static void jit_spill(jit_buf *b, jit_state *st, int keep) {
+    while (st->count > keep)
+        jit_spill_one(b, st);
+}
+
+static void jit_push(jit_buf *b, jit_state *st, int kind, int L, int M) {
+    if (st->count == JIT_PENDING)
+        jit_spill_one(b, st);
+    st->pending[st->count].kind = kind;
+    st->pending[st->count].L = L;
+    st->pending[st->count].M = M;
+    st->count++;
+}
+
+// Pops the top value into reg, from the pending values or else from the real stack
+static void jit_pop(jit_buf *b, jit_state *st, int reg) {
+    static const unsigned char mov_load[] = { 0x8B };
+    if (st->count > 0)
+        jit_load(b, &st->pending[--st->count], reg);
+    else {
+        jit_mem(b, 0, mov_load, 1, reg, R12, 0);
+        JIT(0x49, 0xFF, 0xCC); // dec r12
+    }
+}
+
+// Translates a binary OPR (ADD through GEQ). The right operand is used as an immediate or a
+// memory operand where possible, otherwise it goes to ecx; the left one always goes to eax,
+// which then holds the result.
+static void jit_binary(jit_buf *b, jit_state *st, int M, int index) {
+    // Opcode bytes for add, sub, imul and cmp with eax as destination: reg/mem form, ecx form,
+    // and immediate form
+    static const unsigned char mem_op[4][2] = { { 0x03 }, { 0x2B }, { 0x0F, 0xAF }, { 0x3B } };
+    static const unsigned char ecx_op[4][3] = { { 0x01, 0xC8 }, { 0x29, 0xC8 }, { 0x0F, 0xAF, 0xC1 }, { 0x39, 0xC8 } };
+    static const unsigned char imm_op[4][2] = { { 0x05 }, { 0x2D }, { 0x69, 0xC0 }, { 0x3D } };
+    static const int op_len[4] = { 1, 1, 2, 1 };
+    // Condition codes (jcc low nibble) that hold after cmp eax, right: eql, neq, lss, leq, gtr, geq
+    static const unsigned char cmp_cc[6] = { 0x4, 0x5, 0xC, 0xE, 0xF, 0xD };
+
+    jit_spill(b, st, 2);
+    int form; // 0 memory (r13-relative variable), 1 ecx, 2 immediate
+    jit_value right = {0};
+    if (st->count > 0 && st->pending[st->count - 1].kind == JIT_CONST) {
+        right = st->pending[--st->count];
+        form = 2;
+    }
+    else if (st->count > 0 && st->pending[st->count - 1].kind == JIT_VAR && st->pending[st->count - 1].L == 0 && M != 4) {
+        right = st->pending[--st->count];
+        form = 0;
+    }
+    else {
+        jit_pop(b, st, RCX);
+        form = 1;
+    }
+    jit_pop(b, st, RAX);
+
+    if (M == 4) {
+        if (form == 2 && right.M == 0)
+            jit_raise(b, JIT_DIV_ZERO, index);
+        else if (form == 2 && right.M == -1)
+            JIT(0xF7, 0xD8); // neg eax
+        else if (form == 2) {
+            jit_load(b, &right, RCX);
+            JIT(0x99, 0xF7, 0xF9); // cdq; idiv ecx
+        }
+        else {
+            JIT(0x85, 0xC9); // test ecx, ecx
+            jit_raise_if(b, 0x4, JIT_DIV_ZERO, index); // je
+            JIT(0x83, 0xF9, 0xFF); // cmp ecx, -1
+            JIT(0x75, 0x04); // jne over the neg
+            JIT(0xF7, 0xD8); // neg eax
+            JIT(0xEB, 0x03); // jmp past the division
+            JIT(0x99, 0xF7, 0xF9); // cdq; idiv ecx
+        }
+    }
+    else {
+        int op = M <= 3 ? M - 1 : 3;
+        if (form == 0)
+            jit_mem(b, 0, mem_op[op], op_len[op], RAX, R13, right.M * 4);
+        else if (form == 1)
+            jit_emit(b, ecx_op[op], op_len[op] + 1);
+        else {
+            jit_emit(b, imm_op[op], op_len[op]);
+            jit_u32(b, (uint32_t) right.M);
+        }
+        if (M >= 5) {
+            unsigned char set[3] = { 0x0F, (unsigned char) (0x90 | cmp_cc[M - 5]), 0xC0 }; // setcc al
+            jit_emit(b, set, 3);
+            JIT(0x0F, 0xB6, 0xC0); // movzx eax, al
+            st->flags_at = b->size;
+            st->flags_cc = cmp_cc[M - 5];
+        }
+    }
+    jit_push(b, st, JIT_EAX, 0, 0);
+}
+
+// Translates one PM/0 instruction
+static void jit_instr(jit_buf *b, jit_state *st, const assembly *in, int index, int count) {
+    static const unsigned char mov_load[] = { 0x8B }, mov_store[] = { 0x89 };
+    int OP = in->OP, L = in->L, M = in->M;
+    int target_ok = valid_target(M, count);
+
+    switch (OP) {
+        case 1: // LIT
+            jit_push(b, st, JIT_CONST, 0, M);
+            return;
+        case 3: // LOD
+            jit_push(b, st, JIT_VAR, L, M);
+            return;
+        case 4: { // STO: anything still pending may read the slot, so it is spilled first
+            jit_spill(b, st, 1);
+            jit_value v;
+            if (st->count > 0)
+                v = st->pending[--st->count];
+            else {
+                jit_mem(b, 0, mov_load, 1, RCX, R12, 0);
+                JIT(0x49, 0xFF, 0xCC); // dec r12
+                v.kind = JIT_EAX + 1; // already in ecx
+            }
+            if (v.kind == JIT_VAR) {
+                jit_load(b, &v, RCX);
+                v.kind = JIT_EAX + 1;
+            }
+            int base = jit_base(b, L);
+            if (v.kind == JIT_CONST) {
+                static const unsigned char mov_imm[] = { 0xC7 };
+                jit_mem(b, 0, mov_imm, 1, 0, base, M * 4);
+                jit_u32(b, (uint32_t) v.M);
+            }
+            else
+                jit_mem(b, 0, mov_store, 1, v.kind == JIT_EAX ? RAX : RCX, base, M * 4);
+            return;
+        }
+        case 8: // JPC: a compare right before it becomes a conditional jump
+            if (!target_ok)
+                break;
+            jit_spill(b, st, 1);
+            if (st->count > 0 && st->pending[0].kind == JIT_EAX && st->flags_at == b->size) {
+                st->count--;
+                unsigned char jcc[2] = { 0x0F, (unsigned char) (0x80 | (st->flags_cc ^ 1)) };
+                jit_emit(b, jcc, 2);
+            }
+            else {
+                jit_pop(b, st, RAX);
+                JIT(0x85, 0xC0); // test eax, eax
+                JIT(0x0F, 0x84); // jz
+            }
+            jit_rel32(b, M / 3);
+            return;
+        case 2:
+            if (M >= 1 && M <= 10) {
+                jit_binary(b, st, M, index);
+                return;
+            }
+            if (M == 11) { // ODD: and eax, 1
+                jit_pop(b, st, RAX);
+                JIT(0x83, 0xE0, 0x01);
+                st->flags_at = b->size;
+                st->flags_cc = 0x5;
+                jit_push(b, st, JIT_EAX, 0, 0);
+                return;
+            }
+            break;
+        case 9:
+            if (M == 1) { // WRITE: pop into edi and call jit_write
+                jit_spill(b, st, 1);
+                jit_pop(b, st, RDI);
+                jit_call_c(b, (void *) jit_write);
+                return;
+            }
+            break;
     }
-    if (global_tkn_list.token == 27) {
-        update_tokens(get_next_token());
-        if (global_tkn_list.token != 2)
-            error(16); 
-        global_sym_table.symIdx = symbol_table_check();
-        if (global_sym_table.symIdx == -1)
-            error(7);
-        if (global_sym_table.table[global_sym_table.symIdx].kind != 3)
-            error(17); 
-        emit(5, global_sym_table.current_level-global_sym_table.table[global_sym_table.symIdx].level, global_sym_table.table[global_sym_table.symIdx].addr);
-        update_tokens(get_next_token());
-        return;
 
+    // Everything else works on the real stack
+    jit_spill(b, st, 0);
+    switch (OP) {
+        case 5: { // CAL
+            if (!target_ok)
+                break;
+            JIT(0x49, 0x3B, 0x66, (unsigned char) offsetof(jit_ctx, native_limit)); // cmp rsp, [r14 + native_limit]
+            jit_raise_if(b, 0x2, JIT_OVERFLOW, index); // jb
+            int base = jit_base(b, L);
+            jit_mem(b, 0, mov_store, 1, base, R12, 4); // static link
+            jit_mem(b, 0, mov_store, 1, R13, R12, 8); // dynamic link
+            JIT(0x42, 0xC7, 0x44, 0xA3, 0x0C); // mov dword [rbx + r12*4 + 12], return index
+            jit_u32(b, (uint32_t) (index + 1));
+            JIT(0x4D, 0x8D, 0x6C, 0x24, 0x01); // lea r13, [r12 + 1]
+            JIT(0xE8); // call
+            jit_rel32(b, M / 3);
+            return;
+        }
+        case 6: // INC: add r12, M; cmp r12, [r14 + limit]; jg overflow
+            JIT(0x49, 0x81, 0xC4);
+            jit_u32(b, (uint32_t) M);
+            JIT(0x4D, 0x3B, 0x66, (unsigned char) offsetof(jit_ctx, limit));
+            jit_raise_if(b, 0xF, JIT_OVERFLOW, index);
+            return;
+        case 7: // JMP
+            if (!target_ok)
+                break;
+            JIT(0xE9);
+            jit_rel32(b, M / 3);
+            return;
+        case 2:
+            if (M == 0) { // RTN: lea r12, [r13 - 1]; movsxd r13, [rbx + r13*4 + 4]; ret
+                JIT(0x4D, 0x8D, 0x65, 0xFF);
+                JIT(0x4E, 0x63, 0x6C, 0xAB, 0x04);
+                JIT(0xC3);
+                return;
+            }
+            break;
+        case 9:
+            if (M == 2) { // READ: inc r12; lea rdi, [rbx + r12*4]; call jit_read; stop if it failed
+                JIT(0x49, 0xFF, 0xC4);
+                JIT(0x4A, 0x8D, 0x3C, 0xA3);
+                jit_call_c(b, (void *) jit_read);
+                JIT(0x85, 0xC0);
+                JIT(0x0F, 0x85);
+                jit_rel32(b, JIT_EXIT);
+                return;
+            }
+            if (M == 3) { // HALT
+                JIT(0x31, 0xC0); // xor eax, eax
+                JIT(0xE9);
+                jit_rel32(b, JIT_EXIT);
+                return;
+            }
+            break;
     }
-    if (global_tkn_list.token == 21) {
-        do {
-            update_tokens(get_next_token());
-            statement();
-        } while (global_tkn_list.token == 18);
-        if (global_tkn_list.token != 22)
-            error(10);
-        update_tokens(get_next_token());
-        return;
-    }
-    if (global_tkn_list.token == 23) {
-        update_tokens(get_next_token());
-        condition();
-        int jpcIdx = global_code.cx;
-        emit(8, 0, jpcIdx);
-        if (global_tkn_list.token != 24)
-            error(11);
-        update_tokens(get_next_token());
-        statement();
-        global_code.code[jpcIdx].M = 3 * (global_code.cx - 1);
-        return;
+    // Anything left is malformed; it only fails if it is actually reached, like in the VM
+    jit_raise(b, JIT_FAIL, index);
+}
+
+// Runs the count instructions in code as native code and fills in stats. Returns 0 when the
+// program halts, 1 after reporting a runtime error, or -1 if the code could not be set up (the
+// caller then falls back to the VM).
+int run_jit(arena_pool *pool, const assembly *code, int count, vm_stats *stats) {
+    jit_buf buf = {0};
+    buf.pool = pool;
+    jit_buf *b = &buf;
+    arena offset_mem = {0};
+    uint32_t *offsets = arena_fit(pool, &offset_mem, (size_t) (count + 1) * sizeof(uint32_t));
+    uint32_t stubs[4];
+
+    // Entry: save callee-saved registers, switch to the native stack and call the program
+    JIT(0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, rbp, r12-r15
+    JIT(0x49, 0x89, 0xE7); // mov r15, rsp
+    JIT(0x48, 0x89, 0xFB); // mov rbx, rdi
+    JIT(0x49, 0x89, 0xF6); // mov r14, rsi
+    JIT(0x48, 0x89, 0xD4); // mov rsp, rdx
+    JIT(0x49, 0xC7, 0xC4, 0xFF, 0xFF, 0xFF, 0xFF); // mov r12, -1
+    JIT(0x45, 0x31, 0xED); // xor r13d, r13d
+    JIT(0xE8); // call the first instruction
+    jit_rel32(b, 0);
+    JIT(0x31, 0xC0); // a return from the main block ends the program: xor eax, eax
+
+    // Exit: eax holds the status
+    stubs[-1 - JIT_EXIT] = (uint32_t) b->size;
+    JIT(0x4C, 0x89, 0xFC); // mov rsp, r15
+    JIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3); // pop r15-r12, rbp, rbx; ret
+
+    // Error stubs: call jit_fail(ctx, kind, edx) and exit with status 1
+    for (int kind = JIT_DIV_ZERO; kind >= JIT_FAIL; kind--) {
+        stubs[-1 - kind] = (uint32_t) b->size;
+        JIT(0x4C, 0x89, 0xF7); // mov rdi, r14
+        JIT(0xBE); // mov esi, kind
+        jit_u32(b, (uint32_t) kind);
+        jit_call_c(b, (void *) jit_fail);
+        JIT(0xB8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+        JIT(0xE9);
+        jit_rel32(b, JIT_EXIT);
     }
-    if (global_tkn_list.token == 25) {
-        update_tokens(get_next_token());
-        int loopIdx = 3 * global_code.cx;
-        condition();
-        if (global_tkn_list.token != 26)
-            error(12);
-        update_tokens(get_next_token());
-        int jpcIdx = global_code.cx;
-        emit(8, 0, jpcIdx);
-        statement();
-        emit(7, 0, loopIdx);
-        global_code.code[jpcIdx].M = 3 * (global_code.cx - 1);
-        return;
+
+    // Jump and call targets are where pending values must already be on the stack
+    arena target_mem = {0};
+    char *is_target = arena_fit(pool, &target_mem, (size_t) count + 1);
+    for (int i = 0; i < count; i++)
+        if ((code[i].OP == 5 || code[i].OP == 7 || code[i].OP == 8) && valid_target(code[i].M, count))
+            is_target[code[i].M / 3] = 1;
+
+    jit_state st = {0};
+    st.flags_at = (size_t) -1;
+    for (int i = 0; i < count; i++) {
+        if (is_target[i]) {
+            jit_spill(b, &st, 0);
+            st.flags_at = (size_t) -1;
+        }
+        offsets[i] = (uint32_t) b->size;
+        jit_instr(b, &st, &code[i], i, count);
     }
-    if (global_tkn_list.token == 32) {
-        update_tokens(get_next_token());
-        if (global_tkn_list.token != 2)
-            error(2);
-        global_sym_table.symIdx = symbol_table_check();
-        if (global_sym_table.symIdx == -1)
-            error(7);
-        if (global_sym_table.table[global_sym_table.symIdx].kind != 2)
-            error(8);
-        update_tokens(get_next_token());
-        emit(9, 0, 2); 
-        emit(4, global_sym_table.current_level, global_sym_table.table[global_sym_table.symIdx].addr);
-        return;
+    // Running off the end of the program is treated like a halt
+    jit_spill(b, &st, 0);
+    offsets[count] = (uint32_t) b->size;
+    JIT(0x31, 0xC0);
+    JIT(0xE9);
+    jit_rel32(b, JIT_EXIT);
+
+    for (int i = 0; i < b->fixup_count; i++) {
+        jit_fixup *f = &b->fixups[i];
+        uint32_t to = f->target >= 0 ? offsets[f->target] : stubs[-1 - f->target];
+        int32_t rel = (int32_t) (to - (f->at + 4));
+        memcpy(b->bytes + f->at, &rel, 4);
     }
-    if (global_tkn_list.token == 31) {
-        update_tokens(get_next_token());
-        expression();
-        emit(9, 0, 1);
-        return;
+
+    // Map the code writable, copy it in, then make it executable. The PM/0 stack and the native
+    // stack are reserved up front and only touched pages are ever backed; a guard page sits past
+    // the PM/0 stack for expression temporaries, which INC's limit leaves room for.
+    size_t code_size = b->size;
+    size_t stack_bytes = (size_t) VM_STACK_WORDS * sizeof(int32_t);
+    long page = sysconf(_SC_PAGESIZE);
+    void *text = mmap(NULL, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *stack = mmap(NULL, stack_bytes + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    char *native = mmap(NULL, JIT_NATIVE_STACK, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int status = -1;
+    if (text != MAP_FAILED && stack != MAP_FAILED && native != MAP_FAILED
+        && mprotect(stack + stack_bytes, page, PROT_NONE) == 0) {
+        memcpy(text, b->bytes, code_size);
+        if (mprotect(text, code_size, PROT_READ | PROT_EXEC) == 0) {
+            jit_ctx ctx;
+            ctx.limit = stack_limit(code, count);
+            ctx.native_limit = native + (1 << 16); // room left for printf and scanf
+            ctx.code = code;
+            int (*entry)(int32_t *, jit_ctx *, char *) = (int (*)(int32_t *, jit_ctx *, char *)) text;
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            status = entry((int32_t *) stack, &ctx, native + JIT_NATIVE_STACK);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            stats->executed = 0;
+            stats->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+            stats->max_stack = 0;
+            stats->native_bytes = code_size;
+        }
     }
+    if (text != MAP_FAILED)
+        munmap(text, code_size);
+    if (stack != MAP_FAILED)
+        munmap(stack, stack_bytes + page);
+    if (native != MAP_FAILED)
+        munmap(native, JIT_NATIVE_STACK);
+    arena_free(&buf.mem);
+    arena_free(&buf.fixup_mem);
+    arena_free(&offset_mem);
+    arena_free(&target_mem);
+    return status;
 }
 
-void condition(){
-    // if (token == oddsym){ 
-    //     get next token
-    //     expression();
-    //     emit ODD
-    // }
-    // else {
-    //     EXPRESSION
-    //     if (token == eqlsym) {
-    //         get next token
-    //         expression();
-    //         emit EQL
-    //     }
-    //     else if (token == neqsym) {
-    //         get next token
-    //         expression();
-    //         emit NEQ
-    //     }
-    //     else if (token == lessym) {
-    //         get next token
-    //         expression();
-    //         emit LSS
-    //     }
-    //     else if (token == leqsym) {
-    //         get next token
-    //         expression();
-    //         emit LEQ
-    //     }
-    //     else if (token == gtrsym) {
-    //         get next token
-    //         expression();
-    //         emit GTR
-    //     }
-    //     else if (token == geqsym) {
-    //         get next token
-    //         expression();
-    //         emit GEQ
-    //     }
-    //     else
-    //         error
-    // 
-    // }
+#undef JIT
+#undef RAX
+#undef RCX
+#undef RDX
+#undef RDI
+#undef R12
+#undef R13
+
+#else
+
+// Other architectures have no JIT; the caller runs the VM instead
+int run_jit(arena_pool *pool, const assembly *code, int count, vm_stats *stats) {
+    (void) code;
+    (void) count;
+    (void) stats;
+    return -1;
+}
+
+#endif
+
+// Register IR
+//
+// lower_ir() turns the PM/0 stack code into three-address code. Within a basic block the operand
+// stack is simulated at translation time: LIT becomes an immediate operand, LOD of a variable in
+// the current activation record becomes a direct frame operand, LOD from an outer level becomes
+// a load into a fresh virtual register (reused while the variable is known to be unchanged), and
+// OPR an instruction reading two operands and writing one. A STO of a freshly computed value
+// retargets the instruction that computed it, and a compare or odd followed by JPC becomes a
+// single conditional branch. Variables stay in activation records on the same memory stack the VM
+// uses, with the same static link, dynamic link and return address words, so procedures, levels
+// and recursion behave exactly as before.
+//
+// Virtual registers then go through linear-scan allocation onto IR_REGISTERS physical registers,
+// spilling the interval that ends last when they run out. Register, spill slot and constant
+// operands all end up as indexes into one value file laid out as [registers | spill slots |
+// constants], and frame operands as offsets from the current activation record, so run_ir()
+// fetches any operand with one indexed load. Temporaries never live across a CAL (the stack code
+// has an empty operand stack there), which is why one register file serves all activations.
+//
+// Lowering needs the operand stack to be empty at block boundaries, calls and INC, which holds
+// for everything block() and statement() generate; for other code lower_ir() reports failure and
+// the caller uses the VM.
 
-    if (global_tkn_list.token == 1){ 
-        update_tokens(get_next_token());
-        expression();
-        emit(2, 0, 11);
+#define IR_FRAME (1 << 30) // Operands from here on are frame slots while lowering
+
+// Returns 1 if a lowering-time operand is a virtual register
+static int ir_is_vreg(int x) {
+    return x >= 0 && x < IR_FRAME;
+}
+
+// Returns a new constant operand (encoded as -1 - pool index until allocation)
+static int ir_const(ir_program *ir, int32_t value) {
+    ir->vals = arena_fit(ir->pool, &ir->vals_mem, (size_t) (ir->const_count + 1) * sizeof(int32_t));
+    ir->vals[ir->const_count] = value;
+    return -1 - ir->const_count++;
+}
+
+static void ir_emit(ir_program *ir, int op, int d, int a, int b, int L, int M) {
+    ir->code = arena_fit(ir->pool, &ir->code_mem, (size_t) (ir->count + 1) * sizeof(ir_instr));
+    ir_instr *in = &ir->code[ir->count++];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    in->d = d;
+    in->a = a;
+    in->b = b;
+    in->L = L;
+    in->M = M;
+}
+
+// Fills in which operands an instruction reads (at most two) and whether it writes d
+static int ir_uses(const ir_instr *in, int *uses, int *defines) {
+    *defines = in->op == IR_LOAD || in->op == IR_READ || (in->op >= IR_ADD && in->op <= IR_ODD);
+    switch (in->op) {
+        case IR_STORE: case IR_WRITE: case IR_BRZ: case IR_BEVEN: case IR_ODD:
+            uses[0] = in->a;
+            return 1;
+        default:
+            if ((in->op >= IR_ADD && in->op <= IR_GEQ) || (in->op >= IR_BEQ && in->op <= IR_BGE)) {
+                uses[0] = in->a;
+                uses[1] = in->b;
+                return 2;
+            }
+            return 0;
+    }
+}
+
+// Turns a lowering-time operand into its final index and kind
+static void ir_place(int *x, unsigned char *kind, const int *alloc, int const_base) {
+    if (*x >= IR_FRAME) {
+        *kind = 1;
+        *x -= IR_FRAME;
     }
     else {
-        expression();
-        if (global_tkn_list.token == 9) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 5);
-        }
-        else if (global_tkn_list.token == 10) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 6);
-        }
-        else if (global_tkn_list.token == 11) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 7);
-        }
-        else if (global_tkn_list.token == 12) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 8);
-        }
-        else if (global_tkn_list.token == 13) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 9);
-        }
-        else if (global_tkn_list.token == 14) {
-            update_tokens(get_next_token());
-            expression();
-            emit(2, 0, 10);
-        }
-        else
-            error(13);
-    
+        *kind = 0;
+        *x = *x >= 0 ? alloc[*x] : const_base - 1 - *x;
     }
 }
 
-void expression(){
-    // if (token == minussym) {
-    //     get next token
-    //     term();
-    //     emit NEG
-    //     while (token == plussym || token == minussym) {
-    //         if (token == plussym) {
-    //             get next token
-    //             term();
-    //             emit ADD
-    //         }
-    //         else {
-    //             get next token
-    //             term();
-    //             emit SUB
-    //         }
-    //     }
-    // }
-    // else {
-    //     if (token == plussym)
-    //         get next token
-    //     term();
-    //     while (token == plussym || token == minussym)
-    //     {
-    //         if (token == plussym) {
-    //             get next token
-    //             term();
-    //             emit ADD
-    //         }
-    //         else {
-    //             get next token
-    //             term();
-    //             emit SUB
-    //         }
-    //     }
-    // }
-    
-    if (global_tkn_list.token == 5) {
-        update_tokens(get_next_token());
-        term();
-        while (global_tkn_list.token == 4 || global_tkn_list.token == 5) {
-            if (global_tkn_list.token == 4) {
-                update_tokens(get_next_token());
-                term();
-                emit(2, 0, 1);
+int lower_ir(arena_pool *pool, const assembly *code, int count, ir_program *ir) {
+    memset(ir, 0, sizeof(*ir));
+    ir->pool = pool;
+    ir->pm_count = count;
+    arena leader_mem = {0}, stack_mem = {0}, cache_mem = {0};
+    char *leader = arena_fit(pool, &leader_mem, (size_t) count + 1);
+    ir->start = arena_fit(pool, &ir->start_mem, (size_t) (count + 1) * sizeof(int));
+    for (int i = 0; i <= count; i++)
+        ir->start[i] = -1;
+
+    // Block leaders: the entry, jump and call targets, and whatever follows a transfer of control
+    leader[0] = 1;
+    for (int i = 0; i < count; i++) {
+        int OP = code[i].OP, M = code[i].M;
+        if ((OP == 5 || OP == 7 || OP == 8) && valid_target(M, count))
+            leader[M / 3] = 1;
+        if (OP == 5 || OP == 7 || OP == 8 || (OP == 2 && M == 0) || (OP == 9 && M == 3))
+            leader[i + 1] = 1;
+    }
+
+    // The simulated operand stack, and a cache of outer-level variables whose value a register
+    // already holds
+    int *stack = NULL;
+    int depth = 0;
+    typedef struct { int L, M, operand; } cached;
+    cached *cache = NULL;
+    int cache_size = 0;
+    int vregs = 0;
+
+#define IR_PUSH(x) \
+    do { \
+        stack = arena_fit(pool, &stack_mem, (size_t) (depth + 1) * sizeof(int)); \
+        stack[depth++] = (x); \
+    } while (0)
+#define IR_POP(x) \
+    do { \
+        if (depth == 0) \
+            goto fail; \
+        (x) = stack[--depth]; \
+    } while (0)
+
+    for (int i = 0; i < count; i++) {
+        int OP = code[i].OP, L = code[i].L, M = code[i].M;
+        if (leader[i]) {
+            if (depth != 0)
+                goto fail;
+            cache_size = 0;
+            ir->start[i] = ir->count;
+        }
+        switch (OP) {
+            case 1: // LIT
+                IR_PUSH(ir_const(ir, M));
+                continue;
+            case 3: { // LOD
+                if (L == 0 && M >= 0 && M < IR_FRAME) {
+                    IR_PUSH(IR_FRAME + M);
+                    continue;
+                }
+                int c;
+                for (c = 0; c < cache_size; c++)
+                    if (cache[c].L == L && cache[c].M == M)
+                        break;
+                if (c < cache_size) {
+                    IR_PUSH(cache[c].operand);
+                    continue;
+                }
+                ir_emit(ir, IR_LOAD, vregs, 0, 0, L, M);
+                cache = arena_fit(pool, &cache_mem, (size_t) (cache_size + 1) * sizeof(cached));
+                cache[cache_size].L = L;
+                cache[cache_size].M = M;
+                cache[cache_size++].operand = vregs;
+                IR_PUSH(vregs++);
+                continue;
             }
-            else {
-                update_tokens(get_next_token());
-                term();
-                emit(2, 0, 2);
+            case 4: { // STO
+                int x;
+                IR_POP(x);
+                if (M < 3) // Writing a link word can change what every other level refers to
+                    cache_size = 0;
+                if (L == 0 && M >= 0 && M < IR_FRAME) {
+                    // Values still on the stack that read this slot must be taken first
+                    int aliased = 0;
+                    for (int k = 0; k < depth; k++)
+                        if (stack[k] == IR_FRAME + M) {
+                            ir_emit(ir, IR_LOAD, vregs, 0, 0, 0, M);
+                            stack[k] = vregs++;
+                            aliased = 1;
+                        }
+                    int shared = 0;
+                    for (int k = 0; k < depth; k++)
+                        shared |= stack[k] == x;
+                    for (int c = 0; c < cache_size; c++)
+                        shared |= cache[c].operand == x;
+                    ir_instr *last = ir->count > 0 ? &ir->code[ir->count - 1] : NULL;
+                    if (!aliased && !shared && ir_is_vreg(x) && last != NULL && last->d == x
+                        && (last->op == IR_LOAD || last->op == IR_READ || (last->op >= IR_ADD && last->op <= IR_ODD)))
+                        last->d = IR_FRAME + M;
+                    else
+                        ir_emit(ir, IR_STORE, 0, x, 0, 0, M);
+                    continue;
+                }
+                // Later loads of an outer variable reuse the stored operand
+                ir_emit(ir, IR_STORE, 0, x, 0, L, M);
+                int c;
+                for (c = 0; c < cache_size; c++)
+                    if (cache[c].L == L && cache[c].M == M)
+                        break;
+                if (c == cache_size) {
+                    cache = arena_fit(pool, &cache_mem, (size_t) (cache_size + 1) * sizeof(cached));
+                    cache[cache_size].L = L;
+                    cache[cache_size++].M = M;
+                }
+                cache[c].operand = x;
+                continue;
+            }
+            case 2:
+                if (M == 0) {
+                    if (depth != 0)
+                        goto fail;
+                    ir_emit(ir, IR_RET, 0, 0, 0, 0, 0);
+                    continue;
+                }
+                if (M >= 1 && M <= 10) {
+                    int a, b;
+                    IR_POP(b);
+                    IR_POP(a);
+                    ir_emit(ir, IR_ADD + M - 1, vregs, a, b, 0, 0);
+                    IR_PUSH(vregs++);
+                    continue;
+                }
+                if (M == 11) {
+                    int a;
+                    IR_POP(a);
+                    ir_emit(ir, IR_ODD, vregs, a, 0, 0, 0);
+                    IR_PUSH(vregs++);
+                    continue;
+                }
+                break;
+            case 5: // CAL: the callee may change any variable
+                if (!valid_target(M, count))
+                    break;
+                if (depth != 0)
+                    goto fail;
+                cache_size = 0;
+                ir_emit(ir, IR_CALL, i + 1, 0, 0, L, M / 3);
+                continue;
+            case 6: // INC
+                if (depth != 0)
+                    goto fail;
+                ir_emit(ir, IR_ENTER, 0, 0, 0, 0, M);
+                continue;
+            case 7: // JMP
+                if (!valid_target(M, count))
+                    break;
+                if (depth != 0)
+                    goto fail;
+                ir_emit(ir, IR_JMP, 0, 0, 0, 0, M / 3);
+                continue;
+            case 8: { // JPC: branch when the condition is 0
+                if (!valid_target(M, count))
+                    break;
+                int x;
+                IR_POP(x);
+                if (depth != 0)
+                    goto fail;
+                ir_instr *last = ir->count > 0 ? &ir->code[ir->count - 1] : NULL;
+                if (last != NULL && last->d == x && ir_is_vreg(x) && last->op >= IR_EQL && last->op <= IR_ODD) {
+                    // Branch on the opposite test: eql -> bne, neq -> beq, lss -> bge, ...
+                    static const int opposite[7] = { IR_BNE, IR_BEQ, IR_BGE, IR_BGT, IR_BLE, IR_BLT, IR_BEVEN };
+                    last->op = opposite[last->op - IR_EQL];
+                    last->M = M / 3;
+                }
+                else if (x < 0 && ir->vals[-1 - x] != 0)
+                    continue;
+                else if (x < 0)
+                    ir_emit(ir, IR_JMP, 0, 0, 0, 0, M / 3);
+                else
+                    ir_emit(ir, IR_BRZ, 0, x, 0, 0, M / 3);
+                continue;
             }
+            case 9:
+                if (M == 1) {
+                    int x;
+                    IR_POP(x);
+                    ir_emit(ir, IR_WRITE, 0, x, 0, 0, 0);
+                    continue;
+                }
+                if (M == 2) {
+                    ir_emit(ir, IR_READ, vregs, 0, 0, 0, 0);
+                    IR_PUSH(vregs++);
+                    continue;
+                }
+                if (M == 3) {
+                    ir_emit(ir, IR_HALT, 0, 0, 0, 0, 0);
+                    continue;
+                }
+                break;
         }
+        // Malformed instruction: fails when reached, like in the VM
+        if (depth != 0)
+            goto fail;
+        ir_emit(ir, IR_FAIL, 0, 0, 0, 0, i);
     }
-    else {
-        if (global_tkn_list.token == 4)
-            update_tokens(get_next_token());
-        term();
-        while (global_tkn_list.token == 4 || global_tkn_list.token == 5)
-        {
-            if (global_tkn_list.token == 4) {
-                update_tokens(get_next_token());
-                term();
-                emit(2, 0, 1);
-            }
+    if (depth != 0)
+        goto fail;
+    // Running off the end of the program is treated like a halt
+    ir->start[count] = ir->count;
+    ir_emit(ir, IR_HALT, 0, 0, 0, 0, 0);
+#undef IR_PUSH
+#undef IR_POP
+    arena_free(&leader_mem);
+    arena_free(&stack_mem);
+    arena_free(&cache_mem);
+
+    // Jump and call targets are PM/0 indexes so far
+    for (int k = 0; k < ir->count; k++) {
+        ir_instr *in = &ir->code[k];
+        if (in->op == IR_JMP || in->op == IR_CALL || (in->op >= IR_BEQ && in->op <= IR_BEVEN))
+            in->M = ir->start[in->M];
+    }
+
+    // Linear scan. Intervals start at their definition and end at their last use; virtual
+    // registers are numbered in definition order, so they already come sorted by start. A
+    // result that went straight to a frame slot or into a branch has no interval.
+    arena def_mem = {0}, end_mem = {0}, alloc_mem = {0}, active_mem = {0}, free_slot_mem = {0};
+    int *def = arena_fit(pool, &def_mem, (size_t) (vregs + 1) * sizeof(int));
+    int *end = arena_fit(pool, &end_mem, (size_t) (vregs + 1) * sizeof(int));
+    int *alloc = arena_fit(pool, &alloc_mem, (size_t) (vregs + 1) * sizeof(int));
+    int *active = arena_fit(pool, &active_mem, (size_t) (vregs + 1) * sizeof(int)); // sorted by end
+    int active_count = 0;
+    for (int v = 0; v < vregs; v++)
+        def[v] = -1;
+    for (int k = 0; k < ir->count; k++) {
+        int uses[2], defines;
+        int n = ir_uses(&ir->code[k], uses, &defines);
+        if (defines && ir_is_vreg(ir->code[k].d))
+            def[ir->code[k].d] = end[ir->code[k].d] = k;
+        for (int u = 0; u < n; u++)
+            if (ir_is_vreg(uses[u]))
+                end[uses[u]] = k;
+    }
+    int free_regs[IR_REGISTERS], free_count = IR_REGISTERS;
+    for (int r = 0; r < IR_REGISTERS; r++)
+        free_regs[r] = IR_REGISTERS - 1 - r;
+    int *free_slots = NULL, free_slot_count = 0;
+    for (int v = 0; v < vregs; v++) {
+        if (def[v] < 0)
+            continue;
+        // Expire intervals that end by the time v is defined. An operand and the result of the
+        // same instruction may share a location, since operands are read first.
+        int kept = 0;
+        for (int a = 0; a < active_count; a++) {
+            int w = active[a];
+            if (end[w] > def[v])
+                active[kept++] = w;
+            else if (alloc[w] < IR_REGISTERS)
+                free_regs[free_count++] = alloc[w];
             else {
-                update_tokens(get_next_token());
-                term();
-                emit(2, 0, 2);
+                free_slots = arena_fit(pool, &free_slot_mem, (size_t) (free_slot_count + 1) * sizeof(int));
+                free_slots[free_slot_count++] = alloc[w];
+            }
+        }
+        active_count = kept;
+
+        if (free_count > 0)
+            alloc[v] = free_regs[--free_count];
+        else {
+            // Out of registers: whichever of v and the register-holding intervals ends last
+            // lives in a spill slot for its whole life
+            int slot = free_slot_count > 0 ? free_slots[--free_slot_count] : IR_REGISTERS + ir->spill_slots++;
+            int victim = active_count - 1;
+            while (victim >= 0 && alloc[active[victim]] >= IR_REGISTERS)
+                victim--;
+            if (victim >= 0 && end[active[victim]] > end[v]) {
+                alloc[v] = alloc[active[victim]];
+                alloc[active[victim]] = slot;
             }
+            else
+                alloc[v] = slot;
+        }
+        int a = active_count++;
+        while (a > 0 && end[active[a - 1]] > end[v]) {
+            active[a] = active[a - 1];
+            a--;
         }
+        active[a] = v;
+    }
+
+    // Rewrite operands as value file indexes or frame offsets, and move the constants behind the
+    // spill slots
+    int const_base = IR_REGISTERS + ir->spill_slots;
+    ir->value_count = const_base + ir->const_count;
+    ir->vals = arena_fit(ir->pool, &ir->vals_mem, (size_t) (ir->value_count + 1) * sizeof(int32_t));
+    memmove(ir->vals + const_base, ir->vals, (size_t) ir->const_count * sizeof(int32_t));
+    memset(ir->vals, 0, (size_t) const_base * sizeof(int32_t));
+    for (int k = 0; k < ir->count; k++) {
+        ir_instr *in = &ir->code[k];
+        int uses[2], defines;
+        int n = ir_uses(in, uses, &defines);
+        if (defines)
+            ir_place(&in->d, &in->dk, alloc, const_base);
+        if (n > 0)
+            ir_place(&in->a, &in->ak, alloc, const_base);
+        if (n > 1)
+            ir_place(&in->b, &in->bk, alloc, const_base);
     }
+    ir->vreg_count = vregs;
+
+    arena_free(&def_mem);
+    arena_free(&end_mem);
+    arena_free(&alloc_mem);
+    arena_free(&active_mem);
+    arena_free(&free_slot_mem);
+    return 0;
+
+fail:
+    arena_free(&leader_mem);
+    arena_free(&stack_mem);
+    arena_free(&cache_mem);
+    free_ir(ir);
+    return -1;
 }
 
-void term(){
-    // factor();
-    // while (token == multsym || token == slashsym || token == modsym) {
-    //     if (token == multsym) {
-    //         get next token
-    //         factor();
-    //         emit MUL
-    //     }
-    //     else if (token == slashsym) {
-    //         get next token
-    //         factor();
-    //         emit DIV
-    //     }
-    //     else {
-    //         get next token
-    //         factor();
-    //         emit MOD
-    //     }
-    // }        
-    factor();
-    while (global_tkn_list.token == 6 || global_tkn_list.token == 7) {
-        if (global_tkn_list.token == 6) {
-            update_tokens(get_next_token());
-            factor();
-            emit(2, 0, 3);
-        }
-        else if (global_tkn_list.token == 7) {
-            update_tokens(get_next_token());
-            factor();
-            emit(2, 0, 4);
+void free_ir(ir_program *ir) {
+    arena_free(&ir->code_mem);
+    arena_free(&ir->start_mem);
+    arena_free(&ir->vals_mem);
+}
+
+// Prints one operand: register rN, spill slot sN, slot fN of the current activation record, or a
+// constant
+static void ir_print_operand(const ir_program *ir, int x, int kind) {
+    if (kind == 1)
+        printf("f%d", x);
+    else if (x < IR_REGISTERS)
+        printf("r%d", x);
+    else if (x < IR_REGISTERS + ir->spill_slots)
+        printf("s%d", x - IR_REGISTERS);
+    else
+        printf("%d", ir->vals[x]);
+}
+
+void dump_ir(const ir_program *ir) {
+    static const char *binary[] = { "+", "-", "*", "/", "=", "<>", "<", "<=", ">", ">=" };
+    static const char *branch[] = { "=", "<>", "<", "<=", ">", ">=" };
+    printf("\nRegister IR: %d instructions, %d virtual registers on %d registers and %d spill slots\n",
+           ir->count, ir->vreg_count, IR_REGISTERS, ir->spill_slots);
+    for (int k = 0; k < ir->count; k++) {
+        const ir_instr *in = &ir->code[k];
+        printf("%d\t", k);
+        if (in->op == IR_LOAD || in->op == IR_READ || (in->op >= IR_ADD && in->op <= IR_ODD)) {
+            ir_print_operand(ir, in->d, in->dk);
+            printf(" = ");
         }
-        else {
-            update_tokens(get_next_token());
-            factor();
-            emit(2, 0, 7);
+        switch (in->op) {
+            case IR_LOAD:
+                printf("load %d %d\n", in->L, in->M);
+                break;
+            case IR_STORE:
+                printf("store %d %d, ", in->L, in->M);
+                ir_print_operand(ir, in->a, in->ak);
+                printf("\n");
+                break;
+            case IR_ODD:
+                printf("odd ");
+                ir_print_operand(ir, in->a, in->ak);
+                printf("\n");
+                break;
+            case IR_READ:
+                printf("read\n");
+                break;
+            case IR_WRITE:
+                printf("write ");
+                ir_print_operand(ir, in->a, in->ak);
+                printf("\n");
+                break;
+            case IR_BRZ:
+            case IR_BEVEN:
+                printf("if ");
+                ir_print_operand(ir, in->a, in->ak);
+                printf(in->op == IR_BRZ ? " = 0 goto %d\n" : " even goto %d\n", in->M);
+                break;
+            case IR_JMP:
+                printf("goto %d\n", in->M);
+                break;
+            case IR_CALL:
+                printf("call %d %d\n", in->L, in->M);
+                break;
+            case IR_RET:
+                printf("ret\n");
+                break;
+            case IR_ENTER:
+                printf("enter %d\n", in->M);
+                break;
+            case IR_HALT:
+                printf("halt\n");
+                break;
+            case IR_FAIL:
+                printf("fail %d\n", in->M * 3);
+                break;
+            default:
+                ir_print_operand(ir, in->a, in->ak);
+                if (in->op >= IR_BEQ) {
+                    printf(" %s ", branch[in->op - IR_BEQ]);
+                    ir_print_operand(ir, in->b, in->bk);
+                    printf(" goto %d\n", in->M);
+                }
+                else {
+                    printf(" %s ", binary[in->op - IR_ADD]);
+                    ir_print_operand(ir, in->b, in->bk);
+                    printf("\n");
+                }
         }
     }
 }
 
-void factor(){ 
-    // if token == identsym
-    //      symIdx = SYMBOLTABLECHECK (token)
-    //      if symIdx == -1
-    //          error
-    //      if table[symIdx].kind == 1 (const)
-    //          emit LIT (M = table[symIdx].Value)
-    //      else (var)
-    //          emit LOD (M = table[symIdx].addr)
-    //      get next token
-    // else if token == numbersym
-    //      emit LIT
-    //      get next token
-    // else if token == lparentsym
-    //      get next token
-    //      EXPRESSION
-    //      if token != rparentsym
-    //          error
-    //      get next token
-    // else
-    //      error
+// Runs a lowered program and fills in stats. Returns 0 when the program halts, or 1 after
+// reporting a runtime error.
+int run_ir(const ir_program *ir, const assembly *code, vm_stats *stats) {
+    static const void *handlers[] = {
+        [IR_LOAD] = &&op_load, [IR_STORE] = &&op_store,
+        [IR_ADD] = &&op_add, [IR_SUB] = &&op_sub, [IR_MUL] = &&op_mul, [IR_DIV] = &&op_div,
+        [IR_EQL] = &&op_eql, [IR_NEQ] = &&op_neq, [IR_LSS] = &&op_lss, [IR_LEQ] = &&op_leq,
+        [IR_GTR] = &&op_gtr, [IR_GEQ] = &&op_geq, [IR_ODD] = &&op_odd,
+        [IR_BEQ] = &&op_beq, [IR_BNE] = &&op_bne, [IR_BLT] = &&op_blt, [IR_BLE] = &&op_ble,
+        [IR_BGT] = &&op_bgt, [IR_BGE] = &&op_bge, [IR_BRZ] = &&op_brz, [IR_BEVEN] = &&op_beven,
+        [IR_JMP] = &&op_jmp, [IR_CALL] = &&op_call, [IR_RET] = &&op_ret, [IR_ENTER] = &&op_enter,
+        [IR_WRITE] = &&op_write, [IR_READ] = &&op_read, [IR_HALT] = &&op_halt, [IR_FAIL] = &&op_fail,
+    };
+    typedef struct
+    {
+        const void *handler;
+        int d, a, b, L, M;
+        unsigned char dk, ak, bk;
+    } ir_op;
 
-    
-    if (global_tkn_list.token == 2) { 
-        int temp_idx = symbol_table_check();
-        if (temp_idx == -1)
-            error(7);
-        if (global_sym_table.table[temp_idx].kind == 1){
-            emit(1, 0, global_sym_table.table[temp_idx].val);
-        }
-        else
-            emit(3, global_sym_table.current_level - global_sym_table.table[temp_idx].level, global_sym_table.table[temp_idx].addr);
-        update_tokens(get_next_token());
+    arena prog_mem = {0}, vals_mem = {0}, stack_mem = {0};
+    ir_op *prog = arena_fit(ir->pool, &prog_mem, (size_t) ir->count * sizeof(ir_op));
+    for (int k = 0; k < ir->count; k++) {
+        const ir_instr *in = &ir->code[k];
+        prog[k].handler = handlers[in->op];
+        prog[k].d = in->d;
+        prog[k].a = in->a;
+        prog[k].b = in->b;
+        prog[k].L = in->L;
+        prog[k].M = in->M;
+        prog[k].dk = in->dk;
+        prog[k].ak = in->ak;
+        prog[k].bk = in->bk;
+    }
+    int32_t *v = arena_fit(ir->pool, &vals_mem, (size_t) (ir->value_count + 1) * sizeof(int32_t));
+    memcpy(v, ir->vals, (size_t) ir->value_count * sizeof(int32_t));
+
+    size_t stack_cap = 1 << 16;
+    int32_t *stack = arena_fit(ir->pool, &stack_mem, stack_cap * sizeof(int32_t));
+    long sp = -1, bp = 0, max_sp = -1;
+    long limit = stack_limit(code, ir->pm_count);
+    long reach = largest_frame(code, ir->pm_count); // Kept allocated above the stack top
+    long calls = 0; // Calls that have not returned yet
+    // Operands of kind 0 index the value file and those of kind 1 the current activation record
+    int32_t *bases[2] = { v, stack };
+    unsigned long long executed = 0;
+    int status = 0;
+    const ir_op *ip = prog;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#define IR_RESERVE(n) \
+    do { \
+        if ((size_t) (sp + (n) + reach + 1) >= stack_cap) { \
+            while ((size_t) (sp + (n) + reach + 1) >= stack_cap) \
+                stack_cap *= 2; \
+            stack = arena_fit(ir->pool, &stack_mem, stack_cap * sizeof(int32_t)); \
+            bases[1] = stack + bp; \
+        } \
+    } while (0)
+#define IR_BASE(L, out) \
+    do { \
+        long b_ = bp; \
+        for (int l_ = (L); l_ > 0; l_--) \
+            b_ = stack[b_]; \
+        (out) = b_; \
+    } while (0)
+#define IR_A (bases[ip->ak][ip->a])
+#define IR_B (bases[ip->bk][ip->b])
+#define IR_D (bases[ip->dk][ip->d])
+#define IR_NEXT() do { executed++; goto *ip->handler; } while (0)
+#define IR_BINARY(expr) \
+    do { \
+        int32_t a = IR_A, b = IR_B; \
+        IR_D = (expr); \
+        ip++; \
+        IR_NEXT(); \
+    } while (0)
+#define IR_BRANCH(cond) \
+    do { \
+        int32_t a = IR_A, b = IR_B; \
+        ip = (cond) ? prog + ip->M : ip + 1; \
+        IR_NEXT(); \
+    } while (0)
+
+    IR_NEXT();
+
+op_load: {
+    long base;
+    IR_BASE(ip->L, base);
+    IR_D = stack[base + ip->M];
+    ip++;
+    IR_NEXT();
+}
+op_store: {
+    long base;
+    IR_BASE(ip->L, base);
+    stack[base + ip->M] = IR_A;
+    ip++;
+    IR_NEXT();
+}
+op_add:
+    IR_BINARY((int32_t) ((uint32_t) a + (uint32_t) b));
+op_sub:
+    IR_BINARY((int32_t) ((uint32_t) a - (uint32_t) b));
+op_mul:
+    IR_BINARY((int32_t) ((uint32_t) a * (uint32_t) b));
+op_div:
+    if (IR_B == 0) {
+        printf("Runtime error: division by zero\n");
+        status = 1;
+        goto op_halt;
     }
-    else if (global_tkn_list.token == 3) {
-        emit(1, 0, global_tkn_list.nums[global_tkn_list.num_count]);
-        global_tkn_list.num_count++;
-        update_tokens(get_next_token());
+    IR_BINARY(b == -1 ? (int32_t) (0u - (uint32_t) a) : a / b);
+op_eql:
+    IR_BINARY(a == b);
+op_neq:
+    IR_BINARY(a != b);
+op_lss:
+    IR_BINARY(a < b);
+op_leq:
+    IR_BINARY(a <= b);
+op_gtr:
+    IR_BINARY(a > b);
+op_geq:
+    IR_BINARY(a >= b);
+op_odd:
+    IR_D = IR_A & 1;
+    ip++;
+    IR_NEXT();
+op_beq:
+    IR_BRANCH(a == b);
+op_bne:
+    IR_BRANCH(a != b);
+op_blt:
+    IR_BRANCH(a < b);
+op_ble:
+    IR_BRANCH(a <= b);
+op_bgt:
+    IR_BRANCH(a > b);
+op_bge:
+    IR_BRANCH(a >= b);
+op_brz:
+    ip = IR_A == 0 ? prog + ip->M : ip + 1;
+    IR_NEXT();
+op_beven:
+    ip = (IR_A & 1) == 0 ? prog + ip->M : ip + 1;
+    IR_NEXT();
+op_jmp:
+    ip = prog + ip->M;
+    IR_NEXT();
+op_call: {
+    if (++calls > VM_CALL_DEPTH)
+        goto overflow;
+    long base;
+    IR_BASE(ip->L, base);
+    IR_RESERVE(3);
+    stack[sp + 1] = (int32_t) base; // static link
+    stack[sp + 2] = (int32_t) bp; // dynamic link
+    stack[sp + 3] = ip->d; // return address, as a PM/0 instruction index
+    bp = sp + 1;
+    bases[1] = stack + bp;
+    ip = prog + ip->M;
+    IR_NEXT();
+}
+op_ret: {
+    if (calls-- == 0) // Returning from the main block
+        goto op_halt;
+    int32_t ret = stack[bp + 2];
+    sp = bp - 1;
+    bp = stack[bp + 1];
+    bases[1] = stack + bp;
+    if (ret < 0 || ret > ir->pm_count || ir->start[ret] < 0) {
+        printf("Runtime error: jump to invalid address %d\n", ret * 3);
+        status = 1;
+        goto op_halt;
     }
-    else if (global_tkn_list.token == 15) {
-        update_tokens(get_next_token());
-        expression();
-        if (global_tkn_list.token != 16)
-            error(14);
-        update_tokens(get_next_token());
+    ip = prog + ir->start[ret];
+    IR_NEXT();
+}
+op_enter:
+    if (sp + ip->M > limit)
+        goto overflow;
+    IR_RESERVE(ip->M);
+    sp += ip->M;
+    if (sp > max_sp)
+        max_sp = sp;
+    ip++;
+    IR_NEXT();
+op_write:
+    printf("%d\n", IR_A);
+    ip++;
+    IR_NEXT();
+op_read: {
+    int value;
+    if (scanf("%d", &value) != 1) {
+        printf("Runtime error: expected an integer on input\n");
+        status = 1;
+        goto op_halt;
     }
+    IR_D = value;
+    ip++;
+    IR_NEXT();
+}
+op_fail: {
+    const assembly *in = &code[ip->M];
+    if (in->OP == 5 || in->OP == 7 || in->OP == 8)
+        printf("Runtime error: jump to invalid address %d at address %d\n", in->M, ip->M * 3);
     else
-        error(15);
-}
\ No newline at end of file
+        printf("Runtime error: invalid instruction %d %d %d at address %d\n", in->OP, in->L, in->M, ip->M * 3);
+    status = 1;
+    goto op_halt;
+}
+overflow:
+    printf("Runtime error: stack overflow\n");
+    status = 1;
+op_halt:
+#undef IR_RESERVE
+#undef IR_BASE
+#undef IR_A
+#undef IR_B
+#undef IR_D
+#undef IR_NEXT
+#undef IR_BINARY
+#undef IR_BRANCH
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->executed = executed;
+    stats->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    stats->max_stack = max_sp + 1;
+    stats->native_bytes = 0;
+    arena_free(&stack_mem);
+    arena_free(&vals_mem);
+    arena_free(&prog_mem);
+    return status;
+}